@@ -1,7 +1,7 @@
 #include "app.h"
+#include "logger.h"
 
 #include <algorithm>
-#include <iostream>
 
 #ifdef __linux__
 #include <poll.h>
@@ -12,30 +12,416 @@
 
 using namespace std;
 
-app::ClientApp::ClientApp(const ip::sockaddr& laddr, const ip::sockaddr& raddr,
-                          const uint64_t testDurationSec, const func_t cb,
-                          const ts::TSDescriptor& tsd,
-                          const uint16_t numDrivers, const MsgSize msgSize,
-                          const uint32_t sndBufSize) :
-    testDurationSec(testDurationSec),
+// A unix socket client has nothing to bind to
+static ip::sockaddr
+app_localAddr(const ip::sockaddr& laddr, const ip::sockaddr& raddr)
+{
+    if (!raddr.isUnix())
+        return laddr;
+
+    ip::sockaddr addr;
+    addr.un.sun_family = AF_UNIX;
+    addr.sa_len = sizeof(sa_family_t);
+    return addr;
+}
+
+// Without a cool-down window the bytes sent after the steady-state window
+// are only what was in flight when the test stopped
+static void
+app_moveTail(results::ConnResult& res)
+{
+    res.tailBytes += res.cooldownBytes;
+    res.cooldownBytes = 0;
+}
+
+static void
+app_addRTTMetrics(results::Report& report, const string& prefix,
+                  const stats::Histogram& rtt)
+{
+    report.addMetric(prefix + ".samples", rtt.count);
+    report.addMetric(prefix + ".min_us", rtt.percentile(0) / 1e3);
+    report.addMetric(prefix + ".mean_us", rtt.mean() / 1e3);
+    report.addMetric(prefix + ".p50_us", rtt.percentile(50) / 1e3);
+    report.addMetric(prefix + ".p90_us", rtt.percentile(90) / 1e3);
+    report.addMetric(prefix + ".p99_us", rtt.percentile(99) / 1e3);
+    report.addMetric(prefix + ".p999_us", rtt.percentile(99.9) / 1e3);
+    report.addMetric(prefix + ".max_us", rtt.percentile(100) / 1e3);
+}
+
+// The stages that have samples
+static void
+app_addTimestampMetrics(results::Report& report,
+                        const app::TimestampStats& stamps)
+{
+    for (auto& stage : app::timestampStages)
+    {
+        const stats::Histogram& hist = stamps.*stage.hist;
+        if (hist.count)
+            app_addRTTMetrics(report, string("tstamp_") + stage.name, hist);
+    }
+}
+
+app::Destination::Destination(const ip::sockaddr& raddr,
+                              const uint16_t numConns, const uint32_t weight,
+                              const ts::TSDescriptor& tsd) :
+    raddr(raddr),
+    numConns(numConns),
+    weight(weight),
+    tsd(tsd),
+    ctrlSock(NULL),
+    sessionId(0)
+{
+}
+
+string
+app::Destination::toString() const
+{
+    if (raddr.isUnix())
+        return raddr.toString();
+
+    uint16_t port = ntohs((raddr.sa.sa_family == AF_INET6) ?
+                          raddr.ipv6.sin6_port : raddr.ipv4.sin_port);
+    if (raddr.sa.sa_family == AF_INET6)
+        return "[" + raddr.toString() + "]:" + to_string(port);
+    return raddr.toString() + ":" + to_string(port);
+}
+
+results::ConnResult
+app::Destination::result(bool tx) const
+{
+    results::ConnResult res = {toString(), raddr.toString(), 0, 0,
+                               stats::CPUStats()};
+    for (auto driver : drivers)
+    {
+        res.durationSec = max(res.durationSec, driver->steadySec());
+        // Like the connections, the CPU goes with the send direction
+        if (tx || !clientSends(driver->mode))
+            res.cpu += driver->cpu.result;
+        if (tx)
+        {
+            res.bytes += driver->steadyBytes();
+            res.warmupBytes += driver->steadyStart.bytes;
+            res.cooldownBytes += driver->sentBytes - driver->steadyEnd.bytes;
+            res.retransmits += driver->retransmits;
+            res.hasPeer = driver->peerValid;
+            res.peerBytes += driver->peerBytes;
+            res.peerDurationSec = max(res.peerDurationSec,
+                                      driver->peerDurationSec);
+        }
+        else
+        {
+            res.bytes += driver->steadyRecvBytes();
+            res.warmupBytes += driver->steadyStart.recvBytes;
+            res.cooldownBytes += driver->bytesReceived -
+                                 driver->steadyEnd.recvBytes;
+        }
+    }
+
+    return res;
+}
+
+app::Destination
+app::parseDestination(const string& str)
+{
+    stringstream ss(str);
+    string addr, opt;
+    getline(ss, addr, ',');
+
+    uint16_t port = 0;
+    if (addr.empty() || addr[0] != '/')
+    {
+        size_t pos = addr.rfind(':');
+        if (pos == string::npos || pos == addr.size() - 1)
+            throw std::invalid_argument(ERRSTR("Destination needs a port"));
+        port = stoi(addr.substr(pos + 1));
+        addr = addr.substr(0, pos);
+        if (addr.size() > 1 && addr.front() == '[' && addr.back() == ']')
+            addr = addr.substr(1, addr.size() - 2);
+    }
+
+    Destination dest(ip::sockaddr(addr, port));
+    while (getline(ss, opt, ','))
+    {
+        size_t pos = opt.find('=');
+        string key = opt.substr(0, pos);
+        string value = (pos == string::npos) ? "" : opt.substr(pos + 1);
+        if (value.empty())
+            throw std::invalid_argument(ERRSTR("Destination option needs "
+                                               "a value"));
+
+        if (key == "conns")
+            dest.numConns = stoi(value);
+        else if (key == "weight")
+            dest.weight = stoi(value);
+        else if (key == "rate")
+            dest.tsd = {"rate-limit", value};
+        else
+            throw std::invalid_argument(ERRSTR("Unknown destination option"));
+    }
+
+    if (!dest.weight)
+        throw std::invalid_argument(ERRSTR("Destination weight must be "
+                                           "non-zero"));
+    return dest;
+}
+
+std::vector<app::CongestionShare>
+app::parseCongestionMix(const string& str)
+{
+    std::vector<CongestionShare> mix;
+    stringstream ss(str);
+    string entry;
+    while (getline(ss, entry, ','))
+    {
+        stringstream es(entry);
+        CongestionShare share = {"", 0};
+        string rest;
+        if (!(es >> share.numConns >> share.algo) || (es >> rest) ||
+            !share.numConns)
+            throw std::invalid_argument(ERRSTR("Malformed congestion control "
+                                               "mix"));
+        for (auto& other : mix)
+        {
+            if (other.algo == share.algo)
+                throw std::invalid_argument(ERRSTR("Congestion control "
+                                                   "algorithm listed twice"));
+        }
+        mix.push_back(share);
+    }
+
+    return mix;
+}
+
+app::ClientConfig::ClientConfig() :
+    testDurationSec(0),
+    warmupSec(0),
+    cooldownSec(0),
+    tsd({"noop", ""}),
+    numDrivers(1),
+    msgSize(large),
+    sndBufSize(0),
+    rcvBufSize(0),
+    useControl(true),
+    mode(forward),
+    transport(transportTCP),
+    gsoSegments(0),
+    probeConfig(),
+    idleConfig(),
+    timestamping(0),
+    busyPollUs(0),
+    framing(framingPacked),
+    zeroCopy(false)
+{
+}
+
+app::ClientApp::ClientApp(const app::SourceConfig& sources,
+                          const std::vector<app::Destination>& dests,
+                          const func_t cb, const app::ClientConfig& config) :
+    testDurationSec(config.testDurationSec),
+    warmupSec(config.warmupSec),
+    cooldownSec(config.cooldownSec),
     totalBytesSent(0),
+    warmupBytes(0),
+    steadyBytes(0),
+    cooldownBytes(0),
+    steadySec(0),
+    steadyThroughput(0),
+    mode(config.mode),
+    totalBytesReceived(0),
+    steadyRecvBytes(0),
+    steadyRecvThroughput(0),
 	cb(cb),
-    tsd(tsd)
+    tsd(config.tsd),
+    dests(dests),
+    useControl(config.useControl),
+    totalPeerBytes(0),
+    peerGoodput(0),
+    transport(config.transport),
+    totalPacketsSent(0),
+    steadyPacketRate(0),
+    totalPeerPackets(0),
+    lostPackets(0),
+    reorderedPackets(0),
+    sourcePool(NULL),
+    connectFailures(0),
+    idleConfig(config.idleConfig),
+    idleConnected(0),
+    idleMessages(0),
+    idleSendStalls(0),
+    idleLost(0),
+    ccMix(config.ccMix),
+    totalRetransmits(0),
+    rcvBufSize(config.rcvBufSize),
+    replayTrace(NULL),
+    replayMsgs(0),
+    replayUnfinished(0),
+    timestamping(config.timestamping),
+    busyPollUs(config.busyPollUs),
+    spinHits(0),
+    spinMisses(0),
+    framing(config.framing),
+    zeroCopy(config.zeroCopy),
+    zeroCopyBytes(0),
+    probeConfig(config.probeConfig)
 {
     if (!testDurationSec)
         throw std::runtime_error(ERRSTR("Need a non-zero test duration"));
-    if (!numDrivers)
-        throw std::runtime_error(ERRSTR("Need at least 1 driver"));
+    if (dests.empty())
+        throw std::runtime_error(ERRSTR("Need at least 1 destination"));
+    if (sources.addrs.empty())
+        throw std::runtime_error(ERRSTR("Need at least 1 source address"));
+    const ip::sockaddr& localAddr = sources.addrs.front();
+    // Only a data Hello can tell the server to send
+    if (mode != forward && !useControl)
+        throw std::runtime_error(ERRSTR("Reverse and bidirectional modes "
+                                        "need the control channel"));
+    // Only a server that knows the control protocol echoes probes
+    if (probeConfig.numProbes && !useControl)
+        throw std::runtime_error(ERRSTR("Latency probes need the control "
+                                        "channel"));
+    // Datagrams only go one way, and the server only learns about a UDP
+    // session from the control channel
+    if (transport == transportUDP && (!useControl || mode != forward))
+        throw std::runtime_error(ERRSTR("UDP needs the control channel and "
+                                        "the forward mode"));
+    if (config.gsoSegments && transport != transportUDP)
+        throw std::runtime_error(ERRSTR("GSO is only supported with UDP"));
+    // The server learns about idle connections from the control channel
+    if (idleConfig.intervalMs &&
+        (!useControl || mode != forward || transport != transportTCP))
+        throw std::runtime_error(ERRSTR("Idle mode needs the control channel, "
+                                        "the forward mode and TCP"));
+    // Only the control channel can tell the servers
+    if (rcvBufSize && !useControl)
+        throw std::runtime_error(ERRSTR("The server's receive buffer size "
+                                        "needs the control channel"));
+    // Congestion control is up to the sender, and only TCP has it
+    if (!ccMix.empty() && (!clientSends(mode) || transport != transportTCP ||
+                           idleConfig.intervalMs))
+        throw std::runtime_error(ERRSTR("A congestion control mix needs TCP "
+                                        "and the client to send"));
+    // The trace stands in for the stream of a forward connection
+    if (!config.replayPath.empty() &&
+        (mode != forward || transport == transportUDP || idleConfig.intervalMs))
+        throw std::runtime_error(ERRSTR("Replay needs the forward mode and a "
+                                        "stream transport"));
+    // Only the TCP stack stamps the data
+    if (timestamping && (transport != transportTCP || idleConfig.intervalMs))
+        throw std::runtime_error(ERRSTR("Timestamping needs TCP"));
+    // An idle driver serves many connections from one thread, it can't spin
+    // on any of them
+    if (busyPollUs && idleConfig.intervalMs)
+        throw std::runtime_error(ERRSTR("Busy polling is not supported in "
+                                        "idle mode"));
+    // The framing is in the data Hello, and the replayed blocks are of any
+    // size
+    if (framing == framingAligned &&
+        (!useControl || transport == transportUDP || idleConfig.intervalMs ||
+         !config.replayPath.empty()))
+        throw std::runtime_error(ERRSTR("Page-aligned framing needs the "
+                                        "control channel and a stream "
+                                        "transport, and no replay"));
+    if (framing == framingAligned && config.msgSize % TRAFFIC_FRAME_ALIGN)
+        throw std::runtime_error(ERRSTR("Page-aligned framing needs a "
+                                        "message size of whole pages"));
+    // Only TCP sockets can be mapped
+    if (zeroCopy && (mode == forward || transport != transportTCP ||
+                     idleConfig.intervalMs))
+        throw std::runtime_error(ERRSTR("Zero-copy receive needs TCP and the "
+                                        "client to receive"));
+    bool sameHost = transport == transportUnix || transport == transportShm;
+    for (auto& dest : dests)
+    {
+        if (sameHost != dest.raddr.isUnix())
+            throw std::runtime_error(ERRSTR("The unix and shm transports need "
+                                            "a unix socket path, and only "
+                                            "them"));
+    }
+    assignConns(config.numDrivers);
+    std::vector<string> algos;
+    for (auto& share : ccMix)
+        algos.insert(algos.end(), share.numConns, share.algo);
+    uint32_t totalConns = 0;
+    for (auto& dest : this->dests)
+        totalConns += dest.numConns;
+    if (!ccMix.empty() && algos.size() != totalConns)
+        throw std::runtime_error(ERRSTR("The congestion control mix has to "
+                                        "cover every connection"));
+    if (!sameHost)
+        sourcePool = new SourcePool(sources);
 
     try
     {
-        int i;
-        for (i = 0; i < numDrivers; i++)
+        if (!config.replayPath.empty())
+            replayTrace = new ReplayTrace(config.replayPath, totalConns);
+
+        for (auto& dest : this->dests)
         {
-            string name = "Driver-" + to_string(i);
-            TrafficDriver* driver = new TrafficDriver(name, laddr, raddr, tsd,
-                                                      msgSize, sndBufSize);
-            drivers.push_back(driver);
+            if (useControl)
+                openSession(app_localAddr(localAddr, dest.raddr), dest,
+                            config.msgSize);
+        }
+
+        // The probes start measuring the baseline as soon as they connect.
+        // They all go to the first destination.
+        const ip::sockaddr& probeAddr = this->dests.front().raddr;
+        for (int i = 0; i < probeConfig.numProbes; i++)
+        {
+            string name = "Probe-" + to_string(i);
+            probes.push_back(new LatencyProbe(name,
+                                              app_localAddr(localAddr,
+                                                            probeAddr),
+                                              probeAddr, probeConfig,
+                                              transport, busyPollUs));
+        }
+
+        // Connection indexes are per destination, as is the session
+        int i = 0;
+        for (auto& dest : this->dests)
+        {
+            ip::sockaddr laddr = app_localAddr(localAddr, dest.raddr);
+            DriverConfig driverConfig;
+            driverConfig.tsd = (dest.tsd.name.empty()) ? tsd : dest.tsd;
+            driverConfig.msgSize = config.msgSize;
+            driverConfig.sndBufSize = config.sndBufSize;
+            driverConfig.gate = &gate;
+            driverConfig.sessionId = dest.sessionId;
+            driverConfig.mode = mode;
+            driverConfig.transport = transport;
+            driverConfig.sources = sourcePool;
+            driverConfig.replay = replayTrace;
+            driverConfig.timestamping = timestamping;
+            driverConfig.busyPollUs = busyPollUs;
+            driverConfig.framing = framing;
+            driverConfig.zeroCopy = zeroCopy;
+            // An idle driver takes a whole group of connections
+            for (uint32_t idx = 0; idx < dest.numConns && idleConfig.intervalMs;
+                 idx += IDLE_CONNS_PER_DRIVER, i++)
+            {
+                uint32_t numConns = min((uint32_t) IDLE_CONNS_PER_DRIVER,
+                                        dest.numConns - idx);
+                TrafficDriver* driver =
+                    new IdleDriver("IdleDriver-" + to_string(i), idx, numConns,
+                                   laddr, dest.raddr, driverConfig, idleConfig);
+                drivers.push_back(driver);
+                dest.drivers.push_back(driver);
+            }
+            for (uint32_t idx = 0; idx < dest.numConns && !idleConfig.intervalMs;
+                 idx++, i++)
+            {
+                string name = "Driver-" + to_string(i);
+                driverConfig.congestion = (algos.empty()) ? "" : algos[i];
+                driverConfig.replayFlow = i;
+                TrafficDriver* driver;
+                if (transport == transportUDP)
+                    driver = new UDPDriver(name, idx, laddr, dest.raddr,
+                                           driverConfig, config.gsoSegments);
+                else
+                    driver = new TrafficDriver(name, idx, laddr, dest.raddr,
+                                               driverConfig);
+                drivers.push_back(driver);
+                dest.drivers.push_back(driver);
+            }
         }
 
         manageDrivers();
@@ -55,63 +441,702 @@ app::ClientApp::~ClientApp()
 void
 app::ClientApp::cleanup()
 {
+    // Drivers still waiting to start have to be let go before they can stop
+    gate.open();
+    for (auto& dest : dests)
+        dest.drivers.clear();
     while (!drivers.empty())
     {
         auto driver = drivers.back();
         drivers.pop_back();
         delete driver;
     }
+
+    while (!probes.empty())
+    {
+        auto probe = probes.back();
+        probes.pop_back();
+        delete probe;
+    }
+
+    for (auto& dest : dests)
+    {
+        delete dest.ctrlSock;
+        dest.ctrlSock = NULL;
+    }
+
+    delete sourcePool;
+    sourcePool = NULL;
+    delete replayTrace;
+    replayTrace = NULL;
+}
+
+// Destinations without a connection count of their own share numDrivers by
+// weight, largest remainder first. Each of them gets at least one.
+void
+app::ClientApp::assignConns(const uint16_t numDrivers)
+{
+    uint64_t totalWeight = 0;
+    for (auto& dest : dests)
+    {
+        if (!dest.numConns)
+            totalWeight += dest.weight;
+    }
+    if (!totalWeight)
+        return;
+
+    std::vector<std::pair<uint64_t, Destination*>> remainders;
+    uint32_t assigned = 0;
+    for (auto& dest : dests)
+    {
+        if (dest.numConns)
+            continue;
+
+        uint64_t share = (uint64_t) numDrivers * dest.weight;
+        dest.numConns = share / totalWeight;
+        assigned += dest.numConns;
+        remainders.push_back({share % totalWeight, &dest});
+    }
+
+    std::stable_sort(remainders.begin(), remainders.end(),
+                     [](const std::pair<uint64_t, Destination*>& a,
+                        const std::pair<uint64_t, Destination*>& b)
+                     { return a.first > b.first; });
+    for (auto& rem : remainders)
+    {
+        if (assigned < numDrivers)
+        {
+            rem.second->numConns++;
+            assigned++;
+        }
+        if (!rem.second->numConns)
+            rem.second->numConns = 1;
+    }
+}
+
+void
+app::ClientApp::openSession(const ip::sockaddr& laddr,
+                            app::Destination& dest, const MsgSize msgSize)
+{
+    dest.ctrlSock = new tcp::Socket(laddr);
+    tcp::Socket* ctrlSock = dest.ctrlSock;
+    ctrlSock->connect(dest.raddr);
+    ctrlSock->setNagle(false);
+#ifdef __APPLE__
+    ctrlSock->setNoSIGPIPE();
+#endif
+
+    ctrl::Hello hello = ctrl::makeHello(ctrl::control);
+    hello.numConns = dest.numConns;
+    hello.msgSize = msgSize;
+    hello.durationSec = warmupSec + testDurationSec + cooldownSec;
+    hello.mode = mode;
+    hello.transport = transport;
+    hello.idleIntervalMs = idleConfig.intervalMs;
+    hello.rcvBufSize = rcvBufSize;
+
+    struct iovec iov;
+    iov.iov_base = &hello;
+    iov.iov_len  = sizeof(hello);
+    ctrlSock->writeBlock(&iov, 1, sizeof(hello));
+
+    ctrl::MsgHeader hdr = ctrl::recvHeader(ctrlSock, ctrl::ack);
+    ctrl::Ack ack;
+    if (hdr.len != sizeof(ack))
+        throw std::runtime_error(ERRSTR("Malformed control ack"));
+    ctrl::recvAll(ctrlSock, &ack, sizeof(ack));
+    if (ack.status != ctrl::ok)
+        throw std::runtime_error(ERRSTR("Server rejected the test"));
+
+    dest.sessionId = ack.sessionId;
+    LOG_INFO("Control session " << dest.sessionId << " established with "
+             << dest.toString());
+}
+
+// Asks the server what it received on every data connection. The drivers
+// have stopped and shut their sockets down by now.
+void
+app::ClientApp::closeSession(app::Destination& dest)
+{
+    ctrl::sendMsg(dest.ctrlSock, ctrl::stop);
+    std::vector<ctrl::ConnReport> reports = ctrl::recvResults(dest.ctrlSock,
+                                                              dest.numConns);
+    // The server only reports what it received
+    if (!clientSends(mode))
+        return;
+
+    for (auto driver : dest.drivers)
+    {
+        if (idleConfig.intervalMs)
+        {
+            static_cast<IdleDriver *>(driver)->addPeerReports(reports);
+            totalPeerBytes += driver->peerBytes;
+            peerGoodput += driver->peerGoodput();
+            LOG_INFO(driver->name << " sent " << driver->sentBytes
+                     << " bytes, receiver got " << driver->peerBytes
+                     << " bytes");
+            continue;
+        }
+        if (driver->index >= reports.size() || driver->connectFailed)
+            continue;
+
+        const ctrl::ConnReport& report = reports[driver->index];
+        driver->peerValid = true;
+        driver->peerBytes = report.bytes;
+        driver->peerDurationSec = report.durationNs / 1e9;
+        if (!report.completed)
+            LOG_WARN(driver->name << ": receiver had not drained the data");
+
+        totalPeerBytes += driver->peerBytes;
+        peerGoodput += driver->peerGoodput();
+
+        string goodput = (driver->peerGoodput()) ?
+            formatThroughput(driver->peerGoodput()) : "0 bps";
+        LOG_INFO(driver->name << " sent " << driver->sentBytes
+                 << " bytes, receiver got " << driver->peerBytes << " bytes in "
+                 << driver->peerDurationSec << " sec, goodput " << goodput);
+
+        if (transport != transportUDP)
+            continue;
+
+        UDPDriver* udpDriver = static_cast<UDPDriver *>(driver);
+        udpDriver->peerPackets = report.packets;
+        udpDriver->peerReordered = report.reordered;
+        totalPeerPackets += report.packets;
+        lostPackets += udpDriver->lostPackets();
+        reorderedPackets += report.reordered;
+        LOG_INFO(driver->name << " sent " << udpDriver->sentPackets
+                 << " datagrams, " << udpDriver->lostPackets() << " lost, "
+                 << report.reordered << " reordered");
+    }
 }
 
 void
 app::ClientApp::manageDrivers()
 {
-    this_thread::sleep_for(chrono::seconds(testDurationSec));
+    // Only start sending once every connection is up
+    gate.waitReady(drivers.size());
+    // Nothing is sent before the start, the servers hold their senders back
+    // until then too, so the baseline is of the idle path in every mode
+    if (!probes.empty())
+    {
+        LOG_INFO("Measuring the unloaded latency for "
+                 << probeConfig.baselineSec << " sec");
+        this_thread::sleep_for(chrono::seconds(probeConfig.baselineSec));
+        setProbePhase(probeIdle);
+    }
+    for (auto& dest : dests)
+    {
+        if (dest.ctrlSock)
+            ctrl::sendMsg(dest.ctrlSock, ctrl::start);
+    }
+    gate.open();
+
+    // Sample the aggregate rate once a second, for each direction that
+    // carries traffic. The driver counters are read without synchronizing
+    // with the driver threads.
+    monotime_t start = tsc::FastClock::now();
+    monotime_t last = start;
+    uint64_t lastBytes = 0, lastRecvBytes = 0;
+    string tx = (mode == forward) ? "" : "tx";
+    uint64_t steadyEndSec = warmupSec + testDurationSec;
+    if (!warmupSec)
+    {
+        markDrivers(&TrafficDriver::steadyStart);
+        setProbePhase(probeLoaded);
+    }
+    for (uint64_t i = 1; i <= steadyEndSec + cooldownSec; i++)
+    {
+        this_thread::sleep_until(start + chrono::seconds(i));
+
+        // Mark the window boundaries first thing after waking up
+        if (i == warmupSec)
+        {
+            markDrivers(&TrafficDriver::steadyStart);
+            setProbePhase(probeLoaded);
+        }
+        if (i == steadyEndSec)
+        {
+            markDrivers(&TrafficDriver::steadyEnd);
+            setProbePhase(probeIdle);
+        }
+
+        monotime_t now = tsc::FastClock::now();
+        uint64_t bytes = 0, recvBytes = 0;
+        for (auto driver : drivers)
+        {
+            bytes += driver->sentBytes;
+            recvBytes += driver->bytesReceived;
+        }
+
+        chrono::duration<double> elapsed = now - start;
+        chrono::duration<double> interval = now - last;
+        if (clientSends(mode))
+            samples.push_back({elapsed.count(), interval.count(),
+                               bytes - lastBytes, tx});
+        if (mode != forward)
+            samples.push_back({elapsed.count(), interval.count(),
+                               recvBytes - lastRecvBytes, "rx"});
+        last = now;
+        lastBytes = bytes;
+        lastRecvBytes = recvBytes;
+    }
+
     for (auto driver : drivers)
     {
         driver->stopTraffic();
         totalBytesSent += driver->sentBytes;
+        totalCPU += driver->cpu.result;
+
+        warmupBytes += driver->steadyStart.bytes;
+        steadyBytes += driver->steadyBytes();
+        cooldownBytes += driver->sentBytes - driver->steadyEnd.bytes;
+        steadySec = max(steadySec, driver->steadySec());
+        steadyThroughput += driver->steadyThroughput();
+
+        totalBytesReceived += driver->bytesReceived;
+        steadyRecvBytes += driver->steadyRecvBytes();
+        steadyRecvThroughput += driver->steadyRecvThroughput();
+
+        connectFailures += driver->connectFailed;
+        totalRetransmits += driver->retransmits;
+        if (driver->stamper)
+            stamps.merge(driver->stamper->stats);
+        spinHits += driver->spinHits;
+        spinMisses += driver->spinMisses;
+        zeroCopyBytes += driver->zeroCopyBytes;
+        if (replayTrace)
+        {
+            replayLateness.merge(driver->replayLateness);
+            replayMsgs += driver->replayMsgs;
+            replayUnfinished += !driver->replayDone && !driver->connectFailed;
+        }
+        if (idleConfig.intervalMs)
+        {
+            IdleDriver* idleDriver = static_cast<IdleDriver *>(driver);
+            connectFailures += idleDriver->connectFailures;
+            idleConnected += idleDriver->numConnected;
+            idleMessages += idleDriver->messagesSent;
+            idleSendStalls += idleDriver->sendStalls;
+            idleLost += idleDriver->numLost;
+        }
+
+        if (transport == transportUDP)
+        {
+            UDPDriver* udpDriver = static_cast<UDPDriver *>(driver);
+            totalPacketsSent += udpDriver->sentPackets;
+            steadyPacketRate += udpDriver->steadyPacketRate();
+        }
+    }
+    LOG_INFO("All Drivers completed");
+    if (sourcePool)
+    {
+        for (auto source : sourcePool->sources)
+            LOG_INFO("Source " << source->statsString());
+    }
+
+    for (auto probe : probes)
+    {
+        probe->stopTraffic();
+        baselineRTT.merge(probe->baselineRTT);
+        loadedRTT.merge(probe->loadedRTT);
+        probeCPU += probe->cpu.result;
+        spinHits += probe->spinHits;
+        spinMisses += probe->spinMisses;
+    }
+
+    for (auto& dest : dests)
+    {
+        if (dest.ctrlSock)
+            closeSession(dest);
     }
-	cout << "All Drivers completed\n";
-	cb();
+
+    cb();
 }
 
-app::ServerApp::ServerApp(const ip::sockaddr& addr, const uint64_t rcvBufSize,
-                          const uint16_t backlog) :
+void
+app::ClientApp::markDrivers(app::ByteMark app::TrafficDriver::* byteMark)
+{
+    for (auto driver : drivers)
+        driver->mark(driver->*byteMark);
+}
+
+void
+app::ClientApp::setProbePhase(app::ProbePhase phase)
+{
+    for (auto probe : probes)
+        probe->phase = phase;
+}
+
+void
+app::ClientApp::fillReport(results::Report& report) const
+{
+    // One row per direction. A connection's CPU cost goes with its send
+    // direction, if it has one.
+    string tx = (mode == forward) ? "" : "tx";
+    for (auto driver : drivers)
+    {
+        if (clientSends(mode))
+        {
+            uint64_t cooldown = driver->sentBytes - driver->steadyEnd.bytes;
+            report.conns.push_back({driver->name, driver->raddr.toString(),
+                                    driver->steadyBytes(), driver->steadySec(),
+                                    driver->cpu.result, driver->peerValid,
+                                    driver->peerBytes, driver->peerDurationSec,
+                                    driver->steadyStart.bytes, cooldown, tx,
+                                    driver->retransmits});
+        }
+        if (mode != forward)
+        {
+            uint64_t cooldown = driver->bytesReceived -
+                                driver->steadyEnd.recvBytes;
+            stats::CPUStats cpu = (clientSends(mode)) ?
+                stats::CPUStats() : driver->cpu.result;
+            report.conns.push_back({driver->name, driver->raddr.toString(),
+                                    driver->steadyRecvBytes(),
+                                    driver->steadySec(), cpu, false, 0, 0,
+                                    driver->steadyStart.recvBytes, cooldown,
+                                    "rx"});
+        }
+    }
+
+    report.total.bytes = steadyBytes;
+    report.total.durationSec = steadySec;
+    report.total.warmupBytes = warmupBytes;
+    report.total.cooldownBytes = cooldownBytes;
+    report.total.cpu = totalCPU;
+    report.total.retransmits = totalRetransmits;
+    if (!clientSends(mode))
+    {
+        report.total.bytes = steadyRecvBytes;
+        report.total.warmupBytes = 0;
+        report.total.cooldownBytes = totalBytesReceived - steadyRecvBytes;
+        report.total.direction = "rx";
+    }
+    report.samples = samples;
+    report.addMetric("steady_throughput_bps", steadyThroughput);
+    if (mode != forward)
+    {
+        report.addMetric("recv_bytes", totalBytesReceived);
+        report.addMetric("steady_recv_bytes", steadyRecvBytes);
+        report.addMetric("steady_recv_throughput_bps", steadyRecvThroughput);
+    }
+    if (!probes.empty())
+    {
+        app_addRTTMetrics(report, "probe_baseline", baselineRTT);
+        app_addRTTMetrics(report, "probe_loaded", loadedRTT);
+        report.addMetric("probe_added_p99_us",
+                         ((double) loadedRTT.percentile(99) -
+                          (double) baselineRTT.percentile(99)) / 1000);
+        report.addMetric("probe_cpu_sec", probeCPU.cpuSec);
+    }
+    if (busyPollUs)
+    {
+        report.addMetric("busy_poll_us", busyPollUs);
+        report.addMetric("busy_poll_spin_hits", spinHits);
+        report.addMetric("busy_poll_spin_misses", spinMisses);
+    }
+    if (zeroCopy)
+    {
+        report.addMetric("zerocopy_recv_bytes", zeroCopyBytes);
+        report.addMetric("zerocopy_recv_pct", (totalBytesReceived) ?
+                         100.0 * zeroCopyBytes / totalBytesReceived : 0);
+    }
+    if (replayTrace)
+    {
+        report.addMetric("replay_messages", replayMsgs);
+        report.addMetric("replay_unfinished_conns", replayUnfinished);
+        app_addRTTMetrics(report, "replay_lateness", replayLateness);
+    }
+    if (timestamping)
+        app_addTimestampMetrics(report, stamps);
+    if (dests.size() > 1)
+    {
+        for (auto& dest : dests)
+        {
+            if (clientSends(mode))
+            {
+                results::ConnResult res = dest.result(true);
+                res.direction = tx;
+                report.groups.push_back(res);
+            }
+            if (mode != forward)
+            {
+                results::ConnResult res = dest.result(false);
+                res.direction = "rx";
+                report.groups.push_back(res);
+            }
+        }
+    }
+    if (useControl && clientSends(mode))
+    {
+        report.total.hasPeer = true;
+        report.total.peerBytes = totalPeerBytes;
+        for (auto driver : drivers)
+            report.total.peerDurationSec = max(report.total.peerDurationSec,
+                                               driver->peerDurationSec);
+        report.addMetric("conn_goodput_sum_bps", peerGoodput);
+    }
+    report.addMetric("connect_failures", connectFailures);
+    if (transport == transportTCP)
+        report.addMetric("retransmits", totalRetransmits);
+    if (!ccMix.empty())
+    {
+        for (auto& share : ccMix)
+        {
+            results::ConnResult res = ccResult(share.algo);
+            string prefix = "cc." + share.algo;
+            report.addMetric(prefix + ".connections", share.numConns);
+            report.addMetric(prefix + ".throughput_bps", res.throughput());
+            report.addMetric(prefix + ".retransmits", res.retransmits);
+            report.addMetric(prefix + ".fairness", fairness(share.algo));
+            report.groups.push_back(res);
+        }
+        report.addMetric("fairness", fairness());
+    }
+    if (idleConfig.intervalMs)
+    {
+        report.addMetric("idle_connections", idleConnected);
+        report.addMetric("idle_messages", idleMessages);
+        report.addMetric("idle_send_stalls", idleSendStalls);
+        report.addMetric("idle_lost", idleLost);
+    }
+    if (sourcePool)
+    {
+        for (auto source : sourcePool->sources)
+        {
+            string prefix = "source." + source->addr.toString();
+            report.addMetric(prefix + ".connects", source->connects);
+            report.addMetric(prefix + ".failures", source->failures);
+            report.addMetric(prefix + ".connects_per_sec",
+                             source->connectRate());
+            if (source->connects)
+            {
+                report.addMetric(prefix + ".connect_p50_us",
+                                 source->connectTime.percentile(50) / 1e3);
+                report.addMetric(prefix + ".connect_p99_us",
+                                 source->connectTime.percentile(99) / 1e3);
+            }
+        }
+    }
+    if (transport == transportUDP)
+    {
+        report.addMetric("packets_sent", totalPacketsSent);
+        report.addMetric("steady_packets_per_sec", steadyPacketRate);
+        report.addMetric("peer_packets", totalPeerPackets);
+        report.addMetric("lost_packets", lostPackets);
+        report.addMetric("loss_pct", lossPct());
+        report.addMetric("reordered_packets", reorderedPackets);
+    }
+    if (!cooldownSec)
+    {
+        app_moveTail(report.total);
+        for (auto& conn : report.conns)
+            app_moveTail(conn);
+        for (auto& group : report.groups)
+            app_moveTail(group);
+    }
+}
+
+double
+app::ClientApp::lossPct() const
+{
+    return (totalPacketsSent) ? lostPackets * 100.0 / totalPacketsSent : 0;
+}
+
+results::ConnResult
+app::ClientApp::ccResult(const string& algo) const
+{
+    results::ConnResult res = {algo, "", 0, 0, stats::CPUStats()};
+    for (auto driver : drivers)
+    {
+        if (driver->congestion != algo)
+            continue;
+
+        res.bytes += driver->steadyBytes();
+        res.durationSec = max(res.durationSec, driver->steadySec());
+        res.cpu += driver->cpu.result;
+        res.warmupBytes += driver->steadyStart.bytes;
+        res.cooldownBytes += driver->sentBytes - driver->steadyEnd.bytes;
+        res.retransmits += driver->retransmits;
+        res.hasPeer = driver->peerValid;
+        res.peerBytes += driver->peerBytes;
+        res.peerDurationSec = max(res.peerDurationSec,
+                                  driver->peerDurationSec);
+    }
+    res.direction = (mode == forward) ? "" : "tx";
+
+    return res;
+}
+
+double
+app::ClientApp::fairness(const string& algo) const
+{
+    std::vector<double> shares;
+    for (auto driver : drivers)
+    {
+        if (driver->connectFailed)
+            continue;
+        if (algo.empty() || driver->congestion == algo)
+            shares.push_back(driver->steadyThroughput());
+    }
+
+    return stats::jainIndex(shares);
+}
+
+app::Listener::Listener(const std::string& name, const ip::sockaddr& addr) :
+    name(name),
     sock(addr),
+    accepts(0),
+    wakeups(0),
+    maxBatch(0),
+    acceptErrors(0),
+    unloggedErrors(0)
+{
+#ifdef __APPLE__
+    kq = kqueue();
+    if (kq == -1)
+        throw std::runtime_error(ERRSTR("Error in kqueue()"));
+#endif
+}
+
+app::Listener::~Listener()
+{
+#ifdef __APPLE__
+    close(kq);
+#endif
+}
+
+double
+app::Listener::acceptRate() const
+{
+    chrono::duration<double> diff = lastAcceptTime - firstAcceptTime;
+    return (diff.count() > 0) ? accepts / diff.count() : 0;
+}
+
+// Rate-limited, a full fd table fails every accept until a server is done
+void
+app::Listener::acceptFailed(const string& error)
+{
+    acceptErrors++;
+    unloggedErrors++;
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    if (now - lastErrorLogTime < chrono::seconds(APP_ACCEPT_LOG_SEC))
+        return;
+
+    LOG_WARN(name << ": " << unloggedErrors << " accepts failed: " << error);
+    unloggedErrors = 0;
+    lastErrorLogTime = now;
+}
+
+std::string
+app::Listener::statsString() const
+{
+    stringstream str;
+    str.precision(4);
+    str << name << ": " << accepts << " accepts, " << acceptRate()
+        << " accepts/sec, " << ((wakeups) ? (double) accepts / wakeups : 0)
+        << " accepts/wakeup, max batch " << maxBatch;
+    if (acceptErrors)
+        str << ", " << acceptErrors << " accepts out of fds or memory";
+    return str.str();
+}
+
+app::ServerApp::ServerApp(const ip::sockaddr& addr, const uint64_t rcvBufSize,
+                          const uint16_t backlog, const uint16_t numListeners,
+                          const bool udp, const bool udpGRO,
+                          const uint32_t timestamping,
+                          const uint32_t busyPollUs, const bool zeroCopy) :
+    numServers(0),
     totalBytesReceived(0),
-    shuttingDown(false)
+    totalBytesSent(0),
+    shuttingDown(false),
+    completedServerVal(false),
+    nextSessionId(1),
+    timestamping(timestamping),
+    busyPollUs(busyPollUs),
+    spinHits(0),
+    spinMisses(0),
+    zeroCopy(zeroCopy),
+    zeroCopyBytes(0),
+    udpServer(NULL),
+    idleServer(NULL)
 {
+    if (!numListeners)
+        throw std::runtime_error(ERRSTR("Need at least 1 listener"));
+    if (addr.isUnix() && (numListeners > 1 || udp))
+        throw std::runtime_error(ERRSTR("A unix socket server has a single "
+                                        "listener and no UDP"));
+    // A stale socket file from an earlier run would fail the bind
+    if (!addr.unlinkSocketFile())
+        throw std::runtime_error(ERRSTR("The path exists and is not a "
+                                        "socket"));
+
 #ifdef __linux__
     efd = eventfd(0, 0);
     if (efd == -1)
         throw std::runtime_error(ERRSTR("Error creating event fd"));
 #elif __APPLE__
-    kq = kqueue();
-    if (kq == -1)
-        throw std::runtime_error(ERRSTR("Error in kqueue()"));
-
     ev_pipe(pfd);
-    event = (struct kevent *) malloc(sizeof(struct kevent) * 2);
-    tevent = (struct kevent *) malloc(sizeof(struct kevent) * 2);
 #else
     throw std::runtime_error(ERRSTR("Unsupported Platform"));
 #endif
 
-    sock.setNonBlocking();
-    sock.setReuseAddr();
-    sock.bind();
-    sock.listen(backlog);
+    for (int i = 0; i < numListeners; i++)
+    {
+        Listener* listener = new Listener("Listener-" + to_string(i), addr);
+        listeners.push_back(listener);
 
-    if (rcvBufSize)
-        sock.setRecvBufferSize(rcvBufSize);
+        tcp::Socket& sock = listener->sock;
+        sock.setNonBlocking();
+        sock.setReuseAddr();
+        if (numListeners > 1)
+            sock.setReusePort();
+        sock.bind();
+        sock.listen(backlog);
+
+        if (rcvBufSize)
+            sock.setRecvBufferSize(rcvBufSize);
+    }
+
+    if (udp)
+        udpServer = new UDPServer("UDPServer", addr, rcvBufSize, udpGRO);
+    idleServer = new IdleServer("IdleServer");
 
     serverThread = thread(&app::ServerApp::manageServers, this);
-    listenerThread = thread(&app::ServerApp::listen, this);
+    for (auto listener : listeners)
+    {
+        listener->listenerThread = thread(&app::ServerApp::listen, this,
+                                          listener);
+    }
 }
 
 app::ServerApp::~ServerApp()
 {
+    stop();
+
+    for (auto listener : listeners)
+    {
+        listener->sock.addr.unlinkSocketFile();
+        delete listener;
+    }
+    delete udpServer;
+    delete idleServer;
+
+#ifdef __linux__
+    close(efd);
+#elif __APPLE__
+    close(pfd[0]);
+    close(pfd[1]);
+#endif
+}
+
+void
+app::ServerApp::stop()
+{
+    if (shuttingDown)
+        return;
+
     shuttingDown = true;
 
 #ifdef __linux__
@@ -127,42 +1152,194 @@ app::ServerApp::~ServerApp()
     completedServersCV.notify_one();
     completedServersLock.unlock();
     serverThread.join();
-    listenerThread.join();
-    activeServerCleanup();
-    // No more active servers to complete, so we don't have to take a lock
+    for (auto listener : listeners)
+        listener->listenerThread.join();
+
+    // Senders still waiting for a session to start would hold up the stop
+    // loop below, and the control server that would let them go may be
+    // stopped after them
+    {
+        std::lock_guard<std::mutex> lock(sessionsLock);
+        for (auto& it : sessions)
+            it.second->startGate->shutDown();
+    }
+
+    // Also lets sessions that wait for their idle connections go
+    idleServer->stop();
+    totalCPU += idleServer->cpu.result;
+
+    // Nothing deletes servers any more, so it is safe to stop the ones that
+    // are still in the table even if they complete concurrently
+    uint32_t numSlots = activeServers.size();
+    for (uint32_t slot = 0; slot < numSlots; slot++)
+    {
+        TrafficServer* server = activeServers.get(slot);
+        if (server)
+            server->stopTraffic();
+    }
+
     completedServerCleanup();
+    activeServerCleanup();
 
-#ifdef __APPLE__
-    close(pfd[0]);
-    close(pfd[1]);
-    free(event);
-    free(tevent);
-#endif
+    if (udpServer)
+    {
+        udpServer->stop();
+        totalCPU += udpServer->cpu.result;
+    }
 }
 
 void
 app::ServerApp::activeServerCleanup()
 {
-    std::lock_guard<std::mutex> lock(activeServersLock);
-    while (!activeServers.empty())
+    uint32_t numSlots = activeServers.size();
+    for (uint32_t slot = 0; slot < numSlots; slot++)
     {
-        auto as = activeServers.back();
-        activeServers.pop_back();
-        totalBytesReceived += as->bytesReceived;
-        delete as;
+        TrafficServer* server = activeServers.get(slot);
+        if (!server)
+            continue;
+
+        activeServers.remove(slot);
+        collectStats(server);
+        delete server;
     }
 }
 
 void
 app::ServerApp::completedServerCleanup()
 {
-    while (!completedServers.empty())
+    TrafficServer* server = completedServers.popAll();
+    while (server)
+    {
+        TrafficServer* next = server->nextCompleted;
+        collectStats(server);
+        delete server;
+        server = next;
+    }
+}
+
+void
+app::ServerApp::collectStats(app::TrafficServer* server)
+{
+    server->stopTraffic();
+    totalCPU += server->cpu.result;
+    // The probe connections are the ones that spinning is for
+    spinHits += server->spinHits;
+    spinMisses += server->spinMisses;
+    // Only the data connections count towards the throughput
+    if (server->connType == ctrl::control || server->connType == ctrl::probe ||
+        server->connType == ctrl::idle)
+        return;
+
+    if (connResults.empty() || server->startTime < firstStartTime)
+        firstStartTime = server->startTime;
+    if (connResults.empty() || server->endTime > lastEndTime)
+        lastEndTime = server->endTime;
+
+    totalBytesReceived += server->bytesReceived;
+    zeroCopyBytes += server->zeroCopyBytes;
+    if (server->stamper)
+        stamps.merge(server->stamper->stats);
+    if (!serverSends(server->mode))
+    {
+        connResults.push_back({server->name, server->raddr.toString(),
+                               server->bytesReceived, server->elapsedSec(),
+                               server->cpu.result});
+        return;
+    }
+
+    // The CPU cost goes with the send direction, like on the client
+    totalBytesSent += server->sentBytes;
+    connResults.push_back({server->name, server->raddr.toString(),
+                           server->sentBytes, server->elapsedSec(),
+                           server->cpu.result, false, 0, 0, 0, 0, "tx"});
+    if (clientSends(server->mode))
+        connResults.push_back({server->name, server->raddr.toString(),
+                               server->bytesReceived, server->elapsedSec(),
+                               stats::CPUStats(), false, 0, 0, 0, 0, "rx"});
+}
+
+uint64_t
+app::ServerApp::acceptedConns() const
+{
+    uint64_t accepts = 0;
+    for (auto listener : listeners)
+        accepts += listener->accepts;
+
+    return accepts;
+}
+
+double
+app::ServerApp::acceptRate() const
+{
+    chrono::steady_clock::time_point first, last;
+    bool accepted = false;
+    for (auto listener : listeners)
     {
-        auto cs = completedServers.back();
-        completedServers.pop_back();
-        totalBytesReceived += cs->bytesReceived;
-        delete cs;
+        if (!listener->accepts)
+            continue;
+        if (!accepted || listener->firstAcceptTime < first)
+            first = listener->firstAcceptTime;
+        if (!accepted || listener->lastAcceptTime > last)
+            last = listener->lastAcceptTime;
+        accepted = true;
     }
+
+    chrono::duration<double> diff = last - first;
+    return (diff.count() > 0) ? acceptedConns() / diff.count() : 0;
+}
+
+void
+app::ServerApp::fillReport(results::Report& report) const
+{
+    for (auto& conn : connResults)
+        report.conns.push_back(conn);
+
+    chrono::duration<double> duration = lastEndTime - firstStartTime;
+    report.total.bytes = totalBytesReceived;
+    report.total.durationSec = (connResults.empty()) ? 0 : duration.count();
+
+    if (totalBytesSent)
+        report.addMetric("bytes_sent", totalBytesSent);
+    if (udpServer)
+    {
+        report.addMetric("udp_bytes", udpServer->bytesReceived);
+        report.addMetric("udp_packets", udpServer->packetsReceived);
+    }
+    if (idleServer->peakConns)
+    {
+        report.addMetric("idle_bytes", idleServer->bytesReceived);
+        report.addMetric("idle_peak_conns", idleServer->peakConns);
+        report.addMetric("rss_bytes", idleServer->peakMem.rssBytes);
+        report.addMetric("rss_per_conn_bytes", idleServer->rssPerConn());
+        report.addMetric("tcp_sockets", idleServer->peakMem.tcpSockets);
+        report.addMetric("tcp_mem_bytes", idleServer->peakMem.tcpMemBytes);
+        report.addMetric("tcp_mem_per_conn_bytes",
+                         idleServer->tcpMemPerConn());
+    }
+    if (timestamping)
+        app_addTimestampMetrics(report, stamps);
+    if (busyPollUs)
+    {
+        report.addMetric("busy_poll_us", busyPollUs);
+        report.addMetric("busy_poll_spin_hits", spinHits);
+        report.addMetric("busy_poll_spin_misses", spinMisses);
+    }
+    if (zeroCopy)
+    {
+        report.addMetric("zerocopy_recv_bytes", zeroCopyBytes);
+        report.addMetric("zerocopy_recv_pct", (totalBytesReceived) ?
+                         100.0 * zeroCopyBytes / totalBytesReceived : 0);
+    }
+    report.addMetric("accepts", acceptedConns());
+    report.addMetric("accepts_per_sec", acceptRate());
+    for (auto listener : listeners)
+    {
+        report.addMetric(listener->name + ".accepts", listener->accepts);
+        report.addMetric(listener->name + ".accepts_per_sec",
+                         listener->acceptRate());
+        report.addMetric(listener->name + ".max_batch", listener->maxBatch);
+    }
+    report.total.cpu = totalCPU;
 }
 
 void
@@ -170,29 +1347,37 @@ app::ServerApp::manageServers()
 {
     while (!shuttingDown)
     {
-        std::unique_lock<std::mutex> ul(completedServersLock);
-        completedServersCV.wait(ul, [this]{return completedServerVal == true;});
+        {
+            std::unique_lock<std::mutex> ul(completedServersLock);
+            completedServersCV.wait(ul,
+                                    [this]{return completedServerVal == true;});
+            completedServerVal = false;
+        }
+        if (shuttingDown)
+            break;
+
         completedServerCleanup();
-        completedServerVal = false;
     }
 }
 
 void
-app::ServerApp::listen()
+app::ServerApp::listen(app::Listener* listener)
 {
 #ifdef __linux__
-    struct pollfd fds[2];
-    fds[0].fd      = sock.fd;
+    struct pollfd* fds = listener->fds;
+    fds[0].fd      = listener->sock.fd;
     fds[0].events  = POLLIN;
     fds[0].revents = 0;
     fds[1].fd      = efd;
     fds[1].events  = POLLIN;
     fds[1].revents = 0;
 #elif __APPLE__
+    struct kevent* event = listener->event;
     EV_SET(event, pfd[0], EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, NULL);
-    EV_SET(event + 1, sock.fd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, NULL);
+    EV_SET(event + 1, listener->sock.fd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0,
+           NULL);
 
-    int rc = kevent(kq, event, 2, NULL, 0, NULL);
+    int rc = kevent(listener->kq, event, 2, NULL, 0, NULL);
     if (rc == -1)
         throw std::runtime_error(ERRSTR("Error while registering kevents"));
     if (event->flags & EV_ERROR || (event+1)->flags & EV_ERROR)
@@ -206,61 +1391,336 @@ app::ServerApp::listen()
 #ifdef __linux__
         int ret = poll(fds, 2, -1);
 #elif __APPLE__
-        int ret = kevent(kq, NULL, 0, tevent, 2, NULL);
+        int ret = kevent(listener->kq, NULL, 0, listener->tevent, 2, NULL);
 #else
         throw std::runtime_error(ERRSTR("Unsupported Platform"));
 #endif
         if (ret == -1)
+        {
+            if (errno == EINTR)
+                continue;
             throw std::runtime_error(ERRSTR("Error during poll"));
+        }
         if (shuttingDown)
             break;
 
-        ip::sockaddr addr;
-        addr.sa.sa_family = AF_INET;
-        int fd;
-        try
+        // Drain the whole accept queue on every wake-up rather than paying a
+        // poll() per connection
+        chrono::steady_clock::time_point wakeTime = chrono::steady_clock::now();
+        uint64_t batch = 0;
+        bool backOff = false;
+        for (;;)
         {
-            fd = sock.accept(addr);
-        }
-        catch (...)
-        {
-            if (errno != EWOULDBLOCK && errno != ECONNABORTED &&
-                errno != EPROTO && errno != EINTR)
+            ip::sockaddr addr;
+            int fd = listener->sock.acceptNonBlocking(addr);
+            if (fd == -1)
             {
-                throw;
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                {
+                    listener->acceptFailed(strerror(errno));
+                    backOff = true;
+                }
+                break;
             }
-        }
 
-        if (fd > 0)
-        {
-            uint16_t numServers = activeServers.size();
-            string name = "Server-" + to_string(numServers);
-            cout << "Received connection from ";
-            cout << addr.toString().c_str() << endl;
-            funcTS_t cb = std::bind(&app::ServerApp::serverCompleted, this,
-                                    std::placeholders::_1);
-            app::TrafficServer* server = new app::TrafficServer(name, fd,
-                                                                sock.addr, addr,
-                                                                cb);
-
-            std::lock_guard<std::mutex> lock(activeServersLock);
-            activeServers.push_back(server);
+            // Out of fds for the server's own, the connection is dropped
+            try
+            {
+                startServer(listener, fd, addr);
+            }
+            catch (std::exception& e)
+            {
+                listener->acceptFailed(e.what());
+                backOff = true;
+                break;
+            }
+            batch++;
         }
+
+        // Gives the servers that are done a chance to free what the next
+        // connection needs
+        if (backOff)
+            this_thread::sleep_for(chrono::milliseconds(APP_ACCEPT_BACKOFF_MS));
+
+        listener->wakeups++;
+        if (!batch)
+            continue;
+
+        if (!listener->accepts)
+            listener->firstAcceptTime = wakeTime;
+        listener->lastAcceptTime = chrono::steady_clock::now();
+        listener->accepts += batch;
+        listener->maxBatch = std::max(listener->maxBatch, batch);
+    }
+}
+
+// The connection is handed straight to its own TrafficServer from the
+// listener thread
+void
+app::ServerApp::startServer(app::Listener* listener, int fd,
+                            const ip::sockaddr& addr)
+{
+    string name = "Server-" + to_string(numServers++);
+    LOG_INFO("Received connection from " << addr.toString());
+    funcTS_t cb = std::bind(&app::ServerApp::serverCompleted, this,
+                            std::placeholders::_1);
+    funcHello_t helloCb = std::bind(&app::ServerApp::handleHello, this,
+                                    std::placeholders::_1,
+                                    std::placeholders::_2);
+    app::TrafficServer* server = new app::TrafficServer(name, fd,
+                                                        listener->sock.addr,
+                                                        addr, cb, helloCb);
+    if (!listener->sock.addr.isUnix())
+    {
+        server->timestamping = timestamping;
+        server->zeroCopy = zeroCopy;
     }
+    server->busyPollUs = busyPollUs;
+
+    // The server can complete as soon as it is started, so it has to be in the
+    // table by then
+    server->slot = activeServers.insert(server);
+    server->start();
 }
 
+// Called from the server's own thread. O(1) and lock-free unless
+// manageServers() has to be woken up.
 void
 app::ServerApp::serverCompleted(app::TrafficServer* server)
 {
-    std::lock_guard<std::mutex> aslock(activeServersLock);
-    auto it = std::find(activeServers.begin(),
-                        activeServers.end(), server);
-    if (it != activeServers.end())
+    if (server->sessionId)
+        sessionServerCompleted(server);
+
+    activeServers.remove(server->slot);
+    if (completedServers.push(server))
     {
-        activeServers.remove(server);
-        std::lock_guard<std::mutex> cslock(completedServersLock);
-        completedServers.push_back(server);
+        std::lock_guard<std::mutex> lock(completedServersLock);
         completedServerVal = true;
         completedServersCV.notify_one();
     }
 }
+
+app::Session::Session(const uint32_t id, const ctrl::Hello& params) :
+    id(id),
+    params(params),
+    servers(params.numConns, NULL),
+    reports(params.numConns),
+    numCompleted(0),
+    startGate(new StartGate())
+{
+    for (uint32_t i = 0; i < params.numConns; i++)
+        reports[i] = {i, 0, 0, 0, 0, 0};
+}
+
+// Called with the session lock held. Connections that are still running
+// report what they have received so far.
+std::vector<ctrl::ConnReport>
+app::Session::collectReports()
+{
+    monotime_t now = tsc::FastClock::now();
+    for (uint32_t i = 0; i < servers.size(); i++)
+    {
+        TrafficServer* server = servers[i];
+        if (!server)
+            continue;
+
+        reports[i].bytes = server->bytesReceived;
+        if (reports[i].bytes)
+        {
+            reports[i].durationNs =
+                chrono::duration_cast<chrono::nanoseconds>(
+                    now - server->firstByteTime).count();
+        }
+    }
+
+    return reports;
+}
+
+// Runs on the server's own thread, straight after its Hello
+void
+app::ServerApp::handleHello(app::TrafficServer* server,
+                            const ctrl::Hello& hello)
+{
+    if (hello.version != CTRL_VERSION)
+    {
+        LOG_WARN(server->name << ": unsupported control protocol version "
+                 << hello.version);
+        throw std::runtime_error(ERRSTR("Unsupported control version"));
+    }
+
+    if (hello.type == ctrl::control)
+    {
+        serveSession(server, hello);
+        return;
+    }
+    // Probes are not part of the session's results
+    if (hello.type == ctrl::probe)
+        return;
+
+    std::lock_guard<std::mutex> lock(sessionsLock);
+    auto it = sessions.find(hello.sessionId);
+    if (it == sessions.end() || hello.connIndex >= it->second->servers.size())
+    {
+        LOG_WARN(server->name << ": unknown session " << hello.sessionId);
+        server->sessionId = 0;
+        return;
+    }
+    if (hello.type == ctrl::idle)
+    {
+        // Served from a single thread for the rest of their life
+        idleServer->add(server->sock->release(), hello.sessionId,
+                        hello.connIndex);
+        return;
+    }
+
+    Session* session = it->second;
+    if (session->params.rcvBufSize)
+        server->sock->setRecvBufferSize(session->params.rcvBufSize);
+    std::lock_guard<std::mutex> slock(session->lock);
+    session->servers[hello.connIndex] = server;
+    server->startGate = session->startGate;
+}
+
+void
+app::ServerApp::sessionServerCompleted(app::TrafficServer* server)
+{
+    std::lock_guard<std::mutex> lock(sessionsLock);
+    auto it = sessions.find(server->sessionId);
+    if (it == sessions.end())
+        return;
+
+    Session* session = it->second;
+    std::lock_guard<std::mutex> slock(session->lock);
+    if (session->servers[server->connIndex] != server)
+        return;
+
+    ctrl::ConnReport& report = session->reports[server->connIndex];
+    report.completed = 1;
+    report.bytes = server->bytesReceived;
+    report.durationNs = server->dataSec() * 1e9;
+    session->servers[server->connIndex] = NULL;
+    session->numCompleted++;
+    session->cv.notify_all();
+}
+
+void
+app::ServerApp::serveSession(app::TrafficServer* server,
+                             const ctrl::Hello& hello)
+{
+    ctrl::Ack ack = {nextSessionId++, ctrl::ok, large, 0};
+    bool udp = hello.transport == transportUDP;
+    bool idle = hello.idleIntervalMs != 0;
+    if (udp)
+        ack.maxMsgSize = UDP_MAX_DATAGRAM;
+    if (udp && !udpServer)
+        LOG_WARN(server->name << ": UDP is not enabled");
+    if (!hello.numConns || hello.numConns > CTRL_MAX_CONNS ||
+        hello.msgSize > ack.maxMsgSize ||
+        hello.transport > transportShm ||
+        (udp && (!udpServer || hello.mode != forward)) ||
+        (idle && (hello.transport != transportTCP || hello.mode != forward)))
+    {
+        LOG_WARN(server->name << ": rejecting session with " << hello.numConns
+                 << " connections and " << hello.msgSize << " byte messages");
+        ack.status = ctrl::rejected;
+        ctrl::sendMsg(server->sock, ctrl::ack, &ack, sizeof(ack));
+        return;
+    }
+
+    server->name = "Control-" + to_string(ack.sessionId);
+    Session* session = new Session(ack.sessionId, hello);
+    {
+        std::lock_guard<std::mutex> lock(sessionsLock);
+        sessions[session->id] = session;
+    }
+
+    LOG_INFO("Session " << session->id << " from "
+             << server->raddr.toString() << ": " << hello.numConns
+             << " connections, " << hello.msgSize << " byte messages, "
+             << hello.durationSec << " sec over "
+             << transportName((Transport) hello.transport)
+             << ((idle) ? ", idle" : ""));
+
+    try
+    {
+        ctrl::sendMsg(server->sock, ctrl::ack, &ack, sizeof(ack));
+
+        while (!server->shuttingDown)
+        {
+            ctrl::MsgHeader hdr;
+            server->recvBlock(&hdr, sizeof(hdr));
+            if (server->shuttingDown)
+                break;
+            if (hdr.len > large)
+                throw std::runtime_error(ERRSTR("Malformed control message"));
+            if (hdr.len)
+                server->recvBlock(server->buf, hdr.len);
+
+            if (hdr.type == ctrl::start)
+            {
+                LOG_INFO("Session " << session->id << " started");
+                session->startGate->open();
+            }
+            else if (hdr.type == ctrl::stop)
+            {
+                // Senders still waiting would keep their connections from
+                // draining
+                session->startGate->open();
+                std::vector<ctrl::ConnReport> reports;
+                if (idle)
+                {
+                    reports = idleServer->collectReports(session->id,
+                                                         hello.numConns);
+                    for (auto& report : reports)
+                        session->numCompleted += report.completed;
+                }
+                else if (udp)
+                {
+                    this_thread::sleep_for(
+                        chrono::milliseconds(CTRL_UDP_DRAIN_MS));
+                    reports = udpServer->collectReports(session->id,
+                                                        hello.numConns);
+                    for (auto& report : reports)
+                        session->numCompleted += report.completed;
+                }
+                else
+                {
+                    // The client shuts its data connections down before it
+                    // sends the stop, wait for them to drain
+                    std::unique_lock<std::mutex> ul(session->lock);
+                    chrono::steady_clock::time_point deadline =
+                        chrono::steady_clock::now() +
+                        chrono::milliseconds(CTRL_DRAIN_TIMEOUT_MS);
+                    while (session->numCompleted < hello.numConns &&
+                           !server->shuttingDown &&
+                           chrono::steady_clock::now() < deadline)
+                    {
+                        session->cv.wait_for(ul, chrono::milliseconds(100));
+                    }
+                    reports = session->collectReports();
+                }
+
+                ctrl::sendResults(server->sock, reports);
+                LOG_INFO("Session " << session->id << " completed, "
+                         << session->numCompleted << "/" << hello.numConns
+                         << " connections drained");
+                break;
+            }
+            else
+                throw std::runtime_error(ERRSTR("Unknown control message"));
+        }
+    }
+    catch (...)
+    {
+        session->startGate->open();
+        std::lock_guard<std::mutex> lock(sessionsLock);
+        sessions.erase(session->id);
+        delete session;
+        throw;
+    }
+
+    session->startGate->open();
+    std::lock_guard<std::mutex> lock(sessionsLock);
+    sessions.erase(session->id);
+    delete session;
+}
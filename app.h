@@ -4,15 +4,26 @@
 #include "tcp.h"
 #include "helper.h"
 #include "traffic.h"
+#include "traffic-udp.h"
+#include "traffic-idle.h"
+#include "results.h"
+#include "conntable.h"
+#include "srcpool.h"
+#include "sweep.h"
 
-#ifdef __APPLE__
+#ifdef __linux__
+#include <poll.h>
+#elif __APPLE__
 #include <sys/event.h>
 #endif
 
+#include <atomic>
 #include <limits>
 #include <string>
 #include <thread>
 #include <list>
+#include <map>
+#include <vector>
 #include <mutex>
 #include <condition_variable>
 
@@ -24,62 +35,347 @@ namespace app
         virtual ~PerfApp() {}
     };
 
+    // A server the client sends to, and the connections it gets
+    struct Destination
+    {
+        ip::sockaddr raddr;
+        // 0 takes a share of the client's connections, by weight
+        uint16_t numConns;
+        uint32_t weight;
+        // Replaces the client's traffic shaper, if set
+        ts::TSDescriptor tsd;
+
+        // The control session with the destination's server
+        tcp::Socket* ctrlSock;
+        uint32_t sessionId;
+        std::vector<TrafficDriver*> drivers;
+
+        std::string toString() const;
+        // Subtotal of the destination's drivers, for one direction
+        results::ConnResult result(bool tx) const;
+
+        Destination(const ip::sockaddr& raddr, const uint16_t numConns = 0,
+                    const uint32_t weight = 1,
+                    const ts::TSDescriptor& tsd = {"", ""});
+    };
+
+    // <addr>:<port>[,conns=<n>][,rate=<rate>][,weight=<w>]. IPv6 addresses
+    // go in brackets, unix socket paths have no port.
+    Destination parseDestination(const std::string& str);
+
+    // Connections that run a TCP congestion control algorithm
+    struct CongestionShare
+    {
+        std::string algo;
+        uint32_t numConns;
+    };
+
+    // <n> <algo>[,<n> <algo>...], e.g. "10 cubic, 5 bbr, 5 reno"
+    std::vector<CongestionShare> parseCongestionMix(const std::string& str);
+
+    // What a ClientApp tests, apart from where the connections come from and
+    // go to
+    struct ClientConfig
+    {
+        // The steady-state window, between the warm-up and the cool-down
+        uint64_t testDurationSec;
+        uint64_t warmupSec;
+        uint64_t cooldownSec;
+        ts::TSDescriptor tsd;
+        // Spread over the destinations that do not ask for a number
+        uint16_t numDrivers;
+        MsgSize msgSize;
+        // 0 leaves the system default
+        uint32_t sndBufSize;
+        // Asked of the servers for their end of the data connections
+        uint32_t rcvBufSize;
+        // Opens a control session with every server
+        bool useControl;
+        TrafficMode mode;
+        Transport transport;
+        // UDP only, 0 for no segmentation offload
+        uint16_t gsoSegments;
+        ProbeConfig probeConfig;
+        IdleConfig idleConfig;
+        std::vector<CongestionShare> ccMix;
+        // A trace to replay, empty for none
+        std::string replayPath;
+        // tcp::TimestampFlags of the data connections, 0 for none
+        uint32_t timestamping;
+        uint32_t busyPollUs;
+        Framing framing;
+        bool zeroCopy;
+
+        ClientConfig();
+    };
+
     struct ClientApp : public PerfApp
     {
+        // The test runs for warm-up + duration + cool-down, only the middle
+        // window counts towards the throughput
         const uint64_t testDurationSec;
+        const uint64_t warmupSec;
+        const uint64_t cooldownSec;
         uint64_t totalBytesSent;
+        uint64_t warmupBytes;
+        uint64_t steadyBytes;
+        // What the drivers sent after the steady-state window, which is only
+        // what was in flight when there is no cool-down
+        uint64_t cooldownBytes;
+        // Longest steady-state window of all the drivers
+        double steadySec;
+        // Sum of the steady-state throughput of every driver
+        uint64_t steadyThroughput;
+        // The reverse direction, when the server sends too
+        const TrafficMode mode;
+        uint64_t totalBytesReceived;
+        uint64_t steadyRecvBytes;
+        uint64_t steadyRecvThroughput;
+        stats::CPUStats totalCPU;
         std::list<TrafficDriver*> drivers;
+        std::vector<results::Sample> samples;
         const func_t cb;
         const ts::TSDescriptor tsd;
+        StartGate gate;
+
+        // Every destination has its own control session, if the servers are
+        // asked for their results
+        std::vector<Destination> dests;
+        const bool useControl;
+        uint64_t totalPeerBytes;
+        // Sum of the goodput the receiver measured on every connection
+        uint64_t peerGoodput;
+
+        // UDP: datagrams the drivers sent and what the receiver made of them
+        const Transport transport;
+        uint64_t totalPacketsSent;
+        double steadyPacketRate;
+        uint64_t totalPeerPackets;
+        uint64_t lostPackets;
+        uint64_t reorderedPackets;
+
+        // Where the data connections come from, not used for unix sockets
+        SourcePool* sourcePool;
+        uint64_t connectFailures;
+
+        // Idle mode: many connections that each send a message now and then,
+        // driven by a few IdleDrivers
+        const IdleConfig idleConfig;
+        uint64_t idleConnected;
+        uint64_t idleMessages;
+        uint64_t idleSendStalls;
+        uint64_t idleLost;
+
+        // The congestion control algorithms of the data connections, handed
+        // out in connection order across the destinations. Empty leaves them
+        // all at the system default.
+        const std::vector<CongestionShare> ccMix;
+        uint64_t totalRetransmits;
+        // Asked of the servers for their end of the data connections
+        const uint32_t rcvBufSize;
+
+        // Replay mode: connection i sends the messages of flow i of the
+        // trace, and the client reports how closely it kept to the times
+        ReplayTrace* replayTrace;
+        uint64_t replayMsgs;
+        // Connections still replaying when the test ended
+        uint64_t replayUnfinished;
+        stats::Histogram replayLateness;
+
+        // tcp::TimestampFlags of the data connections, and what the stamps
+        // of all of them add up to
+        const uint32_t timestamping;
+        TimestampStats stamps;
+
+        // Busy polling: how long every receive loop spins before it waits,
+        // 0 for never, and how often the data came while it did
+        const uint32_t busyPollUs;
+        uint64_t spinHits;
+        uint64_t spinMisses;
+
+        // How the data connections lay out their blocks, and whether the
+        // client maps in the data it receives, and how much of it it could
+        const Framing framing;
+        const bool zeroCopy;
+        uint64_t zeroCopyBytes;
+
+        const ProbeConfig probeConfig;
+        std::list<LatencyProbe*> probes;
+        // Probe round trips in ns, before any bulk traffic and during the
+        // steady-state window
+        stats::Histogram baselineRTT;
+        stats::Histogram loadedRTT;
+        // What the probes cost, which spinning adds to
+        stats::CPUStats probeCPU;
 
     protected:
         void cleanup();
         void manageDrivers();
+        void markDrivers(ByteMark TrafficDriver::* byteMark);
+        void setProbePhase(ProbePhase phase);
+        void assignConns(const uint16_t numDrivers);
+        void openSession(const ip::sockaddr& laddr, Destination& dest,
+                         const MsgSize msgSize);
+        void closeSession(Destination& dest);
 
     public:
-        ClientApp(const ip::sockaddr& laddr, const ip::sockaddr& raddr,
-                  const uint64_t testDurationSec, const func_t cb,
-                  const ts::TSDescriptor& tsd, const uint16_t numDrivers = 1,
-                  const MsgSize msgSize = large, const uint32_t sndBufSize = 0);
+        void fillReport(results::Report& report) const;
+        double lossPct() const;
+        // Steady-state subtotal of the connections that run algo
+        results::ConnResult ccResult(const std::string& algo) const;
+        // Jain's index over the steady-state throughput of the connections
+        // that run algo, or of all of them if empty
+        double fairness(const std::string& algo = "") const;
+
+        // Spreads config.numDrivers connections over the destinations that
+        // do not ask for a number of their own. The control and probe
+        // connections come from the first source address.
+        ClientApp(const SourceConfig& sources,
+                  const std::vector<Destination>& dests, const func_t cb,
+                  const ClientConfig& config);
         virtual ~ClientApp();
     };
 
-    struct ServerApp : public PerfApp
+// How long a listener waits before it accepts again when it ran out of fds
+// or memory, and how often it logs that
+#define APP_ACCEPT_BACKOFF_MS 10
+#define APP_ACCEPT_LOG_SEC    1
+
+    // A listening socket and the thread accepting on it. When a ServerApp has
+    // more than one listener, they share the port using SO_REUSEPORT and the
+    // kernel spreads the incoming connections across them.
+    struct Listener
     {
+        const std::string name;
         tcp::Socket sock;
 #ifdef __linux__
-        int efd;
+        struct pollfd fds[2];
 #elif __APPLE__
         int kq;
+        struct kevent event[2];
+        struct kevent tevent[2];
+#endif
+        uint64_t accepts;
+        uint64_t wakeups;
+        uint64_t maxBatch;
+        // Accepts that failed for lack of fds or memory, and the ones not
+        // logged yet
+        uint64_t acceptErrors;
+        uint64_t unloggedErrors;
+        std::chrono::steady_clock::time_point firstAcceptTime;
+        std::chrono::steady_clock::time_point lastAcceptTime;
+        std::chrono::steady_clock::time_point lastErrorLogTime;
+        std::thread listenerThread;
+
+        double acceptRate() const;
+        std::string statsString() const;
+        void acceptFailed(const std::string& error);
+
+        Listener(const std::string& name, const ip::sockaddr& addr);
+        ~Listener();
+    };
+
+    // The server side of a control session: the test parameters and what was
+    // received on each of its data connections
+    struct Session
+    {
+        const uint32_t id;
+        const ctrl::Hello params;
+        std::mutex lock;
+        std::condition_variable cv;
+        // Data connections still running, by connection index
+        std::vector<TrafficServer*> servers;
+        std::vector<ctrl::ConnReport> reports;
+        uint32_t numCompleted;
+        // Opened by the client's start, or once the session ends. Shared with
+        // the data connections, which can outlive the session.
+        std::shared_ptr<StartGate> startGate;
+
+        std::vector<ctrl::ConnReport> collectReports();
+
+        Session(const uint32_t id, const ctrl::Hello& params);
+    };
+
+    struct ServerApp : public PerfApp
+    {
+#ifdef __linux__
+        int efd;
+#elif __APPLE__
         int pfd[2];
-        struct kevent *event;
-        struct kevent *tevent;
 #endif
+        std::vector<Listener*> listeners;
+        std::atomic<uint64_t> numServers;
         uint64_t totalBytesReceived;
+        // Sent on connections in reverse or bidirectional mode
+        uint64_t totalBytesSent;
+        stats::CPUStats totalCPU;
+        std::list<results::ConnResult> connResults;
+        // Span covered by all the connections that have been collected
+        monotime_t firstStartTime;
+        monotime_t lastEndTime;
         bool shuttingDown;
         bool completedServerVal;
 
+        // Only used to put manageServers() to sleep - completions are queued
+        // lock-free and the lock is taken just when the queue was empty
         std::mutex completedServersLock;
         std::condition_variable completedServersCV;
-        std::list<TrafficServer*> completedServers;
+        CompletionQueue completedServers;
 
-        std::mutex activeServersLock;
-        std::list<TrafficServer*> activeServers;
+        ConnTable activeServers;
+
+        // Only taken on the control path and on teardown of data connections
+        // that belong to a session
+        std::mutex sessionsLock;
+        std::map<uint32_t, Session*> sessions;
+        std::atomic<uint32_t> nextSessionId;
+
+        // tcp::TimestampFlags of the TCP connections, and what the stamps of
+        // the data connections add up to
+        const uint32_t timestamping;
+        TimestampStats stamps;
+
+        // How long the receive loops spin before they wait, and how often
+        // the data came while they did
+        const uint32_t busyPollUs;
+        uint64_t spinHits;
+        uint64_t spinMisses;
+
+        // Whether the TCP connections map in the data they receive, and how
+        // much of it the data connections could
+        const bool zeroCopy;
+        uint64_t zeroCopyBytes;
+
+        // Receives the data of UDP sessions, if enabled
+        UDPServer* udpServer;
+        // Serves the idle connections of every session
+        IdleServer* idleServer;
 
         std::thread serverThread;
-        std::thread listenerThread;
 
     protected:
         void activeServerCleanup();
         void completedServerCleanup();
+        void collectStats(TrafficServer* server);
         void manageServers();
-        void listen();
+        void listen(Listener* listener);
+        void startServer(Listener* listener, int fd, const ip::sockaddr& addr);
+        void handleHello(TrafficServer* server, const ctrl::Hello& hello);
+        void serveSession(TrafficServer* server, const ctrl::Hello& hello);
+        void sessionServerCompleted(TrafficServer* server);
 
     public:
         void serverCompleted(TrafficServer* server);
+        void stop();
+        uint64_t acceptedConns() const;
+        double acceptRate() const;
+        void fillReport(results::Report& report) const;
 
         ServerApp(const ip::sockaddr& addr, const uint64_t rcvBufSize = 0,
-                  const uint16_t backlog = 128);
+                  const uint16_t backlog = 128,
+                  const uint16_t numListeners = 1, const bool udp = false,
+                  const bool udpGRO = false, const uint32_t timestamping = 0,
+                  const uint32_t busyPollUs = 0, const bool zeroCopy = false);
         virtual ~ServerApp();
     };
 };
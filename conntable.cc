@@ -0,0 +1,141 @@
+#include "conntable.h"
+#include "helper.h"
+
+app::ConnTable::ConnTable() :
+    freeHead(0),
+    numSlots(0),
+    numActive(0)
+{
+    for (int i = 0; i < CONN_TABLE_MAX_CHUNKS; i++)
+        chunks[i] = NULL;
+}
+
+app::ConnTable::~ConnTable()
+{
+    for (int i = 0; i < CONN_TABLE_MAX_CHUNKS; i++)
+        delete[] chunks[i].load();
+}
+
+app::ConnTable::Slot&
+app::ConnTable::slotAt(uint32_t slot)
+{
+    return chunks[slot / CONN_TABLE_CHUNK_SLOTS][slot % CONN_TABLE_CHUNK_SLOTS];
+}
+
+uint32_t
+app::ConnTable::insert(app::TrafficServer* server)
+{
+    uint32_t slot;
+    uint64_t head = freeHead.load(std::memory_order_acquire);
+    for (;;)
+    {
+        uint32_t idx = (uint32_t) head;
+        if (!idx)
+        {
+            // Free list is empty - take a new slot from the end of the table
+            slot = numSlots.fetch_add(1);
+            uint32_t chunk = slot / CONN_TABLE_CHUNK_SLOTS;
+            if (chunk >= CONN_TABLE_MAX_CHUNKS)
+            {
+                numSlots.fetch_sub(1);
+                throw std::runtime_error(ERRSTR("Connection table full"));
+            }
+
+            if (!chunks[chunk].load(std::memory_order_acquire))
+            {
+                Slot* slots = new Slot[CONN_TABLE_CHUNK_SLOTS];
+                for (int i = 0; i < CONN_TABLE_CHUNK_SLOTS; i++)
+                {
+                    slots[i].server = NULL;
+                    slots[i].nextFree = 0;
+                }
+
+                Slot* expected = NULL;
+                if (!chunks[chunk].compare_exchange_strong(expected, slots))
+                    delete[] slots;
+            }
+            break;
+        }
+
+        uint64_t next = slotAt(idx - 1).nextFree.load();
+        uint64_t newHead = (((head >> 32) + 1) << 32) | next;
+        if (freeHead.compare_exchange_weak(head, newHead))
+        {
+            slot = idx - 1;
+            break;
+        }
+    }
+
+    slotAt(slot).server.store(server, std::memory_order_release);
+    numActive++;
+    return slot;
+}
+
+void
+app::ConnTable::remove(uint32_t slot)
+{
+    Slot& s = slotAt(slot);
+    s.server.store(NULL, std::memory_order_release);
+    numActive--;
+
+    uint64_t head = freeHead.load(std::memory_order_acquire);
+    for (;;)
+    {
+        s.nextFree.store((uint32_t) head);
+        uint64_t newHead = (head & 0xffffffff00000000ULL) | (slot + 1);
+        if (freeHead.compare_exchange_weak(head, newHead))
+            return;
+    }
+}
+
+app::TrafficServer*
+app::ConnTable::get(uint32_t slot)
+{
+    if (!chunks[slot / CONN_TABLE_CHUNK_SLOTS].load(std::memory_order_acquire))
+        return NULL;
+
+    return slotAt(slot).server.load(std::memory_order_acquire);
+}
+
+uint32_t
+app::ConnTable::size() const
+{
+    return numSlots.load();
+}
+
+app::CompletionQueue::CompletionQueue() :
+    head(NULL)
+{
+}
+
+bool
+app::CompletionQueue::push(app::TrafficServer* server)
+{
+    TrafficServer* old = head.load(std::memory_order_relaxed);
+    do
+    {
+        server->nextCompleted = old;
+    } while (!head.compare_exchange_weak(old, server,
+                                         std::memory_order_release,
+                                         std::memory_order_relaxed));
+
+    return old == NULL;
+}
+
+app::TrafficServer*
+app::CompletionQueue::popAll()
+{
+    TrafficServer* server = head.exchange(NULL, std::memory_order_acquire);
+
+    // Pushes are LIFO, reverse to hand them out in completion order
+    TrafficServer* ordered = NULL;
+    while (server)
+    {
+        TrafficServer* next = server->nextCompleted;
+        server->nextCompleted = ordered;
+        ordered = server;
+        server = next;
+    }
+
+    return ordered;
+}
@@ -0,0 +1,60 @@
+#ifndef __CONNTABLE_H
+#define __CONNTABLE_H
+
+#include "traffic.h"
+
+#include <atomic>
+#include <cstdint>
+
+namespace app
+{
+#define CONN_TABLE_CHUNK_SLOTS 1024
+#define CONN_TABLE_MAX_CHUNKS  4096
+
+    // Slot indexed table of the active TrafficServers. Slots are handed out
+    // and returned in O(1) through a lock-free free list, so accepting a
+    // connection never waits on another connection's teardown. Chunks of slots
+    // are allocated on demand and never freed before the table, which keeps
+    // lock-free readers safe.
+    struct ConnTable
+    {
+        struct Slot
+        {
+            std::atomic<TrafficServer*> server;
+            std::atomic<uint32_t> nextFree;
+        };
+
+        std::atomic<Slot*> chunks[CONN_TABLE_MAX_CHUNKS];
+        // Tagged head of the free list: (tag << 32) | (slot + 1), 0 if empty.
+        // The tag is bumped on every pop to rule out ABA.
+        std::atomic<uint64_t> freeHead;
+        std::atomic<uint32_t> numSlots;
+        std::atomic<uint64_t> numActive;
+
+        uint32_t insert(TrafficServer* server);
+        void remove(uint32_t slot);
+        TrafficServer* get(uint32_t slot);
+        uint32_t size() const;
+
+        ConnTable();
+        ~ConnTable();
+
+    protected:
+        Slot& slotAt(uint32_t slot);
+    };
+
+    // Intrusive multi-producer, single-consumer queue of completed
+    // TrafficServers, linked through TrafficServer::nextCompleted.
+    struct CompletionQueue
+    {
+        std::atomic<TrafficServer*> head;
+
+        // Returns true if the queue was empty, i.e. the consumer needs a wakeup
+        bool push(TrafficServer* server);
+        // Takes everything queued so far, oldest first
+        TrafficServer* popAll();
+
+        CompletionQueue();
+    };
+}
+#endif /* __CONNTABLE_H */
@@ -0,0 +1,83 @@
+#include "ctrl.h"
+#include "helper.h"
+
+#include <sys/uio.h>
+#include <cstring>
+
+ctrl::Hello
+ctrl::makeHello(ctrl::ConnType type)
+{
+    Hello hello;
+    memset(&hello, 0, sizeof(hello));
+    hello.magic = CTRL_MAGIC;
+    hello.version = CTRL_VERSION;
+    hello.type = type;
+    return hello;
+}
+
+void
+ctrl::sendMsg(tcp::Socket* sock, ctrl::MsgType type, const void* payload,
+              uint32_t len)
+{
+    MsgHeader hdr = {(uint32_t) type, len};
+    struct iovec iov[2];
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len  = sizeof(hdr);
+    iov[1].iov_base = (void *) payload;
+    iov[1].iov_len  = len;
+    sock->writeBlock(iov, (len) ? 2 : 1, sizeof(hdr) + len);
+}
+
+void
+ctrl::sendResults(tcp::Socket* sock,
+                  const std::vector<ctrl::ConnReport>& reports)
+{
+    sendMsg(sock, results, reports.data(),
+            reports.size() * sizeof(ConnReport));
+}
+
+void
+ctrl::recvAll(tcp::Socket* sock, void* buf, size_t len)
+{
+    char* p = (char *) buf;
+    while (len)
+    {
+        ssize_t count = sock->recv(p, len);
+        if (count <= 0)
+        {
+            if (count < 0 && errno == EINTR)
+                continue;
+            throw std::runtime_error(ERRSTR("Control connection closed"));
+        }
+
+        p += count;
+        len -= count;
+    }
+}
+
+ctrl::MsgHeader
+ctrl::recvHeader(tcp::Socket* sock, ctrl::MsgType expected)
+{
+    MsgHeader hdr;
+    recvAll(sock, &hdr, sizeof(hdr));
+    if (hdr.type != expected)
+        throw std::runtime_error(ERRSTR("Unexpected control message"));
+
+    return hdr;
+}
+
+std::vector<ctrl::ConnReport>
+ctrl::recvResults(tcp::Socket* sock, uint32_t numConns)
+{
+    MsgHeader hdr = recvHeader(sock, results);
+    // The server reports every connection of the session, anything else is
+    // not worth allocating for
+    if (hdr.len != (uint64_t) numConns * sizeof(ConnReport))
+        throw std::runtime_error(ERRSTR("Malformed control results"));
+
+    std::vector<ConnReport> reports(numConns);
+    if (hdr.len)
+        recvAll(sock, reports.data(), hdr.len);
+
+    return reports;
+}
@@ -0,0 +1,145 @@
+#ifndef __CTRL_H
+#define __CTRL_H
+
+#include "tcp.h"
+
+#include <cstdint>
+#include <vector>
+
+// The control protocol between a ClientApp and a ServerApp. Every connection
+// a ClientApp opens starts with a Hello. The magic is larger than any valid
+// block size, so a ServerApp can tell it apart from the data framing used by
+// clients that do not speak the control protocol. All fields are in host byte
+// order, like the data framing.
+namespace ctrl
+{
+#define CTRL_MAGIC   0x6c6f6f7466726570ULL // "perftool"
+#define CTRL_VERSION 8
+#define CTRL_SHAPER_LEN      16
+#define CTRL_SHAPER_ARGS_LEN 32
+// Most data connections a session may ask for, a client destination counts
+// them in 16 bits
+#define CTRL_MAX_CONNS 65535
+// How long a server waits for a session's data connections to drain after
+// the client asked for the results
+#define CTRL_DRAIN_TIMEOUT_MS 5000
+// UDP has no end of data to wait for, datagrams still in flight when the
+// client asks for the results get this long to arrive
+#define CTRL_UDP_DRAIN_MS 200
+
+    enum ConnType
+    {
+        control = 1,
+        data    = 2,
+        // Latency probes, echoed back by the server
+        probe   = 3,
+        // Mostly idle connections that send a small message now and then.
+        // The server serves them all from one thread.
+        idle    = 4,
+    };
+
+    enum MsgType
+    {
+        ack     = 1,
+        start   = 2,
+        stop    = 3,
+        results = 4,
+    };
+
+    enum Status
+    {
+        ok       = 0,
+        rejected = 1,
+    };
+
+    struct Hello
+    {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t type;
+        // Data connections: the session from the Ack and the driver index
+        uint32_t sessionId;
+        uint32_t connIndex;
+        // Control connection: the test parameters
+        uint32_t numConns;
+        uint32_t msgSize;
+        uint64_t durationSec;
+        // Which ends send (an app::TrafficMode). Data connections that have
+        // the server send also carry the message size and the traffic
+        // shaper the server should use.
+        uint32_t mode;
+        // Probe connections: the DSCP the server marks its echoes with
+        uint32_t dscp;
+        // Control connection: the app::Transport the data is carried on
+        uint32_t transport;
+        // Control connection: how often every idle connection sends, 0 if
+        // the session has no idle connections
+        uint32_t idleIntervalMs;
+        // Control connection: the receive buffer of the session's data
+        // connections, 0 leaves what the server was started with
+        uint32_t rcvBufSize;
+        // Data connections: the app::Framing of the blocks, both ways
+        uint32_t framing;
+        char shaper[CTRL_SHAPER_LEN];
+        char shaperArgs[CTRL_SHAPER_ARGS_LEN];
+    };
+
+    struct MsgHeader
+    {
+        uint32_t type;
+        uint32_t len;
+    };
+
+    struct Ack
+    {
+        uint32_t sessionId;
+        uint32_t status;
+        uint32_t maxMsgSize;
+        uint32_t reserved;
+    };
+
+    // What the receiver measured on one data connection
+    struct ConnReport
+    {
+        uint32_t connIndex;
+        uint32_t completed;
+        uint64_t bytes;
+        // From the first data byte to the end of the connection
+        uint64_t durationNs;
+        // UDP only: datagrams received and those that arrived after a later
+        // one of the same flow
+        uint64_t packets;
+        uint64_t reordered;
+    };
+
+    // A latency probe request, echoed back as is
+    struct Probe
+    {
+        uint64_t seq;
+        uint64_t sendNs;
+        char pad[48];
+    };
+
+    // Starts every UDP datagram. The server keeps the statistics of a flow by
+    // session and connection index, there is no Hello.
+    struct DatagramHeader
+    {
+        uint32_t sessionId;
+        uint32_t connIndex;
+        // Consecutive per flow, starting at 0
+        uint64_t seq;
+        uint64_t sendNs;
+    };
+
+    Hello makeHello(ConnType type);
+
+    void sendMsg(tcp::Socket* sock, MsgType type, const void* payload = NULL,
+                 uint32_t len = 0);
+    void sendResults(tcp::Socket* sock, const std::vector<ConnReport>& reports);
+
+    // Blocking helpers for the client side of the control connection
+    void recvAll(tcp::Socket* sock, void* buf, size_t len);
+    MsgHeader recvHeader(tcp::Socket* sock, MsgType expected);
+    std::vector<ConnReport> recvResults(tcp::Socket* sock, uint32_t numConns);
+}
+#endif /* __CTRL_H */
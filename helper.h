@@ -1,6 +1,7 @@
 #ifndef __HELPER_H
 #define __HELPER_H
 
+#include <atomic>
 #include <cassert>
 #include <chrono>
 #include <cstdlib>
@@ -10,9 +11,12 @@
 #include <math.h>
 #include <sstream>
 #include <stdexcept>
+#include <sys/resource.h>
 #include <vector>
 #include <unistd.h>
 
+#include "tsc.h"
+
 #define STRINGIFY(x) #x
 #define TOSTRING(x) STRINGIFY(x)
 #define AT __FILE__ ":" TOSTRING(__LINE__)
@@ -20,8 +24,29 @@
 
 typedef std::function<void (void)> func_t;
 
-typedef std::chrono::time_point<std::chrono::system_clock> systime_t;
-typedef std::chrono::time_point<std::chrono::high_resolution_clock> hrsystime_t;
+// Durations are measured on the monotonic fast clock, never the wall clock
+typedef tsc::FastClock::time_point monotime_t;
+
+// A counter that is updated by a single thread and can be sampled by other
+// threads without locks. Unlike std::atomic::operator+=, add() does not need a
+// locked read-modify-write as there is only one writer.
+struct Counter
+{
+    std::atomic<uint64_t> val;
+
+    void add(uint64_t n)
+    {
+        val.store(val.load(std::memory_order_relaxed) + n,
+                  std::memory_order_relaxed);
+    }
+    void set(uint64_t n) { val.store(n, std::memory_order_relaxed); }
+    uint64_t get() const { return val.load(std::memory_order_relaxed); }
+
+    Counter& operator+=(uint64_t n) { add(n); return *this; }
+    operator uint64_t() const { return get(); }
+
+    Counter(uint64_t val = 0) : val(val) {}
+};
 
 static const std::vector<std::string> sizes = { "bps", "kbps", "mbps", "gbps"};
 static const std::vector<int> multipliers   = { 0, 10, 20, 30};
@@ -67,6 +92,19 @@ inline uint64_t strtou64(const std::string& str)
     throw std::runtime_error(ERRSTR("Invalid multiplier"));
 }
 
+// Tests with many connections need more descriptors than the default soft
+// limit allows
+inline void
+raiseFileLimit()
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1 || rl.rlim_cur == rl.rlim_max)
+        return;
+
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+}
+
 inline int
 rfcntl(int fd, int cmd, long arg)
 {
@@ -2,14 +2,18 @@
 #include "helper.h"
 
 #include <netdb.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <iostream>
+#include <cstring>
 
 using namespace std;
 
 static int
 ip_guessIPAddressFamily(const string& addr)
 {
+    if (!addr.empty() && addr[0] == '/')
+        return AF_UNIX;
     if (addr.find(':') == std::string::npos)
         return AF_INET;
 
@@ -34,6 +38,15 @@ ip::sockaddr::sockaddr(const std::string addr, const uint16_t port)
         sa_len = sizeof(struct sockaddr_in6);
         ipv6.sin6_port = htons(port);
     }
+    else if (family == AF_UNIX)
+    {
+        if (addr.size() >= sizeof(un.sun_path))
+            throw std::invalid_argument(ERRSTR("Unix socket path too long"));
+        memset(un.sun_path, 0, sizeof(un.sun_path));
+        memcpy(un.sun_path, addr.c_str(), addr.size());
+        sa_len = sizeof(struct sockaddr_un);
+        ret = 1;
+    }
     else
     {
         throw std::runtime_error(ERRSTR("Wrong Address family"));
@@ -53,6 +66,8 @@ ip::sockaddr::toString() const
         inet_ntop(family, &ipv4.sin_addr, addrStr, IP_ADDR_LEN);
     else if (family == AF_INET6)
         inet_ntop(family, &ipv6.sin6_addr, addrStr, IP_ADDR_LEN);
+    else if (family == AF_UNIX)
+        return string("unix:") + ((un.sun_path[0]) ? un.sun_path : "unnamed");
     else
         return "Unknown address";
 
@@ -75,6 +90,9 @@ ip::Socket::Socket(const ip::sockaddr& addr, const int type) :
 
 ip::Socket::~Socket()
 {
+    if (fd == -1)
+        return;
+
     ::shutdown(fd, SHUT_RDWR);
     ::close(fd);
 }
@@ -87,6 +105,20 @@ ip::Socket::bind()
         throw std::runtime_error(ERRSTR("Error during socket bind"));
 }
 
+int
+ip::Socket::release()
+{
+    int ret = fd;
+    fd = -1;
+    return ret;
+}
+
+void
+ip::Socket::shutdownWrite()
+{
+    ::shutdown(fd, SHUT_WR);
+}
+
 void
 ip::Socket::setReuseAddr()
 {
@@ -96,6 +128,15 @@ ip::Socket::setReuseAddr()
         throw std::runtime_error(ERRSTR("Error during set reuse addr"));
 }
 
+void
+ip::Socket::setReusePort()
+{
+    const int on = 1;
+    int ret = ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    if (ret == -1)
+        throw std::runtime_error(ERRSTR("Error during set reuse port"));
+}
+
 void
 ip::Socket::setNonBlocking()
 {
@@ -137,6 +178,21 @@ ip::Socket::setSendBufferSize(uint32_t size)
         throw std::runtime_error(ERRSTR("Error setting send buffer size"));
 }
 
+bool
+ip::sockaddr::unlinkSocketFile() const
+{
+    if (!isUnix())
+        return true;
+
+    struct stat st;
+    if (lstat(un.sun_path, &st) == -1)
+        return true;
+    if (!S_ISSOCK(st.st_mode))
+        return false;
+    unlink(un.sun_path);
+    return true;
+}
+
 void
 ip::Socket::setKeepAlive(bool enabled)
 {
@@ -146,6 +202,50 @@ ip::Socket::setKeepAlive(bool enabled)
         throw std::runtime_error(ERRSTR("Error setting keepalive"));
 }
 
+void
+ip::Socket::setDSCP(uint8_t dscp)
+{
+    // Nothing to mark on a unix socket
+    if (addr.isUnix())
+        return;
+
+    // The DSCP is the upper six bits of the TOS / traffic class byte
+    int tos = dscp << 2;
+    int ret;
+    if (addr.sa.sa_family == AF_INET6)
+        ret = ::setsockopt(fd, IPPROTO_IPV6, IPV6_TCLASS, &tos, sizeof(tos));
+    else
+        ret = ::setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+    if (ret == -1)
+        throw std::runtime_error(ERRSTR("Error setting DSCP"));
+}
+
+void
+ip::Socket::setPriority(uint32_t priority)
+{
+#ifdef __linux__
+    int val = priority;
+    int ret = ::setsockopt(fd, SOL_SOCKET, SO_PRIORITY, &val, sizeof(val));
+    if (ret == -1)
+        throw std::runtime_error(ERRSTR("Error setting priority"));
+#else
+    throw std::runtime_error(ERRSTR("Not supported"));
+#endif
+}
+
+void
+ip::Socket::setBindAddressNoPort()
+{
+#ifdef __linux__
+    int val = 1;
+    int ret = ::setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &val,
+                           sizeof(val));
+    if (ret == -1)
+        throw std::runtime_error(ERRSTR("Error setting bind address no port"));
+#endif
+    // Elsewhere bind() picks the port right away
+}
+
 #ifdef __APPLE__
 void
 ip::Socket::setNoSIGPIPE()
@@ -158,6 +258,18 @@ ip::Socket::setNoSIGPIPE()
 }
 #endif
 
+int
+ip::Socket::getError()
+{
+    int val;
+    socklen_t len = sizeof(val);
+    int ret = ::getsockopt(fd, SOL_SOCKET, SO_ERROR, &val, &len);
+    if (ret == -1)
+        throw std::runtime_error(ERRSTR("Error getting socket error"));
+
+    return val;
+}
+
 uint32_t
 ip::Socket::getRecvBufferSize()
 {
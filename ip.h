@@ -5,6 +5,7 @@
 #include <string>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 
 namespace ip
 {
@@ -19,10 +20,18 @@ namespace ip
             struct ::sockaddr       sa;
             struct sockaddr_in      ipv4;
             struct sockaddr_in6     ipv6;
+            struct sockaddr_un      un;
         };
 
         std::string toString() const;
+        bool isUnix() const { return sa.sa_family == AF_UNIX; }
+        // Removes the socket file of a unix address, e.g. a stale one from an
+        // earlier run. False, and nothing removed, if the path is there but
+        // is not a socket.
+        bool unlinkSocketFile() const;
 
+        // Addresses starting with a '/' are unix socket paths, the port is
+        // ignored for them
         sockaddr(const std::string addr, const uint16_t port = 0);
         sockaddr() : sa_len(0), storage({}) {}
         ~sockaddr() {}
@@ -34,16 +43,28 @@ namespace ip
         sockaddr addr;
 
         void     bind();
+        // Hands the descriptor over to the caller, the socket no longer
+        // closes it
+        int      release();
+        virtual void shutdownWrite();
         void     setReuseAddr();
+        void     setReusePort();
         void     setNonBlocking();
         void     setBlocking();
         void     setRecvTimeout(uint64_t timeoutUs);
         void     setRecvBufferSize(uint32_t size);
         void     setSendBufferSize(uint32_t size);
         void     setKeepAlive(bool enabled);
+        void     setDSCP(uint8_t dscp);
+        void     setPriority(uint32_t priority);
+        // Leaves the choice of the local port to connect(), so that bind()
+        // only reserves the address
+        void     setBindAddressNoPort();
 #ifdef __APPLE__
         void     setNoSIGPIPE();
 #endif
+        // The pending error, e.g. of a non-blocking connect
+        int      getError();
         uint32_t getRecvBufferSize();
         uint32_t getSendBufferSize();
 
@@ -0,0 +1,223 @@
+#include "logger.h"
+#include "helper.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+
+using namespace std;
+
+#define LOG_DRAIN_INTERVAL_MS 1
+
+logger::Logger logger::log;
+
+namespace
+{
+    // Marks the calling thread's ring as orphaned when the thread exits
+    struct RingHandle
+    {
+        logger::Ring* ring;
+
+        RingHandle() : ring(NULL) {}
+        ~RingHandle()
+        {
+            if (ring)
+                ring->orphaned.store(true, std::memory_order_release);
+        }
+    };
+
+    thread_local RingHandle localHandle;
+}
+
+logger::Ring::Ring() :
+    head(0),
+    tail(0),
+    orphaned(false)
+{
+}
+
+bool
+logger::Ring::push(logger::Level level, const std::string& msg)
+{
+    uint32_t h = head.load(std::memory_order_relaxed);
+    if (h - tail.load(std::memory_order_acquire) == LOG_RING_SIZE)
+        return false;
+
+    Entry& entry = entries[h % LOG_RING_SIZE];
+    entry.level = level;
+    entry.len = std::min(msg.size(), (size_t) LOG_MSG_LEN);
+    memcpy(entry.msg, msg.data(), entry.len);
+
+    head.store(h + 1, std::memory_order_release);
+    return true;
+}
+
+bool
+logger::Ring::pop(logger::Entry& entry)
+{
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    if (t == head.load(std::memory_order_acquire))
+        return false;
+
+    const Entry& e = entries[t % LOG_RING_SIZE];
+    entry.level = e.level;
+    entry.len = e.len;
+    memcpy(entry.msg, e.msg, e.len);
+
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+}
+
+logger::Logger::Logger() :
+    level(info),
+    mode(async),
+    dropped(0),
+    shuttingDown(false)
+{
+}
+
+logger::Logger::~Logger()
+{
+    shuttingDown = true;
+    if (drainThread.joinable())
+        drainThread.join();
+
+    drain();
+    for (auto ring : rings)
+        delete ring;
+}
+
+logger::Ring*
+logger::Logger::localRing()
+{
+    if (!localHandle.ring)
+    {
+        Ring* ring = new Ring();
+        std::lock_guard<std::mutex> lock(ringsLock);
+        rings.push_back(ring);
+        localHandle.ring = ring;
+    }
+
+    return localHandle.ring;
+}
+
+void
+logger::Logger::write(logger::Level level, const std::string& msg)
+{
+    if (mode.load(std::memory_order_relaxed) == sync)
+    {
+        // The old behaviour - serializes on the stream and flushes every line
+        cout << msg << endl;
+        return;
+    }
+
+    std::call_once(started, [this] {
+        drainThread = thread(&logger::Logger::drainer, this);
+    });
+
+    // Never block the caller - if the drainer cannot keep up, drop and count
+    if (!localRing()->push(level, msg))
+        dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+void
+logger::Logger::drain()
+{
+    std::lock_guard<std::mutex> dlock(drainLock);
+
+    // Takes the rings out so that threads logging for the first time only
+    // wait for the splice, not for the writes
+    std::list<Ring*> draining;
+    {
+        std::lock_guard<std::mutex> rlock(ringsLock);
+        draining.splice(draining.end(), rings);
+    }
+
+    Entry entry;
+    bool written = false;
+    auto it = draining.begin();
+    while (it != draining.end())
+    {
+        Ring* ring = *it;
+        // Read the flag before draining so that nothing pushed before the
+        // thread exited can be missed
+        bool orphaned = ring->orphaned.load(std::memory_order_acquire);
+
+        while (ring->pop(entry))
+        {
+            fwrite(entry.msg, 1, entry.len, stdout);
+            fputc('\n', stdout);
+            written = true;
+        }
+
+        if (orphaned)
+        {
+            it = draining.erase(it);
+            delete ring;
+        }
+        else
+            ++it;
+    }
+
+    {
+        std::lock_guard<std::mutex> rlock(ringsLock);
+        rings.splice(rings.begin(), draining);
+    }
+
+    uint64_t drops = dropped.exchange(0, std::memory_order_relaxed);
+    if (drops)
+    {
+        fprintf(stdout, "%llu log messages dropped\n",
+                (unsigned long long) drops);
+        written = true;
+    }
+
+    if (written)
+        fflush(stdout);
+}
+
+void
+logger::Logger::flush()
+{
+    drain();
+}
+
+void
+logger::Logger::drainer()
+{
+    while (!shuttingDown)
+    {
+        drain();
+        this_thread::sleep_for(chrono::milliseconds(LOG_DRAIN_INTERVAL_MS));
+    }
+}
+
+logger::Level
+logger::parseLevel(const std::string& str)
+{
+    if (str == "debug")
+        return debug;
+    if (str == "info")
+        return info;
+    if (str == "warn")
+        return warn;
+    if (str == "error")
+        return error;
+    if (str == "none")
+        return none;
+
+    throw std::invalid_argument(ERRSTR("Unknown log level"));
+}
+
+logger::Mode
+logger::parseMode(const std::string& str)
+{
+    if (str == "async")
+        return async;
+    if (str == "sync")
+        return sync;
+
+    throw std::invalid_argument(ERRSTR("Unknown log mode"));
+}
@@ -0,0 +1,116 @@
+#ifndef __LOGGER_H
+#define __LOGGER_H
+
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+namespace logger
+{
+#define LOG_RING_SIZE 64
+#define LOG_MSG_LEN   248
+
+    enum Level
+    {
+        debug,
+        info,
+        warn,
+        error,
+        none,
+    };
+
+    enum Mode
+    {
+        async,
+        sync,
+    };
+
+    struct Entry
+    {
+        Level level;
+        uint32_t len;
+        char msg[LOG_MSG_LEN];
+    };
+
+    // Lock-free single producer, single consumer ring. The producer is the
+    // thread that owns the ring and the consumer is whichever thread drains
+    // the logger.
+    struct Ring
+    {
+        Entry entries[LOG_RING_SIZE];
+        std::atomic<uint32_t> head;
+        std::atomic<uint32_t> tail;
+        // Set once the owning thread has exited; the ring is freed by the
+        // consumer after it has been drained
+        std::atomic<bool> orphaned;
+
+        bool push(Level level, const std::string& msg);
+        bool pop(Entry& entry);
+
+        Ring();
+    };
+
+    struct Logger
+    {
+        std::atomic<int> level;
+        std::atomic<int> mode;
+        std::atomic<uint64_t> dropped;
+
+        // Only taken when a thread logs for the first time, and by the
+        // drainer to take the rings out and put them back
+        std::mutex ringsLock;
+        std::list<Ring*> rings;
+        std::mutex drainLock;
+
+        std::once_flag started;
+        std::atomic<bool> shuttingDown;
+        std::thread drainThread;
+
+        void write(Level level, const std::string& msg);
+        void drain();
+        void flush();
+
+        Logger();
+        ~Logger();
+
+    protected:
+        Ring* localRing();
+        void drainer();
+    };
+
+    extern Logger log;
+
+    Level parseLevel(const std::string& str);
+    Mode parseMode(const std::string& str);
+
+    inline bool
+    enabled(Level level)
+    {
+        return level >= log.level.load(std::memory_order_relaxed);
+    }
+
+    inline void setLevel(Level level) { log.level = level; }
+    inline void setMode(Mode mode) { log.mode = mode; }
+    inline void flush() { log.flush(); }
+}
+
+#define LOG(level, expr)                                                    \
+    do                                                                      \
+    {                                                                       \
+        if (logger::enabled(level))                                         \
+        {                                                                   \
+            std::stringstream _logStr;                                      \
+            _logStr << expr;                                                \
+            logger::log.write(level, _logStr.str());                        \
+        }                                                                   \
+    } while (0)
+
+#define LOG_DEBUG(expr) LOG(logger::debug, expr)
+#define LOG_INFO(expr)  LOG(logger::info, expr)
+#define LOG_WARN(expr)  LOG(logger::warn, expr)
+#define LOG_ERROR(expr) LOG(logger::error, expr)
+
+#endif /* __LOGGER_H */
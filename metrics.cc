@@ -0,0 +1,407 @@
+#include "metrics.h"
+#include "logger.h"
+
+#include <poll.h>
+#include <string.h>
+#include <sys/uio.h>
+
+using namespace std;
+
+metrics::Registry metrics::registry;
+
+struct metrics_Metric
+{
+    const char* name;
+    const char* type;
+    const char* help;
+    uint64_t metrics::Totals::* field;
+};
+
+static const metrics_Metric metrics_totals[] =
+{
+    {"perf_tool_bytes_sent_total", "counter",
+     "Bytes sent, framing included.", &metrics::Totals::bytesSent},
+    {"perf_tool_bytes_received_total", "counter",
+     "Bytes received, framing included.", &metrics::Totals::bytesReceived},
+    {"perf_tool_messages_sent_total", "counter",
+     "Messages, or datagrams, sent.", &metrics::Totals::msgsSent},
+    {"perf_tool_messages_received_total", "counter",
+     "Messages, or datagrams, received.", &metrics::Totals::msgsReceived},
+    {"perf_tool_connections_active", "gauge",
+     "Connections, or threads serving many of them, with live counters.",
+     &metrics::Totals::active},
+    {"perf_tool_connections_completed_total", "counter",
+     "Connections, or threads serving many of them, that have ended.",
+     &metrics::Totals::completed},
+};
+
+// Label values escape backslashes, double quotes and newlines
+static string
+metrics_escape(const string& value)
+{
+    string escaped;
+    for (char c : value)
+    {
+        if (c == '\\' || c == '"')
+            escaped += '\\';
+        if (c == '\n')
+            escaped += "\\n";
+        else
+            escaped += c;
+    }
+    return escaped;
+}
+
+static void
+metrics_header(stringstream& str, const char* name, const char* type,
+               const char* help)
+{
+    str << "# HELP " << name << " " << help << "\n";
+    str << "# TYPE " << name << " " << type << "\n";
+}
+
+metrics::Registry::Registry() :
+    enabled(false),
+    numSlots(0),
+    freeHead(0),
+    seq(0)
+{
+    for (int i = 0; i < METRICS_MAX_CHUNKS; i++)
+        chunks[i] = NULL;
+}
+
+metrics::Registry::~Registry()
+{
+    for (int i = 0; i < METRICS_MAX_CHUNKS; i++)
+        delete[] chunks[i].load();
+}
+
+void
+metrics::Registry::enable(const string& role)
+{
+    this->role = role;
+    enabled = true;
+}
+
+metrics::ConnCounters&
+metrics::Registry::slotAt(uint32_t slot)
+{
+    return chunks[slot / METRICS_CHUNK_SLOTS].load(
+        std::memory_order_acquire)[slot % METRICS_CHUNK_SLOTS];
+}
+
+metrics::ConnCounters*
+metrics::Registry::acquire(const string& name)
+{
+    std::unique_lock<std::mutex> ul(lock);
+    uint32_t slot;
+    if (freeHead)
+    {
+        slot = freeHead - 1;
+        freeHead = slotAt(slot).nextFree;
+    }
+    else
+    {
+        slot = numSlots.load(std::memory_order_relaxed);
+        uint32_t chunk = slot / METRICS_CHUNK_SLOTS;
+        if (chunk >= METRICS_MAX_CHUNKS)
+        {
+            LOG_WARN("Out of metrics slots, " << name << " is not counted");
+            return NULL;
+        }
+
+        if (!chunks[chunk].load(std::memory_order_relaxed))
+        {
+            ConnCounters* slots = new ConnCounters[METRICS_CHUNK_SLOTS];
+            for (int i = 0; i < METRICS_CHUNK_SLOTS; i++)
+            {
+                slots[i].active = false;
+                slots[i].nameSeq = 0;
+                slots[i].slot = chunk * METRICS_CHUNK_SLOTS + i;
+            }
+            chunks[chunk].store(slots, std::memory_order_release);
+        }
+        numSlots.store(slot + 1, std::memory_order_release);
+    }
+
+    // A new connection starts from zero, which leaves the totals as they are
+    ConnCounters& counters = slotAt(slot);
+    uint32_t s = counters.nameSeq.load(std::memory_order_relaxed);
+    counters.nameSeq.store(s + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    strncpy(counters.name, name.c_str(), METRICS_NAME_LEN - 1);
+    counters.name[METRICS_NAME_LEN - 1] = '\0';
+    counters.nameSeq.store(s + 2, std::memory_order_release);
+    counters.bytesSent.set(0);
+    counters.bytesReceived.set(0);
+    counters.msgsSent.set(0);
+    counters.msgsReceived.set(0);
+    counters.shaperWaitNs.set(0);
+    counters.active.store(true, std::memory_order_release);
+    return &counters;
+}
+
+// Called once the connection's threads are done with the counters
+void
+metrics::Registry::release(metrics::ConnCounters* counters)
+{
+    std::unique_lock<std::mutex> ul(lock);
+    uint64_t s = seq.load(std::memory_order_relaxed);
+    seq.store(s + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    retired.bytesSent += counters->bytesSent;
+    retired.bytesReceived += counters->bytesReceived;
+    retired.msgsSent += counters->msgsSent;
+    retired.msgsReceived += counters->msgsReceived;
+    retired.shaperWaitNs += counters->shaperWaitNs;
+    completed += 1;
+    counters->active.store(false, std::memory_order_relaxed);
+
+    seq.store(s + 2, std::memory_order_release);
+
+    counters->nextFree = freeHead;
+    freeHead = counters->slot + 1;
+}
+
+// One lock-free pass over the slots, false if a retirement got in the way
+bool
+metrics::Registry::readTotals(metrics::Totals& totals)
+{
+    uint64_t s = seq.load(std::memory_order_acquire);
+    if (s & 1)
+        return false;
+
+    totals = {retired.bytesSent, retired.bytesReceived, retired.msgsSent,
+              retired.msgsReceived, retired.shaperWaitNs, 0, completed};
+    uint32_t n = numSlots.load(std::memory_order_acquire);
+    for (uint32_t slot = 0; slot < n; slot++)
+    {
+        ConnCounters& counters = slotAt(slot);
+        if (!counters.active.load(std::memory_order_acquire))
+            continue;
+
+        totals.bytesSent += counters.bytesSent;
+        totals.bytesReceived += counters.bytesReceived;
+        totals.msgsSent += counters.msgsSent;
+        totals.msgsReceived += counters.msgsReceived;
+        totals.shaperWaitNs += counters.shaperWaitNs;
+        totals.active++;
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return seq.load(std::memory_order_relaxed) == s;
+}
+
+metrics::Totals
+metrics::Registry::totals()
+{
+    Totals totals;
+    for (int i = 0; i < METRICS_SCRAPE_TRIES; i++)
+    {
+        if (readTotals(totals))
+            return totals;
+    }
+
+    // Only holds off connections that start or end, never the data path
+    std::unique_lock<std::mutex> ul(lock);
+    readTotals(totals);
+    return totals;
+}
+
+string
+metrics::Registry::render()
+{
+    Totals totals = this->totals();
+    string label = "role=\"" + metrics_escape(role) + "\"";
+    stringstream str;
+    for (auto& m : metrics_totals)
+    {
+        metrics_header(str, m.name, m.type, m.help);
+        str << m.name << "{" << label << "} " << totals.*m.field << "\n";
+    }
+    metrics_header(str, "perf_tool_shaper_wait_seconds_total", "counter",
+                   "Time the traffic shapers held the senders back.");
+    str << "perf_tool_shaper_wait_seconds_total{" << label << "} "
+        << totals.shaperWaitNs / 1e9 << "\n";
+
+    // The connections that are active right now, each read on its own. A
+    // slot that keeps being handed to new connections is left out.
+    stringstream sent, received;
+    uint32_t n = numSlots.load(std::memory_order_acquire);
+    for (uint32_t slot = 0; slot < n; slot++)
+    {
+        ConnCounters& counters = slotAt(slot);
+        char name[METRICS_NAME_LEN];
+        uint64_t bytesSent, bytesReceived;
+        bool read = false;
+        for (int i = 0; i < METRICS_SCRAPE_TRIES && !read; i++)
+        {
+            uint32_t s = counters.nameSeq.load(std::memory_order_acquire);
+            if (s & 1)
+                continue;
+            if (!counters.active.load(std::memory_order_acquire))
+                break;
+
+            memcpy(name, counters.name, sizeof(name));
+            bytesSent = counters.bytesSent;
+            bytesReceived = counters.bytesReceived;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            read = counters.nameSeq.load(std::memory_order_relaxed) == s;
+        }
+        if (!read)
+            continue;
+
+        name[METRICS_NAME_LEN - 1] = '\0';
+        string conn = "{" + label + ",conn=\"" + metrics_escape(name) + "\"} ";
+        sent << "perf_tool_connection_bytes_sent_total" << conn
+             << bytesSent << "\n";
+        received << "perf_tool_connection_bytes_received_total" << conn
+                 << bytesReceived << "\n";
+    }
+    metrics_header(str, "perf_tool_connection_bytes_sent_total", "counter",
+                   "Bytes sent on an active connection.");
+    str << sent.str();
+    metrics_header(str, "perf_tool_connection_bytes_received_total",
+                   "counter", "Bytes received on an active connection.");
+    str << received.str();
+
+    return str.str();
+}
+
+metrics::Exporter::Exporter(const ip::sockaddr& addr, const string& role) :
+    sock(addr),
+    scrapes(0)
+{
+    // A stale socket file from an earlier run would fail the bind
+    if (!addr.unlinkSocketFile())
+        throw std::runtime_error(ERRSTR("The metrics path exists and is not "
+                                        "a socket"));
+    sock.setReuseAddr();
+    sock.bind();
+    sock.listen(16);
+    ev_pipe(pfd);
+
+    registry.enable(role);
+    exporterThread = thread(&metrics::Exporter::serve, this);
+}
+
+metrics::Exporter::~Exporter()
+{
+    ev_pipe_write(pfd[1]);
+    exporterThread.join();
+    close(pfd[0]);
+    close(pfd[1]);
+    sock.addr.unlinkSocketFile();
+}
+
+void
+metrics::Exporter::serve()
+{
+    struct pollfd fds[2];
+    fds[0].fd     = sock.fd;
+    fds[0].events = POLLIN;
+    fds[1].fd     = pfd[0];
+    fds[1].events = POLLIN;
+
+    for (;;)
+    {
+        fds[0].revents = 0;
+        fds[1].revents = 0;
+        int rc = poll(fds, 2, -1);
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            LOG_ERROR("Metrics exporter: error in poll");
+            return;
+        }
+        if (fds[1].revents)
+            return;
+        if (!fds[0].revents)
+            continue;
+
+        ip::sockaddr raddr;
+        raddr.sa_len = sizeof(raddr.storage);
+        int fd = ::accept(sock.fd, &raddr.sa, &raddr.sa_len);
+        if (fd == -1)
+            continue;
+
+        try
+        {
+            handle(fd);
+        }
+        catch (std::exception& e)
+        {
+            LOG_WARN("Metrics exporter: " << e.what());
+        }
+    }
+}
+
+// HTTP/1.0: one request per connection, closed after the response
+void
+metrics::Exporter::handle(int fd)
+{
+    tcp::Socket conn(fd, sock.addr);
+    // A client that never finishes its request can't hold the scrapes up
+    conn.setRecvTimeout(1000000);
+#ifdef __APPLE__
+    conn.setNoSIGPIPE();
+#endif
+
+    string request;
+    char buf[1024];
+    while (request.find("\r\n\r\n") == string::npos &&
+           request.find("\n\n") == string::npos && request.size() < 8192)
+    {
+        ssize_t rc = conn.recv(buf, sizeof(buf));
+        if (rc <= 0)
+            break;
+        request.append(buf, rc);
+    }
+
+    string line = request.substr(0, request.find_first_of("\r\n"));
+    string status = "200 OK", body;
+    if (line.compare(0, 4, "GET ") != 0)
+        status = "405 Method Not Allowed";
+    else
+    {
+        string path = line.substr(4, line.find(' ', 4) - 4);
+        if (path == "/metrics" || path == "/")
+        {
+            body = registry.render();
+            scrapes++;
+        }
+        else
+            status = "404 Not Found";
+    }
+
+    string header = "HTTP/1.0 " + status + "\r\n"
+                    "Content-Type: text/plain; version=0.0.4\r\n"
+                    "Content-Length: " + to_string(body.size()) + "\r\n"
+                    "Connection: close\r\n\r\n";
+    struct iovec iov[2];
+    iov[0].iov_base = (void *) header.data();
+    iov[0].iov_len  = header.size();
+    iov[1].iov_base = (void *) body.data();
+    iov[1].iov_len  = body.size();
+    conn.writeBlock(iov, 2, header.size() + body.size());
+}
+
+ip::sockaddr
+metrics::parseEndpoint(const string& str)
+{
+    if (!str.empty() && str[0] == '/')
+        return ip::sockaddr(str);
+
+    size_t pos = str.rfind(':');
+    if (pos == string::npos)
+        return ip::sockaddr("0.0.0.0", stoi(str));
+    if (pos == str.size() - 1)
+        throw std::invalid_argument(ERRSTR("Metrics endpoint needs a port"));
+
+    string addr = str.substr(0, pos);
+    if (addr.size() > 1 && addr.front() == '[' && addr.back() == ']')
+        addr = addr.substr(1, addr.size() - 2);
+    return ip::sockaddr(addr, stoi(str.substr(pos + 1)));
+}
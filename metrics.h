@@ -0,0 +1,131 @@
+#ifndef __METRICS_H
+#define __METRICS_H
+
+#include "tcp.h"
+#include "helper.h"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace metrics
+{
+#define METRICS_CHUNK_SLOTS 1024
+#define METRICS_MAX_CHUNKS  1024
+#define METRICS_NAME_LEN    48
+// A scrape that keeps racing with connections being retired gives up on the
+// lock-free read after this many tries, and holds the retirements off instead
+#define METRICS_SCRAPE_TRIES 8
+
+    // The live counters of a connection, or of a thread that serves many of
+    // them. Only the thread that moves the data writes them, scrapes read
+    // them without locks.
+    struct ConnCounters
+    {
+        std::atomic<bool> active;
+        // Odd while the name is being written, so a scrape that races with
+        // the slot being handed to another connection can tell and skip it
+        std::atomic<uint32_t> nameSeq;
+        // Set before the slot turns active
+        char name[METRICS_NAME_LEN];
+        Counter bytesSent;
+        Counter bytesReceived;
+        Counter msgsSent;
+        Counter msgsReceived;
+        // Time the traffic shaper held the sender back
+        Counter shaperWaitNs;
+        // Owned by the Registry
+        uint32_t slot;
+        uint32_t nextFree;
+    };
+
+    // What a scrape adds up, over the retired connections and the active ones
+    struct Totals
+    {
+        uint64_t bytesSent;
+        uint64_t bytesReceived;
+        uint64_t msgsSent;
+        uint64_t msgsReceived;
+        uint64_t shaperWaitNs;
+        uint64_t active;
+        uint64_t completed;
+    };
+
+    // The counters of every connection of the process. Slots are handed out
+    // from chunks that are allocated on demand and never freed, so a scrape
+    // can read any slot that ever existed. Retiring a slot folds its counters
+    // into the totals under a sequence count, and a scrape retries if one
+    // went by, so the totals never go backwards.
+    struct Registry
+    {
+        std::atomic<bool> enabled;
+        std::string role;
+        std::atomic<ConnCounters*> chunks[METRICS_MAX_CHUNKS];
+        std::atomic<uint32_t> numSlots;
+        // Only taken when a connection starts and ends, never on the data path
+        std::mutex lock;
+        // Slot + 1 of the first free slot, 0 if none
+        uint32_t freeHead;
+        // Odd while a retirement is under way
+        std::atomic<uint64_t> seq;
+        // The sum of every retired slot, written under the lock
+        ConnCounters retired;
+        Counter completed;
+
+        void enable(const std::string& role);
+        // NULL when the metrics are disabled, or out of slots
+        ConnCounters* acquire(const std::string& name);
+        void release(ConnCounters* counters);
+        Totals totals();
+        // The Prometheus text exposition format
+        std::string render();
+
+        Registry();
+        ~Registry();
+
+    protected:
+        ConnCounters& slotAt(uint32_t slot);
+        bool readTotals(Totals& totals);
+    };
+
+    extern Registry registry;
+
+    inline ConnCounters*
+    acquire(const std::string& name)
+    {
+        if (!registry.enabled.load(std::memory_order_relaxed))
+            return NULL;
+        return registry.acquire(name);
+    }
+
+    inline void
+    release(ConnCounters* counters)
+    {
+        if (counters)
+            registry.release(counters);
+    }
+
+    // Serves the registry over HTTP, on TCP or a unix socket, to one client at
+    // a time. Any GET of /metrics (or /) gets the metrics.
+    struct Exporter
+    {
+        tcp::Socket sock;
+        int pfd[2];
+        uint64_t scrapes;
+        std::thread exporterThread;
+
+        Exporter(const ip::sockaddr& addr, const std::string& role);
+        ~Exporter();
+
+    protected:
+        void serve();
+        void handle(int fd);
+    };
+
+    // <port>, <ip>:<port>, [<ipv6>]:<port> or a unix socket path. A port on
+    // its own listens on all the IPv4 addresses.
+    ip::sockaddr parseEndpoint(const std::string& str);
+}
+#endif /* __METRICS_H */
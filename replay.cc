@@ -0,0 +1,141 @@
+#include "replay.h"
+#include "helper.h"
+
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Digits at p, up to end, into value. False if there are none.
+static bool
+replay_parseUint(const char*& p, const char* end, uint64_t& value)
+{
+    const char* start = p;
+    value = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+        value = value * 10 + (*p++ - '0');
+    return p != start;
+}
+
+app::ReplayTrace::ReplayTrace(const string& path, uint32_t numFlows) :
+    path(path),
+    data(NULL),
+    len(0),
+    binary(false),
+    flows(numFlows)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1)
+        throw std::runtime_error(ERRSTR("Error opening the replay trace"));
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !st.st_size)
+    {
+        close(fd);
+        throw std::runtime_error(ERRSTR("Empty replay trace"));
+    }
+
+    void* mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+        throw std::runtime_error(ERRSTR("Error mapping the replay trace"));
+    data = (const char *) mem;
+    len = st.st_size;
+
+    const ReplayFileHeader* hdr = (const ReplayFileHeader *) data;
+    if (len >= sizeof(*hdr) && hdr->magic == REPLAY_MAGIC)
+    {
+        if (hdr->version != REPLAY_VERSION ||
+            hdr->recordSize != sizeof(ReplayRecord))
+        {
+            munmap(mem, len);
+            throw std::runtime_error(ERRSTR("Unsupported replay trace "
+                                            "version"));
+        }
+        binary = true;
+    }
+
+    // The index is built front to back. The drivers then read their flows
+    // all at once, each from its own place in the file.
+    madvise(mem, len, MADV_SEQUENTIAL);
+    size_t pos = 0;
+    ReplayRecord rec;
+    for (size_t at = 0; next(pos, rec); at = pos)
+    {
+        if (rec.flow < numFlows)
+            flows[rec.flow].push_back(at);
+    }
+    madvise(mem, len, MADV_NORMAL);
+}
+
+app::ReplayTrace::~ReplayTrace()
+{
+    munmap((void *) data, len);
+}
+
+bool
+app::ReplayTrace::next(size_t& pos, app::ReplayRecord& rec) const
+{
+    if (!binary)
+        return nextCSV(pos, rec);
+
+    // A record cut short at the end of the file is left out
+    if (pos < sizeof(ReplayFileHeader))
+        pos = sizeof(ReplayFileHeader);
+    if (pos + sizeof(rec) > len)
+        return false;
+    rec = *(const ReplayRecord *) (data + pos);
+    pos += sizeof(rec);
+    return true;
+}
+
+// Parsed again from where the message is, a CSV trace is not kept parsed
+bool
+app::ReplayTrace::message(uint32_t flow, size_t i, app::ReplayRecord& rec) const
+{
+    if (flow >= flows.size() || i >= flows[flow].size())
+        return false;
+
+    size_t pos = flows[flow][i];
+    return next(pos, rec);
+}
+
+// Lines that don't start with a digit, like a header, are skipped, and so
+// are malformed ones. The time may have a fraction, down to ns.
+bool
+app::ReplayTrace::nextCSV(size_t& pos, app::ReplayRecord& rec) const
+{
+    const char* end = data + len;
+    while (pos < len)
+    {
+        const char* p = data + pos;
+        const char* eol = p;
+        while (eol < end && *eol != '\n')
+            eol++;
+        pos = eol - data + 1;
+
+        uint64_t flow, us, size;
+        if (!replay_parseUint(p, eol, flow) || p == eol || *p++ != ',' ||
+            !replay_parseUint(p, eol, us))
+            continue;
+        uint64_t ns = us * 1000;
+        if (p < eol && *p == '.')
+        {
+            uint64_t scale = 100;
+            for (p++; p < eol && *p >= '0' && *p <= '9'; p++, scale /= 10)
+                ns += (*p - '0') * scale;
+        }
+        if (p == eol || *p++ != ',' || !replay_parseUint(p, eol, size) ||
+            size > UINT32_MAX || flow > UINT32_MAX)
+            continue;
+
+        rec.timeNs = ns;
+        rec.flow = flow;
+        rec.size = size;
+        return true;
+    }
+
+    return false;
+}
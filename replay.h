@@ -0,0 +1,62 @@
+#ifndef __REPLAY_H
+#define __REPLAY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace app
+{
+// "PFREPLAY", little endian
+#define REPLAY_MAGIC   0x59414c5045524650ULL
+#define REPLAY_VERSION 1
+
+    // A message of a recorded flow: its size, and when it was sent relative
+    // to the start of the trace
+    struct ReplayRecord
+    {
+        uint64_t timeNs;
+        uint32_t flow;
+        uint32_t size;
+    };
+
+    // The binary format is this header followed by packed ReplayRecords
+    struct ReplayFileHeader
+    {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t recordSize;
+    };
+
+    // A trace of the messages of many flows, sorted by time within a flow.
+    // Either CSV, with one <flow>,<time in us>,<size in bytes> line per
+    // message, or the binary format. The file is mmap'd and indexed by flow
+    // in one pass, so only the pages being replayed and the offsets of the
+    // replayed flows have to be in memory. Every driver walks the messages of
+    // its own flow only.
+    struct ReplayTrace
+    {
+        std::string path;
+        const char* data;
+        size_t len;
+        bool binary;
+        // Where the messages of flows 0 to numFlows - 1 are, in trace order.
+        // The other flows are not replayed.
+        std::vector<std::vector<size_t>> flows;
+
+        // The first message at or after pos, which moves past it. False at
+        // the end of the trace.
+        bool next(size_t& pos, ReplayRecord& rec) const;
+        // The i-th message of the flow. False past its last one.
+        bool message(uint32_t flow, size_t i, ReplayRecord& rec) const;
+
+        ReplayTrace(const std::string& path, uint32_t numFlows);
+        ~ReplayTrace();
+
+    protected:
+        bool nextCSV(size_t& pos, ReplayRecord& rec) const;
+    };
+}
+
+#endif /* __REPLAY_H */
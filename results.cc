@@ -0,0 +1,319 @@
+#include "results.h"
+#include "helper.h"
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <unistd.h>
+
+using namespace std;
+
+static string
+results_escape(const string& str)
+{
+    stringstream out;
+    for (char c : str)
+    {
+        switch (c)
+        {
+        case '"':
+            out << "\\\"";
+            break;
+        case '\\':
+            out << "\\\\";
+            break;
+        case '\n':
+            out << "\\n";
+            break;
+        default:
+            if ((unsigned char) c < 0x20)
+                out << "\\u00" << "0123456789abcdef"[c >> 4]
+                    << "0123456789abcdef"[c & 0xf];
+            else
+                out << c;
+        }
+    }
+
+    return out.str();
+}
+
+static void
+results_writeJSONEntries(ostream& out,
+                         const vector<results::ConfigEntry>& entries)
+{
+    out << "{";
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        const results::ConfigEntry& ce = entries[i];
+        out << ((i) ? ", " : "") << "\"" << results_escape(ce.key) << "\": ";
+        if (ce.numeric)
+            out << ce.value;
+        else
+            out << "\"" << results_escape(ce.value) << "\"";
+    }
+    out << "}";
+}
+
+static void
+results_writeJSONConn(ostream& out, const results::ConnResult& conn)
+{
+    out << "{\"name\": \"" << results_escape(conn.name) << "\"";
+    if (!conn.direction.empty())
+        out << ", \"direction\": \"" << conn.direction << "\"";
+    if (!conn.raddr.empty())
+        out << ", \"raddr\": \"" << results_escape(conn.raddr) << "\"";
+    out << ", \"bytes\": " << conn.bytes;
+    out << ", \"duration_sec\": " << conn.durationSec;
+    out << ", \"throughput_bps\": " << conn.throughput();
+    out << ", \"cpu_sec\": " << conn.cpu.cpuSec;
+    out << ", \"cpu_sec_per_gb\": " << conn.cpu.cpuSecPerGB(conn.totalBytes());
+    out << ", \"ctx_switches\": " << conn.cpu.ctxSwitches;
+    out << ", \"retransmits\": " << conn.retransmits;
+    if (conn.warmupBytes || conn.cooldownBytes)
+    {
+        out << ", \"warmup_bytes\": " << conn.warmupBytes;
+        out << ", \"cooldown_bytes\": " << conn.cooldownBytes;
+    }
+    if (conn.tailBytes)
+        out << ", \"tail_bytes\": " << conn.tailBytes;
+    if (conn.hasPeer)
+    {
+        out << ", \"peer_bytes\": " << conn.peerBytes;
+        out << ", \"peer_duration_sec\": " << conn.peerDurationSec;
+        out << ", \"goodput_bps\": " << conn.peerGoodput();
+    }
+    if (conn.cpu.hwCounters)
+    {
+        out << ", \"cycles\": " << conn.cpu.cycles;
+        out << ", \"instructions\": " << conn.cpu.instructions;
+        out << ", \"cache_misses\": " << conn.cpu.cacheMisses;
+        out << ", \"cycles_per_byte\": "
+            << conn.cpu.cyclesPerByte(conn.totalBytes());
+    }
+    out << "}";
+}
+
+static void
+results_writeCSVConn(ostream& out, const string& record,
+                     const results::ConnResult& conn)
+{
+    out << record << "," << conn.name << "," << conn.raddr << ",";
+    out << conn.bytes << "," << conn.durationSec << ",";
+    out << conn.throughput() << "," << conn.cpu.cpuSec << ",";
+    out << conn.cpu.cpuSecPerGB(conn.totalBytes()) << ",";
+    if (conn.cpu.hwCounters)
+        out << conn.cpu.cyclesPerByte(conn.totalBytes());
+    out << ",";
+    if (conn.hasPeer)
+        out << conn.peerBytes << "," << conn.peerGoodput();
+    else
+        out << ",";
+    out << "," << conn.warmupBytes << "," << conn.cooldownBytes << ",";
+    out << conn.direction << "," << conn.retransmits << ",";
+    out << conn.tailBytes << "\n";
+}
+
+results::Format
+results::parseFormat(const string& str)
+{
+    if (str == "human")
+        return human;
+    if (str == "json")
+        return json;
+    if (str == "csv")
+        return csv;
+
+    throw std::invalid_argument(ERRSTR("Unknown results format"));
+}
+
+// Everything that was sent, the CPU cost covers all of it
+uint64_t
+results::ConnResult::totalBytes() const
+{
+    return bytes + warmupBytes + cooldownBytes + tailBytes;
+}
+
+uint64_t
+results::ConnResult::throughput() const
+{
+    return (durationSec > 0) ? (bytes / durationSec) * 8 : 0;
+}
+
+uint64_t
+results::ConnResult::peerGoodput() const
+{
+    return (peerDurationSec > 0) ? (peerBytes / peerDurationSec) * 8 : 0;
+}
+
+uint64_t
+results::Sample::throughput() const
+{
+    return (intervalSec > 0) ? (bytes / intervalSec) * 8 : 0;
+}
+
+results::Report::Report(const string& role) :
+    role(role),
+    total({"total", "", 0, 0, stats::CPUStats()})
+{
+}
+
+void
+results::Report::addConfig(const string& key, const string& value)
+{
+    config.push_back({key, value, false});
+}
+
+void
+results::Report::addConfig(const string& key, uint64_t value)
+{
+    config.push_back({key, to_string(value), true});
+}
+
+void
+results::Report::addMetric(const string& key, double value)
+{
+    stringstream str;
+    str.precision(15);
+    str << value;
+    metrics.push_back({key, str.str(), true});
+}
+
+results::Writer::Writer(const results::Format format, const string& path) :
+    format(format),
+    path(path),
+    fd(-1)
+{
+    if (format == human || (!path.empty() && path != "-"))
+        return;
+
+    cout.flush();
+    fflush(stdout);
+    fd = dup(STDOUT_FILENO);
+    if (fd == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1)
+        throw std::runtime_error(ERRSTR("Error moving the output to stderr"));
+}
+
+results::Writer::~Writer()
+{
+    if (fd != -1)
+        close(fd);
+}
+
+void
+results::Writer::write(const results::Report& report)
+{
+    if (format == human)
+        return;
+
+    ofstream file;
+    stringstream doc;
+    ostream* out = &doc;
+    if (fd == -1)
+    {
+        file.open(path.c_str(), ios::out | ios::trunc);
+        if (!file)
+            throw std::runtime_error(ERRSTR("Error opening results file"));
+        out = &file;
+    }
+
+    if (format == json)
+        writeJSON(*out, report);
+    else
+        writeCSV(*out, report);
+
+    out->flush();
+    if (fd == -1)
+        return;
+
+    string str = doc.str();
+    size_t done = 0;
+    while (done < str.size())
+    {
+        ssize_t rc = ::write(fd, str.data() + done, str.size() - done);
+        if (rc == -1 && errno == EINTR)
+            continue;
+        if (rc == -1)
+            throw std::runtime_error(ERRSTR("Error writing the results"));
+        done += rc;
+    }
+}
+
+void
+results::writeJSON(ostream& out, const results::Report& report)
+{
+    out << "{\n";
+    out << "  \"role\": \"" << results_escape(report.role) << "\",\n";
+
+    out << "  \"config\": ";
+    results_writeJSONEntries(out, report.config);
+    out << ",\n";
+    out << "  \"metrics\": ";
+    results_writeJSONEntries(out, report.metrics);
+    out << ",\n";
+
+    out << "  \"connections\": [";
+    for (size_t i = 0; i < report.conns.size(); i++)
+    {
+        out << ((i) ? ",\n    " : "\n    ");
+        results_writeJSONConn(out, report.conns[i]);
+    }
+    out << "\n  ],\n";
+
+    if (!report.groups.empty())
+    {
+        out << "  \"groups\": [";
+        for (size_t i = 0; i < report.groups.size(); i++)
+        {
+            out << ((i) ? ",\n    " : "\n    ");
+            results_writeJSONConn(out, report.groups[i]);
+        }
+        out << "\n  ],\n";
+    }
+
+    out << "  \"aggregate\": ";
+    results_writeJSONConn(out, report.total);
+    out << ",\n";
+
+    out << "  \"samples\": [";
+    for (size_t i = 0; i < report.samples.size(); i++)
+    {
+        const Sample& s = report.samples[i];
+        out << ((i) ? ",\n    " : "\n    ");
+        out << "{\"time_sec\": " << s.timeSec;
+        if (!s.direction.empty())
+            out << ", \"direction\": \"" << s.direction << "\"";
+        out << ", \"interval_sec\": " << s.intervalSec;
+        out << ", \"bytes\": " << s.bytes;
+        out << ", \"throughput_bps\": " << s.throughput() << "}";
+    }
+    out << "\n  ]\n";
+    out << "}\n";
+}
+
+void
+results::writeCSV(ostream& out, const results::Report& report)
+{
+    // Configuration goes into comment lines so that every row shares the
+    // same columns
+    out << "# role=" << report.role << "\n";
+    for (auto& ce : report.config)
+        out << "# " << ce.key << "=" << ce.value << "\n";
+    for (auto& ce : report.metrics)
+        out << "# metric." << ce.key << "=" << ce.value << "\n";
+
+    out << "record,name,raddr,bytes,duration_sec,throughput_bps,cpu_sec,"
+           "cpu_sec_per_gb,cycles_per_byte,peer_bytes,goodput_bps,warmup_bytes,"
+           "cooldown_bytes,direction,retransmits,tail_bytes\n";
+    for (auto& conn : report.conns)
+        results_writeCSVConn(out, "conn", conn);
+    for (auto& group : report.groups)
+        results_writeCSVConn(out, "group", group);
+    results_writeCSVConn(out, "total", report.total);
+
+    for (auto& s : report.samples)
+    {
+        out << "sample," << s.timeSec << ",," << s.bytes << ",";
+        out << s.intervalSec << "," << s.throughput() << ",,,,,,,,";
+        out << s.direction << ",,\n";
+    }
+}
@@ -0,0 +1,105 @@
+#ifndef __RESULTS_H
+#define __RESULTS_H
+
+#include "stats.h"
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace results
+{
+    enum Format
+    {
+        human,
+        json,
+        csv,
+    };
+
+    Format parseFormat(const std::string& str);
+
+    struct ConfigEntry
+    {
+        std::string key;
+        std::string value;
+        bool numeric;
+    };
+
+    struct ConnResult
+    {
+        std::string name;
+        std::string raddr;
+        uint64_t bytes;
+        double durationSec;
+        stats::CPUStats cpu;
+        // What the other end measured, when it reported back
+        bool hasPeer;
+        uint64_t peerBytes;
+        double peerDurationSec;
+        // Sent outside the steady-state window that bytes covers
+        uint64_t warmupBytes;
+        uint64_t cooldownBytes;
+        // "tx" or "rx" when the connection carries traffic both ways
+        std::string direction;
+        // TCP segments the sender retransmitted
+        uint64_t retransmits;
+        // Sent after the steady-state window when there is no cool-down
+        uint64_t tailBytes;
+
+        uint64_t totalBytes() const;
+        uint64_t throughput() const;
+        uint64_t peerGoodput() const;
+    };
+
+    // Bytes transferred by all connections during one sampling interval
+    struct Sample
+    {
+        double timeSec;
+        double intervalSec;
+        uint64_t bytes;
+        std::string direction;
+
+        uint64_t throughput() const;
+    };
+
+    // Everything a test run produces. A report is only assembled once the
+    // test is over, so none of this is touched from the send/receive paths.
+    struct Report
+    {
+        std::string role;
+        std::vector<ConfigEntry> config;
+        // Role specific results that do not fit the per-connection records
+        std::vector<ConfigEntry> metrics;
+        std::vector<ConnResult> conns;
+        // Subtotals over groups of connections, e.g. per destination
+        std::vector<ConnResult> groups;
+        std::vector<Sample> samples;
+        ConnResult total;
+
+        void addConfig(const std::string& key, const std::string& value);
+        void addConfig(const std::string& key, uint64_t value);
+        void addMetric(const std::string& key, double value);
+
+        Report(const std::string& role);
+    };
+
+    struct Writer
+    {
+        const Format format;
+        const std::string path;
+        // Where a document for stdout goes, -1 if there is none
+        int fd;
+
+        void write(const Report& report);
+
+        // An empty path or "-" writes to stdout. A JSON or CSV document then
+        // has stdout to itself, so it parses: everything else the app prints
+        // goes to stderr from here on.
+        Writer(const Format format, const std::string& path = "");
+        ~Writer();
+    };
+
+    void writeJSON(std::ostream& out, const Report& report);
+    void writeCSV(std::ostream& out, const Report& report);
+}
+#endif /* __RESULTS_H */
@@ -0,0 +1,355 @@
+#include "shm.h"
+#include "helper.h"
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <stdexcept>
+#include <string.h>
+#include <thread>
+
+// The ring headers get a page of their own, so the data stays page aligned
+#define SHM_HDR_LEN    4096
+#define SHM_REGION_LEN (SHM_HDR_LEN + SHM_RING_SIZE)
+// How long the server waits for the rings after the Hello
+#define SHM_SETUP_TIMEOUT_MS 5000
+
+shm::Socket::Socket(const int fd, const ip::sockaddr& addr) :
+    tcp::Socket(fd, addr),
+    mem(NULL),
+    memLen(0),
+    tx(NULL),
+    rx(NULL),
+    txData(NULL),
+    rxData(NULL),
+    txHead(0),
+    txTailCache(0),
+    rxTail(0),
+    rxHeadCache(0),
+    peerGone(false)
+{
+}
+
+shm::Socket::Socket(const ip::sockaddr& addr) :
+    tcp::Socket(addr),
+    mem(NULL),
+    memLen(0),
+    tx(NULL),
+    rx(NULL),
+    txData(NULL),
+    rxData(NULL),
+    txHead(0),
+    txTailCache(0),
+    rxTail(0),
+    rxHeadCache(0),
+    peerGone(false)
+{
+    if (!addr.isUnix())
+        throw std::runtime_error(ERRSTR("Shared memory needs a unix socket"));
+}
+
+shm::Socket::~Socket()
+{
+    if (mem)
+        munmap(mem, memLen);
+}
+
+// The creator produces into the first ring and consumes from the second
+void
+shm::Socket::mapRings(int memFd, bool creator)
+{
+    memLen = 2 * SHM_REGION_LEN;
+    mem = mmap(NULL, memLen, PROT_READ | PROT_WRITE, MAP_SHARED, memFd, 0);
+    if (mem == MAP_FAILED)
+    {
+        mem = NULL;
+        throw std::runtime_error(ERRSTR("Error mapping the rings"));
+    }
+
+    char* region[2] = {(char *) mem, (char *) mem + SHM_REGION_LEN};
+    if (creator)
+    {
+        new (region[0]) Ring();
+        new (region[1]) Ring();
+    }
+
+    int txIdx = (creator) ? 0 : 1;
+    tx = (Ring *) region[txIdx];
+    rx = (Ring *) region[1 - txIdx];
+    txData = region[txIdx] + SHM_HDR_LEN;
+    rxData = region[1 - txIdx] + SHM_HDR_LEN;
+}
+
+void
+shm::Socket::setupRings()
+{
+    // The name is gone as soon as the fd is passed on
+    char name[64];
+    snprintf(name, sizeof(name), "/perftool-%d-%d", (int) getpid(), fd);
+    int memFd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (memFd == -1)
+        throw std::runtime_error(ERRSTR("Error creating shared memory"));
+    shm_unlink(name);
+
+    try
+    {
+        if (ftruncate(memFd, 2 * SHM_REGION_LEN) == -1)
+            throw std::runtime_error(ERRSTR("Error sizing shared memory"));
+        mapRings(memFd, true);
+
+        char byte = 0;
+        struct iovec iov;
+        iov.iov_base = &byte;
+        iov.iov_len  = sizeof(byte);
+        char control[CMSG_SPACE(sizeof(int))];
+        memset(control, 0, sizeof(control));
+
+        struct msghdr mh = {};
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &memFd, sizeof(int));
+
+        if (::sendmsg(fd, &mh, 0) != 1)
+            throw std::runtime_error(ERRSTR("Error passing the rings"));
+    }
+    catch (...)
+    {
+        close(memFd);
+        throw;
+    }
+
+    close(memFd);
+}
+
+void
+shm::Socket::acceptRings()
+{
+    struct pollfd pfd = {fd, POLLIN, 0};
+    int rc;
+    do
+    {
+        rc = ::poll(&pfd, 1, SHM_SETUP_TIMEOUT_MS);
+    } while (rc == -1 && errno == EINTR);
+    if (rc != 1)
+        throw std::runtime_error(ERRSTR("No rings from the client"));
+
+    char byte;
+    struct iovec iov;
+    iov.iov_base = &byte;
+    iov.iov_len  = sizeof(byte);
+    char control[CMSG_SPACE(sizeof(int))];
+
+    struct msghdr mh = {};
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control;
+    mh.msg_controllen = sizeof(control);
+    if (::recvmsg(fd, &mh, 0) != 1)
+        throw std::runtime_error(ERRSTR("Error receiving the rings"));
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&mh);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS)
+        throw std::runtime_error(ERRSTR("No rings from the client"));
+
+    int memFd;
+    memcpy(&memFd, CMSG_DATA(cmsg), sizeof(int));
+    struct stat st;
+    if (fstat(memFd, &st) == -1 || st.st_size != 2 * SHM_REGION_LEN)
+    {
+        close(memFd);
+        throw std::runtime_error(ERRSTR("Rings of the wrong size"));
+    }
+
+    try
+    {
+        mapRings(memFd, false);
+    }
+    catch (...)
+    {
+        close(memFd);
+        throw;
+    }
+    close(memFd);
+}
+
+void
+shm::Socket::ringDoorbell()
+{
+    char byte = 0;
+#ifdef __linux__
+    ::send(fd, &byte, sizeof(byte), MSG_DONTWAIT | MSG_NOSIGNAL);
+#else
+    ::send(fd, &byte, sizeof(byte), MSG_DONTWAIT);
+#endif
+    // A full socket already has wake-ups queued, a dead peer is found out by
+    // the next wait
+}
+
+// Only pays for a system call when the reader went to sleep
+void
+shm::Socket::publish()
+{
+    tx->head.store(txHead);
+    if (tx->readerWaiting.load() && tx->readerWaiting.exchange(0))
+        ringDoorbell();
+}
+
+// The reader is behind. Yield for a bit, then back off to short sleeps, and
+// give up once the connection is shut down.
+void
+shm::Socket::waitForSpace()
+{
+    for (int spins = 0; ; spins++)
+    {
+        if (tx->closed.load())
+            throw std::runtime_error(ERRSTR("Connection shut down"));
+
+        txTailCache = tx->tail.load(std::memory_order_acquire);
+        if (txHead - txTailCache < SHM_RING_SIZE)
+            return;
+
+        if (spins < 64)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+
+        struct pollfd pfd = {fd, 0, 0};
+        if (::poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLHUP | POLLERR)))
+            throw std::runtime_error(ERRSTR("Peer closed the connection"));
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+}
+
+void
+shm::Socket::writeBlock(struct iovec *iov, int iovcnt, size_t iovlen)
+{
+    if (!tx)
+    {
+        tcp::Socket::writeBlock(iov, iovcnt, iovlen);
+        return;
+    }
+
+    for (int i = 0; i < iovcnt; i++)
+    {
+        const char* p = (const char *) iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+        while (len)
+        {
+            uint64_t space = SHM_RING_SIZE - (txHead - txTailCache);
+            if (!space)
+            {
+                txTailCache = tx->tail.load(std::memory_order_acquire);
+                space = SHM_RING_SIZE - (txHead - txTailCache);
+            }
+            if (!space)
+            {
+                // Let the reader drain what is there before waiting on it
+                publish();
+                waitForSpace();
+                continue;
+            }
+
+            size_t off = txHead & (SHM_RING_SIZE - 1);
+            size_t n = std::min((uint64_t) len,
+                                std::min(space, (uint64_t) SHM_RING_SIZE - off));
+            memcpy(txData + off, p, n);
+            txHead += n;
+            p += n;
+            len -= n;
+        }
+    }
+
+    publish();
+}
+
+// Returns -1 with EAGAIN when the ring is empty, once the writer has been
+// asked to wake us up through the socket
+ssize_t
+shm::Socket::recv(void* buf, size_t bufLen)
+{
+    if (!rx)
+        return tcp::Socket::recv(buf, bufLen);
+
+    bool armed = false;
+    for (;;)
+    {
+        uint64_t avail = rxHeadCache - rxTail;
+        if (!avail)
+        {
+            rxHeadCache = rx->head.load(std::memory_order_acquire);
+            avail = rxHeadCache - rxTail;
+        }
+        if (avail)
+        {
+            size_t off = rxTail & (SHM_RING_SIZE - 1);
+            size_t n = std::min((uint64_t) bufLen,
+                                std::min(avail, (uint64_t) SHM_RING_SIZE - off));
+            memcpy(buf, rxData + off, n);
+            rxTail += n;
+            rx->tail.store(rxTail, std::memory_order_release);
+            return n;
+        }
+
+        // The writer closes after its last publish, look once more
+        if (rx->closed.load() || peerGone)
+        {
+            if (rx->head.load() != rxTail)
+                continue;
+            return 0;
+        }
+
+        if (armed)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        // Consume the wake-ups so far, then arm and look once more
+        char drain[64];
+        for (;;)
+        {
+            ssize_t rc = ::recv(fd, drain, sizeof(drain), MSG_DONTWAIT);
+            if (rc > 0)
+                continue;
+            if (rc == 0)
+                peerGone = true;
+            break;
+        }
+        rx->readerWaiting.store(1);
+        armed = true;
+    }
+}
+
+// Reading from the ring never blocks anyway
+ssize_t
+shm::Socket::recvNonBlocking(void* buf, size_t bufLen)
+{
+    if (!rx)
+        return tcp::Socket::recvNonBlocking(buf, bufLen);
+
+    return recv(buf, bufLen);
+}
+
+void
+shm::Socket::shutdownWrite()
+{
+    if (!tx)
+    {
+        tcp::Socket::shutdownWrite();
+        return;
+    }
+
+    tx->closed.store(1);
+    tx->readerWaiting.store(0);
+    ringDoorbell();
+}
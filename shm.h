@@ -0,0 +1,66 @@
+#ifndef __SHM_H
+#define __SHM_H
+
+#include "tcp.h"
+
+#include <atomic>
+
+// A stream over a pair of single-producer/single-consumer rings in shared
+// memory, one per direction. The rings are set up over a unix socket, which
+// then only carries wake-ups: a reader with nothing to read arms its ring and
+// polls the socket, and the writer sends it a byte once there is data. Until
+// the rings are set up the socket is used as is, so a Hello can go first.
+namespace shm
+{
+// Power of two
+#define SHM_RING_SIZE (4 * 1024 * 1024)
+
+    struct Ring
+    {
+        // Free running byte counts, written by the producer and the consumer
+        alignas(64) std::atomic<uint64_t> head;
+        alignas(64) std::atomic<uint64_t> tail;
+        // Set by a consumer that is about to sleep
+        alignas(64) std::atomic<uint32_t> readerWaiting;
+        // Set once the producer is done
+        std::atomic<uint32_t> closed;
+    };
+
+    struct Socket : public tcp::Socket
+    {
+        void* mem;
+        size_t memLen;
+        Ring* tx;
+        Ring* rx;
+        char* txData;
+        char* rxData;
+        // Local copies, to touch the peer's cache line less often
+        uint64_t txHead;
+        uint64_t txTailCache;
+        uint64_t rxTail;
+        uint64_t rxHeadCache;
+        bool peerGone;
+
+        // Client side: creates the rings and passes them to the peer
+        void setupRings();
+        // Server side: maps the rings the client passed
+        void acceptRings();
+
+        virtual void writeBlock(struct iovec *iov, int iovcnt, size_t iovlen);
+        virtual ssize_t recv(void* buf, size_t bufLen);
+        virtual ssize_t recvNonBlocking(void* buf, size_t bufLen);
+        virtual void shutdownWrite();
+
+        Socket(const int fd, const ip::sockaddr& addr);
+        Socket(const ip::sockaddr& addr);
+        virtual ~Socket();
+
+    protected:
+        void mapRings(int memFd, bool creator);
+        void publish();
+        void ringDoorbell();
+        void waitForSpace();
+    };
+}
+
+#endif /* __SHM_H */
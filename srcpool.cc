@@ -0,0 +1,282 @@
+#include "srcpool.h"
+#include "helper.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+
+using namespace std;
+
+// The key from the Microsoft RSS specification, that many NICs default to
+static const uint8_t srcpool_defaultKey[SRC_RSS_KEY_LEN] =
+{
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+static void
+srcpool_setPort(ip::sockaddr& addr, uint16_t port)
+{
+    if (addr.sa.sa_family == AF_INET6)
+        addr.ipv6.sin6_port = htons(port);
+    else
+        addr.ipv4.sin_port = htons(port);
+}
+
+static void
+srcpool_parseKey(const string& str, uint8_t* key)
+{
+    size_t len = 0;
+    for (size_t i = 0; i < str.size(); )
+    {
+        if (str[i] == ':')
+        {
+            i++;
+            continue;
+        }
+        if (len == SRC_RSS_KEY_LEN || i + 1 >= str.size() ||
+            !isxdigit(str[i]) || !isxdigit(str[i + 1]))
+            throw std::invalid_argument(ERRSTR("Malformed RSS key"));
+
+        key[len++] = stoi(str.substr(i, 2), NULL, 16);
+        i += 2;
+    }
+
+    if (len != SRC_RSS_KEY_LEN)
+        throw std::invalid_argument(ERRSTR("The RSS key has to be 40 bytes"));
+}
+
+app::SourceConfig::SourceConfig(const ip::sockaddr& addr) :
+    addrs(1, addr),
+    portLo(0),
+    portHi(0),
+    rssQueues(0)
+{
+}
+
+app::SourceConfig::SourceConfig() :
+    portLo(0),
+    portHi(0),
+    rssQueues(0)
+{
+}
+
+void
+app::SourceConfig::parseAddrs(const string& str)
+{
+    stringstream ss(str);
+    string addr;
+    addrs.clear();
+    while (getline(ss, addr, ','))
+        addrs.push_back(ip::sockaddr(addr, 0));
+}
+
+void
+app::SourceConfig::parsePorts(const string& str)
+{
+    size_t pos = str.find('-');
+    int lo = stoi(str.substr(0, pos));
+    int hi = (pos == string::npos) ? lo : stoi(str.substr(pos + 1));
+    if (lo < 1 || hi > 65535 || lo > hi)
+        throw std::invalid_argument(ERRSTR("Invalid source port range"));
+
+    portLo = lo;
+    portHi = hi;
+}
+
+app::Source::Source(const ip::sockaddr& addr, uint32_t numPorts) :
+    addr(addr),
+    usedPorts(numPorts, false),
+    nextPort(0),
+    connects(0),
+    failures(0)
+{
+}
+
+void
+app::Source::addConnect(const chrono::steady_clock::time_point& start,
+                        bool ok)
+{
+    chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lg(lock);
+    if (!connects && !failures)
+    {
+        firstConnect = start;
+        lastConnect = now;
+    }
+    firstConnect = min(firstConnect, start);
+    lastConnect = max(lastConnect, now);
+
+    if (!ok)
+    {
+        failures++;
+        return;
+    }
+    connects++;
+    connectTime.add(chrono::duration_cast<chrono::nanoseconds>(
+                        now - start).count());
+}
+
+double
+app::Source::connectRate() const
+{
+    chrono::duration<double> elapsed = lastConnect - firstConnect;
+    return (elapsed.count() > 0) ? connects / elapsed.count() : 0;
+}
+
+string
+app::Source::statsString() const
+{
+    stringstream str;
+    str.precision(4);
+    str << addr.toString() << ": " << connects << " connects, " << failures
+        << " failures, " << connectRate() << " connects/sec";
+    if (connects)
+        str << ", connect p50 " << connectTime.percentile(50) / 1e3
+            << " us, p99 " << connectTime.percentile(99) / 1e3 << " us";
+    return str.str();
+}
+
+app::SourcePool::SourcePool(const app::SourceConfig& config) :
+    config(config),
+    numBound(0)
+{
+    if (config.addrs.empty())
+        throw std::invalid_argument(ERRSTR("Need at least 1 source address"));
+    if (!config.portLo != !config.portHi)
+        throw std::invalid_argument(ERRSTR("Invalid source port range"));
+    // Only explicit ports can be picked by their hash
+    if (config.rssQueues && !config.portLo)
+        throw std::invalid_argument(ERRSTR("Spreading over RSS queues needs a "
+                                           "source port range"));
+
+    if (config.rssKey.empty())
+        memcpy(rssKey, srcpool_defaultKey, sizeof(rssKey));
+    else
+        srcpool_parseKey(config.rssKey, rssKey);
+
+    uint32_t numPorts = (config.portLo) ?
+        config.portHi - config.portLo + 1 : 0;
+    for (auto& addr : config.addrs)
+    {
+        if (addr.isUnix() ||
+            addr.sa.sa_family != config.addrs.front().sa.sa_family)
+            throw std::invalid_argument(ERRSTR("Source addresses have to be "
+                                               "of the same IP family"));
+        sources.push_back(new Source(addr, numPorts));
+    }
+}
+
+app::SourcePool::~SourcePool()
+{
+    for (auto source : sources)
+        delete source;
+}
+
+app::Source*
+app::SourcePool::bind(ip::Socket* sock, const ip::sockaddr& raddr)
+{
+    uint64_t conn = numBound++;
+    Source* source = sources[conn % sources.size()];
+    sock->addr = source->addr;
+    if (!config.portLo)
+    {
+        sock->setBindAddressNoPort();
+        sock->bind();
+        return source;
+    }
+
+    // Ports of connections that were closed by a previous run may still be
+    // in TIME_WAIT
+    sock->setReuseAddr();
+    uint32_t queue = (config.rssQueues) ? conn % config.rssQueues : 0;
+    for (;;)
+    {
+        srcpool_setPort(sock->addr, takePort(source, queue, raddr));
+        if (::bind(sock->fd, &sock->addr.sa, sock->addr.sa_len) == 0)
+            return source;
+        // Something else has the port, it is skipped from now on
+        if (errno != EADDRINUSE)
+            throw std::runtime_error(ERRSTR("Error during socket bind"));
+    }
+}
+
+// Next unused port of the range, that hashes to the queue when spreading
+// over the RSS queues
+uint16_t
+app::SourcePool::takePort(app::Source* source, uint32_t queue,
+                          const ip::sockaddr& raddr)
+{
+    uint32_t numPorts = source->usedPorts.size();
+    ip::sockaddr laddr = source->addr;
+    for (uint32_t i = 0; i < numPorts; i++)
+    {
+        uint32_t idx = (source->nextPort + i) % numPorts;
+        if (source->usedPorts[idx])
+            continue;
+
+        srcpool_setPort(laddr, config.portLo + idx);
+        if (config.rssQueues && rssQueue(laddr, raddr) != queue)
+            continue;
+
+        source->usedPorts[idx] = true;
+        source->nextPort = idx + 1;
+        return config.portLo + idx;
+    }
+
+    throw std::runtime_error(ERRSTR("Source port range exhausted"));
+}
+
+// The hash covers the packets the server receives: the source is our end
+uint32_t
+app::SourcePool::rssQueue(const ip::sockaddr& laddr,
+                          const ip::sockaddr& raddr) const
+{
+    uint8_t data[36];
+    size_t len = 0;
+    if (laddr.sa.sa_family == AF_INET6)
+    {
+        memcpy(data, &laddr.ipv6.sin6_addr, 16);
+        memcpy(data + 16, &raddr.ipv6.sin6_addr, 16);
+        memcpy(data + 32, &laddr.ipv6.sin6_port, 2);
+        memcpy(data + 34, &raddr.ipv6.sin6_port, 2);
+        len = 36;
+    }
+    else
+    {
+        memcpy(data, &laddr.ipv4.sin_addr, 4);
+        memcpy(data + 4, &raddr.ipv4.sin_addr, 4);
+        memcpy(data + 8, &laddr.ipv4.sin_port, 2);
+        memcpy(data + 10, &raddr.ipv4.sin_port, 2);
+        len = 12;
+    }
+
+    uint32_t hash = toeplitzHash(rssKey, data, len);
+    return (hash % SRC_RSS_TABLE_SIZE) % config.rssQueues;
+}
+
+uint32_t
+app::toeplitzHash(const uint8_t* key, const uint8_t* data, size_t len)
+{
+    uint32_t hash = 0;
+    // The 32 bits of the key that line up with the current input bit
+    uint32_t window = ((uint32_t) key[0] << 24) | (key[1] << 16) |
+                      (key[2] << 8) | key[3];
+    for (size_t i = 0; i < len; i++)
+    {
+        for (int bit = 7; bit >= 0; bit--)
+        {
+            if (data[i] & (1 << bit))
+                hash ^= window;
+            window <<= 1;
+            if (key[i + 4] & (1 << bit))
+                window |= 1;
+        }
+    }
+
+    return hash;
+}
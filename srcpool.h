@@ -0,0 +1,103 @@
+#ifndef __SRCPOOL_H
+#define __SRCPOOL_H
+
+#include "ip.h"
+#include "stats.h"
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace app
+{
+// Entries of the RSS indirection table most NICs are set up with. The table
+// maps the low bits of the hash onto the receive queues, round robin.
+#define SRC_RSS_TABLE_SIZE 128
+#define SRC_RSS_KEY_LEN    40
+
+    // Where a client's connections come from
+    struct SourceConfig
+    {
+        std::vector<ip::sockaddr> addrs;
+        // Explicit local ports, both 0 leaves them to the kernel
+        uint16_t portLo;
+        uint16_t portHi;
+        // Pick the ports so that the connections spread evenly over this
+        // many receive queues of the server, 0 to not care
+        uint32_t rssQueues;
+        // The Toeplitz key of the server's NIC in hex, as ethtool -x shows
+        // it. The well-known default key if empty.
+        std::string rssKey;
+
+        // <addr>[,<addr>...]
+        void parseAddrs(const std::string& str);
+        // <lo>-<hi>
+        void parsePorts(const std::string& str);
+
+        SourceConfig(const ip::sockaddr& addr);
+        SourceConfig();
+    };
+
+    // A local address and the connections made from it. Connects are
+    // recorded from the driver threads.
+    struct Source
+    {
+        ip::sockaddr addr;
+        // Ports of the range handed out so far, and where to look next
+        std::vector<bool> usedPorts;
+        uint32_t nextPort;
+
+        std::mutex lock;
+        uint64_t connects;
+        uint64_t failures;
+        // Time to connect, in ns
+        stats::Histogram connectTime;
+        std::chrono::steady_clock::time_point firstConnect;
+        std::chrono::steady_clock::time_point lastConnect;
+
+        void addConnect(const std::chrono::steady_clock::time_point& start,
+                        bool ok);
+        // Connections established per second, from the first attempt to the
+        // last one done
+        double connectRate() const;
+        std::string statsString() const;
+
+        Source(const ip::sockaddr& addr, uint32_t numPorts);
+    };
+
+    // Hands out the local end of every connection, round robin over the
+    // addresses. Without a port range the socket binds with
+    // IP_BIND_ADDRESS_NO_PORT, so the kernel picks the port at connect time
+    // and can reuse it towards other destinations. That lifts the limit of
+    // one ephemeral port range per address and not per destination. Not
+    // thread safe, connections are set up from a single thread.
+    struct SourcePool
+    {
+        const SourceConfig config;
+        std::vector<Source*> sources;
+        uint8_t rssKey[SRC_RSS_KEY_LEN];
+        uint64_t numBound;
+
+        // Binds sock to the next source, to a port from the range if there is
+        // one. Returns the source the connection is accounted to.
+        Source* bind(ip::Socket* sock, const ip::sockaddr& raddr);
+        // The receive queue of the server that gets the packets from laddr
+        uint32_t rssQueue(const ip::sockaddr& laddr,
+                          const ip::sockaddr& raddr) const;
+
+        SourcePool(const SourceConfig& config);
+        ~SourcePool();
+
+    protected:
+        uint16_t takePort(Source* source, uint32_t queue,
+                          const ip::sockaddr& raddr);
+    };
+
+    // The Toeplitz hash NICs use for RSS, over the addresses and ports of
+    // the packet in network byte order
+    uint32_t toeplitzHash(const uint8_t* key, const uint8_t* data,
+                          size_t len);
+}
+#endif /* __SRCPOOL_H */
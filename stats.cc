@@ -0,0 +1,385 @@
+#include "stats.h"
+#include "helper.h"
+
+#include <cstring>
+#include <fstream>
+#include <sys/resource.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+using namespace std;
+
+static bool stats_perfEnabled = false;
+
+#ifdef __linux__
+static const uint64_t perfConfigs[stats::numPerfCounters] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+};
+
+// What a read() of the group leader returns
+struct stats_PerfGroup
+{
+    uint64_t nr;
+    uint64_t timeRunning;
+    uint64_t values[stats::numPerfCounters];
+};
+
+// The leader, groupFd -1, is enabled and read for the whole group
+static int
+stats_perfEventOpen(uint64_t config, bool excludeKernel, int groupFd)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = (groupFd == -1);
+    attr.exclude_kernel = excludeKernel;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    // pid 0, cpu -1: count the calling thread on whichever cpu it runs on
+    return syscall(__NR_perf_event_open, &attr, 0, -1, groupFd, 0);
+}
+#endif
+
+void
+stats::enablePerfCounters()
+{
+    stats_perfEnabled = true;
+}
+
+// Values below HIST_SUB_BUCKETS get a bucket each, above that every power of
+// two is split into HIST_SUB_BUCKETS linear buckets
+static uint32_t
+stats_histBucket(uint64_t value)
+{
+    if (value < HIST_SUB_BUCKETS)
+        return value;
+
+    uint32_t msb = 63 - __builtin_clzll(value);
+    uint32_t shift = msb - 4;
+    return (msb - 3) * HIST_SUB_BUCKETS +
+           ((value >> shift) & (HIST_SUB_BUCKETS - 1));
+}
+
+// Middle of the range of values that fall into a bucket
+static uint64_t
+stats_histValue(uint32_t bucket)
+{
+    if (bucket < HIST_SUB_BUCKETS)
+        return bucket;
+
+    uint32_t shift = bucket / HIST_SUB_BUCKETS - 1;
+    uint64_t sub = HIST_SUB_BUCKETS + bucket % HIST_SUB_BUCKETS;
+    return (sub << shift) + ((1ULL << shift) >> 1);
+}
+
+static uint64_t
+stats_threadCtxSwitches()
+{
+#ifdef __linux__
+    struct rusage ru;
+    if (getrusage(RUSAGE_THREAD, &ru) == -1)
+        return 0;
+
+    return ru.ru_nvcsw + ru.ru_nivcsw;
+#else
+    return 0;
+#endif
+}
+
+stats::CPUStats::CPUStats() :
+    cpuSec(0),
+    cycles(0),
+    instructions(0),
+    cacheMisses(0),
+    ctxSwitches(0),
+    hwCounters(true),
+    userOnly(false)
+{
+}
+
+stats::CPUStats&
+stats::CPUStats::operator+=(const stats::CPUStats& other)
+{
+    cpuSec       += other.cpuSec;
+    cycles       += other.cycles;
+    instructions += other.instructions;
+    cacheMisses  += other.cacheMisses;
+    ctxSwitches  += other.ctxSwitches;
+    hwCounters   &= other.hwCounters;
+    userOnly     |= other.userOnly;
+    return *this;
+}
+
+double
+stats::CPUStats::cpuSecPerGB(uint64_t bytes) const
+{
+    return (bytes) ? cpuSec / (bytes / 1e9) : 0;
+}
+
+double
+stats::CPUStats::cyclesPerByte(uint64_t bytes) const
+{
+    return (bytes && hwCounters) ? (double) cycles / bytes : 0;
+}
+
+std::string
+stats::CPUStats::toString(uint64_t bytes) const
+{
+    stringstream str;
+    str.precision(4);
+    str << "CPU: " << cpuSec << " sec, " << cpuSecPerGB(bytes)
+        << " CPU-sec/GB, " << ctxSwitches << " ctx switches";
+
+    if (!hwCounters)
+    {
+        str << ", hw counters n/a";
+        return str.str();
+    }
+
+    str << ", " << cyclesPerByte(bytes) << " cycles/byte";
+    if (cycles)
+        str << ", " << (double) instructions / cycles << " IPC";
+    str << ", " << cacheMisses << " cache misses";
+    if (userOnly)
+        str << " (user only)";
+
+    return str.str();
+}
+
+stats::Histogram::Histogram() :
+    count(0),
+    sum(0),
+    minValue(0),
+    maxValue(0)
+{
+    memset(counts, 0, sizeof(counts));
+}
+
+void
+stats::Histogram::add(uint64_t value)
+{
+    counts[stats_histBucket(value)]++;
+    if (!count || value < minValue)
+        minValue = value;
+    if (value > maxValue)
+        maxValue = value;
+    count++;
+    sum += value;
+}
+
+void
+stats::Histogram::merge(const stats::Histogram& other)
+{
+    if (!other.count)
+        return;
+
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        counts[i] += other.counts[i];
+    if (!count || other.minValue < minValue)
+        minValue = other.minValue;
+    if (other.maxValue > maxValue)
+        maxValue = other.maxValue;
+    count += other.count;
+    sum += other.sum;
+}
+
+// pct is in [0, 100]. The result is exact at the extremes and within the
+// bucket error in between.
+uint64_t
+stats::Histogram::percentile(double pct) const
+{
+    if (!count)
+        return 0;
+
+    uint64_t rank = ceil(pct / 100 * count);
+    if (rank <= 1)
+        return minValue;
+    if (rank >= count)
+        return maxValue;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += counts[i];
+        if (seen >= rank)
+            return min(max(stats_histValue(i), minValue), maxValue);
+    }
+
+    return maxValue;
+}
+
+double
+stats::Histogram::mean() const
+{
+    return (count) ? (double) sum / count : 0;
+}
+
+double
+stats::jainIndex(const std::vector<double>& shares)
+{
+    double sum = 0, sumSquares = 0;
+    for (double x : shares)
+    {
+        sum += x;
+        sumSquares += x * x;
+    }
+
+    return (sumSquares > 0) ? sum * sum / (shares.size() * sumSquares) : 0;
+}
+
+stats::MemStats::MemStats() :
+    rssBytes(0),
+    tcpSockets(0),
+    tcpMemBytes(0)
+{
+}
+
+void
+stats::MemStats::sample()
+{
+#ifdef __linux__
+    uint64_t pageSize = sysconf(_SC_PAGESIZE);
+    uint64_t size, resident;
+    std::ifstream statm("/proc/self/statm");
+    if (statm >> size >> resident)
+        rssBytes = resident * pageSize;
+
+    // TCP: inuse <n> orphan <n> tw <n> alloc <n> mem <pages>
+    std::ifstream sockstat("/proc/net/sockstat");
+    std::string line;
+    while (getline(sockstat, line))
+    {
+        if (line.compare(0, 4, "TCP:"))
+            continue;
+
+        std::stringstream fields(line.substr(4));
+        std::string key;
+        uint64_t value;
+        while (fields >> key >> value)
+        {
+            if (key == "inuse")
+                tcpSockets = value;
+            else if (key == "mem")
+                tcpMemBytes = value * pageSize;
+        }
+    }
+#endif
+}
+
+stats::ThreadCPUCounters::ThreadCPUCounters() :
+    startTime({}),
+    startCtxSwitches(0),
+    userOnly(false)
+{
+    for (int i = 0; i < numPerfCounters; i++)
+        fds[i] = -1;
+}
+
+stats::ThreadCPUCounters::~ThreadCPUCounters()
+{
+    closePerfCounters();
+}
+
+void
+stats::ThreadCPUCounters::openPerfCounters()
+{
+#ifdef __linux__
+    if (!stats_perfEnabled)
+        return;
+
+    // Kernel time is where most of the networking cost lives, so prefer it
+    // and fall back to user-only counting if perf_event_paranoid forbids it.
+    for (int excludeKernel = 0; excludeKernel < 2; excludeKernel++)
+    {
+        int i;
+        for (i = 0; i < numPerfCounters; i++)
+        {
+            fds[i] = stats_perfEventOpen(perfConfigs[i], excludeKernel,
+                                         fds[perfCycles]);
+            if (fds[i] == -1)
+                break;
+        }
+
+        if (i == numPerfCounters)
+        {
+            userOnly = excludeKernel;
+            return;
+        }
+        closePerfCounters();
+    }
+#endif
+}
+
+void
+stats::ThreadCPUCounters::closePerfCounters()
+{
+    for (int i = 0; i < numPerfCounters; i++)
+    {
+        if (fds[i] != -1)
+            close(fds[i]);
+        fds[i] = -1;
+    }
+}
+
+void
+stats::ThreadCPUCounters::start()
+{
+    openPerfCounters();
+
+#ifdef __linux__
+    if (fds[perfCycles] != -1)
+    {
+        ioctl(fds[perfCycles], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(fds[perfCycles], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+
+    startCtxSwitches = stats_threadCtxSwitches();
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &startTime) == -1)
+        throw std::runtime_error(ERRSTR("Error reading thread cpu clock"));
+}
+
+void
+stats::ThreadCPUCounters::stop()
+{
+    struct timespec endTime;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &endTime) == -1)
+        throw std::runtime_error(ERRSTR("Error reading thread cpu clock"));
+
+    result.cpuSec = (endTime.tv_sec - startTime.tv_sec) +
+                    (endTime.tv_nsec - startTime.tv_nsec) / 1e9;
+    result.ctxSwitches = stats_threadCtxSwitches() - startCtxSwitches;
+    result.hwCounters = (fds[0] != -1);
+    result.userOnly = userOnly;
+
+#ifdef __linux__
+    if (fds[perfCycles] != -1)
+    {
+        ioctl(fds[perfCycles], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        // A group the PMU never had room for counted nothing
+        stats_PerfGroup group;
+        if (::read(fds[perfCycles], &group, sizeof(group)) != sizeof(group) ||
+            group.nr != numPerfCounters || !group.timeRunning)
+        {
+            result.hwCounters = false;
+        }
+        else
+        {
+            result.cycles = group.values[perfCycles];
+            result.instructions = group.values[perfInstructions];
+            result.cacheMisses = group.values[perfCacheMisses];
+        }
+    }
+#endif
+
+    closePerfCounters();
+}
@@ -0,0 +1,109 @@
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <time.h>
+
+namespace stats
+{
+// Sub-buckets per power of two, bounds the error of a recorded value to 1/16
+#define HIST_SUB_BUCKETS 16
+#define HIST_BUCKETS     (64 * HIST_SUB_BUCKETS)
+
+    enum PerfCounter
+    {
+        perfCycles,
+        perfInstructions,
+        perfCacheMisses,
+        numPerfCounters,
+    };
+
+    struct CPUStats
+    {
+        double   cpuSec;
+        uint64_t cycles;
+        uint64_t instructions;
+        uint64_t cacheMisses;
+        uint64_t ctxSwitches;
+        // Set when the hardware counters could be read for every thread that
+        // was accumulated into this object
+        bool     hwCounters;
+        // Set when the hardware counters exclude kernel time
+        bool     userOnly;
+
+        CPUStats& operator+=(const CPUStats& other);
+        double cpuSecPerGB(uint64_t bytes) const;
+        double cyclesPerByte(uint64_t bytes) const;
+        std::string toString(uint64_t bytes) const;
+
+        CPUStats();
+    };
+
+    // Log-linear histogram of non-negative values, e.g. latencies in ns.
+    // Recording is O(1) and allocation free; not thread safe.
+    struct Histogram
+    {
+        uint64_t counts[HIST_BUCKETS];
+        uint64_t count;
+        uint64_t sum;
+        uint64_t minValue;
+        uint64_t maxValue;
+
+        void add(uint64_t value);
+        void merge(const Histogram& other);
+        uint64_t percentile(double pct) const;
+        double mean() const;
+
+        Histogram();
+    };
+
+    // Jain's fairness index of the shares, e.g. the throughput of competing
+    // flows: 1 when all are equal, down to 1/n when one of n takes it all
+    double jainIndex(const std::vector<double>& shares);
+
+    // Memory of the process and of the kernel's TCP sockets, from /proc. The
+    // socket figures cover the whole network namespace, both ends of the
+    // connections when they are on the same host. Linux only, zero elsewhere.
+    struct MemStats
+    {
+        uint64_t rssBytes;
+        uint64_t tcpSockets;
+        // Buffer memory of the TCP sockets
+        uint64_t tcpMemBytes;
+
+        void sample();
+
+        MemStats();
+    };
+
+    // The perf_event counters are off unless enabled, before any thread is
+    // measured. Every measured thread takes an fd per counter.
+    void enablePerfCounters();
+
+    // Measures the CPU cost of the calling thread between start() and stop().
+    // Both calls must be made from the thread that is being measured. The
+    // perf_event counters are optional - if they are not enabled or not
+    // permitted, only the thread CPU time and context switches are reported.
+    // They are opened as one group, so they count over the same time.
+    struct ThreadCPUCounters
+    {
+        int fds[numPerfCounters];
+        struct timespec startTime;
+        uint64_t startCtxSwitches;
+        bool userOnly;
+        CPUStats result;
+
+        void start();
+        void stop();
+
+        ThreadCPUCounters();
+        ~ThreadCPUCounters();
+
+    protected:
+        void openPerfCounters();
+        void closePerfCounters();
+    };
+}
+#endif /* __STATS_H */
@@ -0,0 +1,247 @@
+#include "sweep.h"
+#include "helper.h"
+#include "logger.h"
+#include "traffic.h"
+
+#include <algorithm>
+#include <tuple>
+
+using namespace std;
+
+static vector<uint32_t>
+sweep_parseValues(const string& str)
+{
+    vector<uint32_t> values;
+    stringstream ss(str);
+    string value;
+    while (getline(ss, value, ','))
+        values.push_back(stoul(value));
+    if (values.empty())
+        throw std::invalid_argument(ERRSTR("Sweep axis without values"));
+    return values;
+}
+
+static const vector<uint32_t>&
+sweep_axis(const app::SweepConfig& config, size_t axis)
+{
+    switch (axis)
+    {
+    case 0:
+        return config.msgSizes;
+    case 1:
+        return config.sndBufSizes;
+    case 2:
+        return config.rcvBufSizes;
+    default:
+        return config.numConns;
+    }
+}
+
+string
+app::SweepPoint::toString() const
+{
+    return "m=" + to_string(msgSize) + " s=" + to_string(sndBufSize) +
+           " r=" + to_string(rcvBufSize) + " n=" + to_string(numConns);
+}
+
+bool
+app::SweepPoint::operator<(const app::SweepPoint& other) const
+{
+    return tie(msgSize, sndBufSize, rcvBufSize, numConns) <
+           tie(other.msgSize, other.sndBufSize, other.rcvBufSize,
+               other.numConns);
+}
+
+void
+app::SweepConfig::parse(const string& str)
+{
+    stringstream ss(str);
+    string axis;
+    while (getline(ss, axis, ';'))
+    {
+        size_t pos = axis.find('=');
+        if (pos != 1)
+            throw std::invalid_argument(ERRSTR("Malformed sweep axis"));
+
+        vector<uint32_t> values = sweep_parseValues(axis.substr(pos + 1));
+        switch (axis[0])
+        {
+        case 'm':
+            for (auto size : values)
+            {
+                if (size < small || size > large)
+                    throw std::invalid_argument(ERRSTR("Need msg size between "
+                                                       "32 bytes and 64k "
+                                                       "bytes"));
+            }
+            msgSizes = values;
+            break;
+        case 's':
+            sndBufSizes = values;
+            break;
+        case 'r':
+            rcvBufSizes = values;
+            break;
+        case 'n':
+            for (auto conns : values)
+            {
+                if (!conns)
+                    throw std::invalid_argument(ERRSTR("Need at least one "
+                                                       "connection"));
+            }
+            numConns = values;
+            break;
+        default:
+            throw std::invalid_argument(ERRSTR("Unknown sweep axis"));
+        }
+    }
+}
+
+uint64_t
+app::SweepConfig::gridSize() const
+{
+    return (uint64_t) msgSizes.size() * sndBufSizes.size() *
+           rcvBufSizes.size() * numConns.size();
+}
+
+app::Sweep::Sweep(const app::SweepConfig& config,
+                  const app::funcTrial_t& runTrial) :
+    config(config),
+    runTrial(runTrial)
+{
+    if (!config.gridSize())
+        throw std::invalid_argument(ERRSTR("Every sweep axis needs a value"));
+}
+
+void
+app::Sweep::run()
+{
+    if (config.adaptive)
+        climb();
+    else
+        runGrid();
+}
+
+// Runs a point unless it already ran
+const app::Trial&
+app::Sweep::trial(const app::SweepPoint& point)
+{
+    auto it = done.find(point);
+    if (it != done.end())
+        return trials[it->second];
+
+    trials.push_back(runTrial(point));
+    done[point] = trials.size() - 1;
+    return trials.back();
+}
+
+app::SweepPoint
+app::Sweep::pointAt(const vector<size_t>& idx) const
+{
+    return {config.msgSizes[idx[0]], config.sndBufSizes[idx[1]],
+            config.rcvBufSizes[idx[2]], config.numConns[idx[3]]};
+}
+
+void
+app::Sweep::runGrid()
+{
+    vector<size_t> idx(4, 0);
+    for (idx[0] = 0; idx[0] < config.msgSizes.size(); idx[0]++)
+        for (idx[1] = 0; idx[1] < config.sndBufSizes.size(); idx[1]++)
+            for (idx[2] = 0; idx[2] < config.rcvBufSizes.size(); idx[2]++)
+                for (idx[3] = 0; idx[3] < config.numConns.size(); idx[3]++)
+                    trial(pointAt(idx));
+}
+
+// Steepest ascent from the middle of the grid: every step tries the
+// neighbours one value up and down each axis, and moves to the best of them.
+// Stops when no neighbour is better by the minimum gain.
+void
+app::Sweep::climb()
+{
+    vector<size_t> idx(4);
+    for (size_t axis = 0; axis < idx.size(); axis++)
+        idx[axis] = sweep_axis(config, axis).size() / 2;
+
+    uint64_t best = trial(pointAt(idx)).throughput;
+    for (;;)
+    {
+        vector<size_t> bestIdx = idx;
+        for (size_t axis = 0; axis < idx.size(); axis++)
+        {
+            for (int step : {-1, 1})
+            {
+                if ((step < 0 && !idx[axis]) ||
+                    (step > 0 &&
+                     idx[axis] + 1 >= sweep_axis(config, axis).size()))
+                    continue;
+
+                vector<size_t> next = idx;
+                next[axis] += step;
+                const Trial& t = trial(pointAt(next));
+                if (t.throughput >
+                    best * (1 + SWEEP_CLIMB_MIN_GAIN_PCT / 100.0))
+                {
+                    best = t.throughput;
+                    bestIdx = next;
+                }
+            }
+        }
+
+        if (bestIdx == idx)
+            break;
+        idx = bestIdx;
+        LOG_INFO("Sweep moved to " << pointAt(idx).toString());
+    }
+}
+
+vector<const app::Trial*>
+app::Sweep::frontier() const
+{
+    vector<const Trial*> front;
+    for (auto& t : trials)
+    {
+        if (t.failed)
+            continue;
+
+        bool dominated = false;
+        for (auto& other : trials)
+        {
+            if (other.failed || &other == &t)
+                continue;
+            if (other.throughput >= t.throughput &&
+                other.cpuPerGB <= t.cpuPerGB &&
+                (other.throughput > t.throughput ||
+                 other.cpuPerGB < t.cpuPerGB))
+            {
+                dominated = true;
+                break;
+            }
+        }
+        if (!dominated)
+            front.push_back(&t);
+    }
+
+    sort(front.begin(), front.end(), [](const Trial* a, const Trial* b)
+         { return a->throughput > b->throughput; });
+    return front;
+}
+
+const app::Trial*
+app::Sweep::recommended() const
+{
+    vector<const Trial*> front = frontier();
+    if (front.empty())
+        return NULL;
+
+    // The frontier is sorted by throughput, so CPU/GB only drops along it
+    uint64_t best = front.front()->throughput;
+    const Trial* pick = front.front();
+    for (auto t : front)
+    {
+        if (t->throughput < best * (1 - SWEEP_TOLERANCE_PCT / 100.0))
+            break;
+        pick = t;
+    }
+    return pick;
+}
@@ -0,0 +1,91 @@
+#ifndef __SWEEP_H
+#define __SWEEP_H
+
+#include "results.h"
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace app
+{
+// A neighbour has to beat the current point by this much for the hill climb
+// to move, so noise alone does not keep it going
+#define SWEEP_CLIMB_MIN_GAIN_PCT 1
+// The recommendation is the cheapest trial within this much of the best
+// throughput
+#define SWEEP_TOLERANCE_PCT      5
+
+    // One configuration a sweep tries. 0 buffer sizes leave them to the
+    // system.
+    struct SweepPoint
+    {
+        uint32_t msgSize;
+        uint32_t sndBufSize;
+        uint32_t rcvBufSize;
+        uint32_t numConns;
+
+        std::string toString() const;
+        bool operator<(const SweepPoint& other) const;
+    };
+
+    // The values to try along every axis, in the order they are given
+    struct SweepConfig
+    {
+        std::vector<uint32_t> msgSizes;
+        std::vector<uint32_t> sndBufSizes;
+        std::vector<uint32_t> rcvBufSizes;
+        std::vector<uint32_t> numConns;
+        // Climb from the middle of the grid towards more throughput, instead
+        // of trying all of it
+        bool adaptive;
+
+        // <axis>=<value>[,<value>...][;...] with the axes m (message size),
+        // s (send buffer), r (receive buffer) and n (connections). Axes that
+        // are not given keep the values they have.
+        void parse(const std::string& str);
+        uint64_t gridSize() const;
+    };
+
+    struct Trial
+    {
+        SweepPoint point;
+        // The steady state, warm-up excluded
+        uint64_t throughput;
+        double cpuPerGB;
+        bool failed;
+        results::ConnResult result;
+    };
+
+    typedef std::function<Trial (const SweepPoint&)> funcTrial_t;
+
+    // Runs trials over the grid of a SweepConfig, each point at most once
+    struct Sweep
+    {
+        const SweepConfig config;
+        const funcTrial_t runTrial;
+        // In the order they ran
+        std::vector<Trial> trials;
+
+        void run();
+        // The trials no other trial beats on both throughput and CPU/GB, by
+        // throughput
+        std::vector<const Trial*> frontier() const;
+        // The cheapest trial of the frontier within the tolerance of the best
+        // throughput, NULL if every trial failed
+        const Trial* recommended() const;
+
+        Sweep(const SweepConfig& config, const funcTrial_t& runTrial);
+
+    protected:
+        std::map<SweepPoint, size_t> done;
+
+        const Trial& trial(const SweepPoint& point);
+        SweepPoint pointAt(const std::vector<size_t>& idx) const;
+        void runGrid();
+        void climb();
+    };
+}
+#endif /* __SWEEP_H */
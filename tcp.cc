@@ -1,11 +1,44 @@
 #include "tcp.h"
 #include "helper.h"
+#include "logger.h"
 
 #include <sys/uio.h>
 #include <unistd.h>
 #include <stdexcept>
-#include <iostream>
 #include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <sys/mman.h>
+#endif
+
+#ifdef __linux__
+// Linux 5.11, older headers don't have it
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#endif
+
+// Room for the cmsgs of a stamp: scm_timestamping and sock_extended_err
+#define TCP_TSTAMP_CMSG_LEN 512
+
+#ifdef __linux__
+static uint64_t
+tcp_timespecNs(const struct timespec& ts)
+{
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+uint64_t
+tcp::timestampNowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
 tcp::Socket::Socket(const int fd, const ip::sockaddr& addr) :
     ip::Socket(fd, addr)
@@ -34,16 +67,61 @@ tcp::Socket::accept(ip::sockaddr& addr)
     return ret;
 }
 
+// Returns a non-blocking, close-on-exec fd or -1 once the accept queue is
+// empty. Also -1, with errno set, when the process or the system is out of
+// fds or memory for the connection, which a connection-rate test runs into.
+int
+tcp::Socket::acceptNonBlocking(ip::sockaddr& addr)
+{
+    for (;;)
+    {
+        addr.sa_len = sizeof(addr.storage);
+#ifdef __linux__
+        int ret = ::accept4(fd, &addr.sa, &addr.sa_len,
+                            SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        int ret = ::accept(fd, &addr.sa, &addr.sa_len);
+        if (ret != -1)
+        {
+            int flags = rfcntl(ret, F_GETFL, 0);
+            rfcntl(ret, F_SETFL, flags | O_NONBLOCK);
+            rfcntl(ret, F_SETFD, FD_CLOEXEC);
+        }
+#endif
+        if (ret != -1)
+            return ret;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return -1;
+        // The peer gave up before we got to it - move on to the next one
+        if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO)
+            continue;
+        if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+            errno == ENOMEM)
+            return -1;
+
+        throw std::runtime_error(ERRSTR("Error during accept"));
+    }
+}
+
 void
 tcp::Socket::connect(const ip::sockaddr& addr)
 {
     if (::connect(fd, &addr.sa, addr.sa_len) == -1)
     {
-        std::cout << "Connect Error " << strerror(errno) << std::endl;
+        LOG_ERROR("Connect Error " << strerror(errno));
         throw std::runtime_error(ERRSTR("Error during connect"));
     }
 }
 
+int
+tcp::Socket::connectNonBlocking(const ip::sockaddr& addr)
+{
+    if (::connect(fd, &addr.sa, addr.sa_len) == 0)
+        return 0;
+
+    return errno;
+}
+
 size_t
 tcp::Socket::read(void* buf, size_t nbyte)
 {
@@ -135,6 +213,10 @@ tcp::Socket::recvNonBlocking(void* buf, size_t bufLen)
 void
 tcp::Socket::setNagle(bool enabled)
 {
+    // Unix sockets never delay, and have no TCP options at all
+    if (addr.isUnix())
+        return;
+
     int noDelay = !enabled;
     int ret = ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay,
                            sizeof(noDelay));
@@ -181,6 +263,53 @@ tcp::Socket::setKeepAliveInterval(uint32_t size)
 #endif
 }
 
+// Caps the unsent data queued in the socket, so a sender sits on less of its
+// own backlog
+void
+tcp::Socket::setNotSentLowat(uint32_t bytes)
+{
+#if defined(__linux__) || defined(__APPLE__)
+    if (addr.isUnix())
+        return;
+
+    int ret = ::setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &bytes,
+                           sizeof(bytes));
+    if (ret == -1)
+        throw std::runtime_error(ERRSTR("Error setting not sent lowat"));
+#else
+    throw std::runtime_error(ERRSTR("Not supported"));
+#endif
+}
+
+void
+tcp::Socket::setCongestion(const std::string& name)
+{
+#ifdef __linux__
+    int ret = ::setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, name.c_str(),
+                           name.size());
+    if (ret == -1)
+        throw std::runtime_error(ERRSTR("Error setting congestion control"));
+#else
+    throw std::runtime_error(ERRSTR("Not supported"));
+#endif
+}
+
+std::string
+tcp::Socket::getCongestion()
+{
+#ifdef __linux__
+    // TCP_CA_NAME_MAX, the kernel does not export it
+    char name[16] = {0};
+    socklen_t len = sizeof(name);
+    int ret = ::getsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, name, &len);
+    if (ret == -1)
+        throw std::runtime_error(ERRSTR("Error getting congestion control"));
+    return std::string(name, strnlen(name, len));
+#else
+    throw std::runtime_error(ERRSTR("Not supported"));
+#endif
+}
+
 void
 tcp::Socket::getTCPInfo(struct tcp_info* ti)
 {
@@ -193,3 +322,200 @@ tcp::Socket::getTCPInfo(struct tcp_info* ti)
     throw std::runtime_error(ERRSTR("Not supported"));
 #endif
 }
+
+// Above net.core.busy_read it needs CAP_NET_ADMIN. Where the kernel knows
+// it, the NIC's interrupts are also held off while the queue is polled.
+void
+tcp::Socket::setBusyPoll(uint32_t us)
+{
+#ifdef __linux__
+    int val = us;
+    int ret = ::setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &val, sizeof(val));
+    if (ret == -1)
+        throw std::runtime_error(ERRSTR("Error setting busy poll"));
+    val = 1;
+    ret = ::setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &val, sizeof(val));
+    if (ret == -1 && errno != ENOPROTOOPT)
+        throw std::runtime_error(ERRSTR("Error preferring busy poll"));
+#else
+    throw std::runtime_error(ERRSTR("Not supported"));
+#endif
+}
+
+// Only TCP sockets can be mapped, since Linux 4.18
+void*
+tcp::Socket::mapReceive(size_t len)
+{
+#ifdef __linux__
+    void* region = ::mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    if (region == MAP_FAILED)
+        throw std::runtime_error(ERRSTR("Error mapping the receive region"));
+    return region;
+#else
+    throw std::runtime_error(ERRSTR("Not supported"));
+#endif
+}
+
+// The kernel unmaps what the last call mapped into the region first. Only
+// the pages that hold a whole page of the stream, and nothing else, can be
+// mapped, so how much of the data qualifies depends on the MTU and on the
+// NIC splitting the headers off.
+size_t
+tcp::Socket::recvZeroCopy(void* region, size_t len, uint32_t& skip)
+{
+#ifdef __linux__
+    struct tcp_zerocopy_receive zc;
+    memset(&zc, 0, sizeof(zc));
+    zc.address = (uint64_t) region;
+    zc.length = len;
+    socklen_t optlen = sizeof(zc);
+    int ret = ::getsockopt(fd, IPPROTO_TCP, TCP_ZEROCOPY_RECEIVE, &zc,
+                           &optlen);
+    // EIO is the end of the data, which recv() reports the usual way
+    if (ret == -1 && errno == EIO)
+    {
+        skip = 0;
+        return 0;
+    }
+    if (ret == -1)
+        throw std::runtime_error(ERRSTR("Error in zero-copy receive"));
+    skip = zc.recv_skip_hint;
+    return zc.length;
+#else
+    throw std::runtime_error(ERRSTR("Not supported"));
+#endif
+}
+
+// OPT_ID numbers the sends by their last byte, OPT_TSONLY leaves the data
+// out of the error queue. The NIC only stamps if its hardware timestamping
+// is turned on, with SIOCSHWTSTAMP.
+void
+tcp::Socket::setTimestamping(uint32_t flags)
+{
+#ifdef __linux__
+    int val = 0;
+    if (flags & tsTx)
+        val |= SOF_TIMESTAMPING_TX_SCHED | SOF_TIMESTAMPING_TX_SOFTWARE |
+               SOF_TIMESTAMPING_TX_ACK | SOF_TIMESTAMPING_OPT_ID |
+               SOF_TIMESTAMPING_OPT_TSONLY;
+    if (flags & tsRx)
+        val |= SOF_TIMESTAMPING_RX_SOFTWARE;
+    if (flags & (tsTx | tsRx))
+        val |= SOF_TIMESTAMPING_SOFTWARE;
+    if ((flags & tsHardware) && (flags & tsTx))
+        val |= SOF_TIMESTAMPING_TX_HARDWARE;
+    if ((flags & tsHardware) && (flags & tsRx))
+        val |= SOF_TIMESTAMPING_RX_HARDWARE;
+    if (flags & tsHardware)
+        val |= SOF_TIMESTAMPING_RAW_HARDWARE;
+
+    int ret = ::setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &val, sizeof(val));
+    if (ret == -1)
+        throw std::runtime_error(ERRSTR("Error setting timestamping"));
+#else
+    throw std::runtime_error(ERRSTR("Not supported"));
+#endif
+}
+
+int
+tcp::Socket::readTxTimestamps(tcp::TxTimestamp* stamps, int max)
+{
+#ifdef __linux__
+    int n = 0;
+    while (n < max)
+    {
+        char control[TCP_TSTAMP_CMSG_LEN];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t rc = ::recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            throw std::runtime_error(ERRSTR("Error reading the error queue"));
+        }
+
+        const struct scm_timestamping* tss = NULL;
+        const struct sock_extended_err* serr = NULL;
+        for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm;
+             cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if (cm->cmsg_level == SOL_SOCKET &&
+                cm->cmsg_type == SO_TIMESTAMPING)
+                tss = (const struct scm_timestamping *) CMSG_DATA(cm);
+            else if ((cm->cmsg_level == SOL_IP &&
+                      cm->cmsg_type == IP_RECVERR) ||
+                     (cm->cmsg_level == SOL_IPV6 &&
+                      cm->cmsg_type == IPV6_RECVERR))
+                serr = (const struct sock_extended_err *) CMSG_DATA(cm);
+        }
+        // Anything but a stamp, like an ICMP error, is not ours to handle
+        if (!tss || !serr || serr->ee_errno != ENOMSG ||
+            serr->ee_origin != SO_EE_ORIGIN_TIMESTAMPING)
+            continue;
+
+        TxTimestamp& ts = stamps[n++];
+        ts.key = serr->ee_data;
+        switch (serr->ee_info)
+        {
+        case SCM_TSTAMP_SCHED:
+            ts.stage = txSched;
+            break;
+        case SCM_TSTAMP_SND:
+            ts.stage = txSnd;
+            break;
+        default:
+            ts.stage = txAck;
+            break;
+        }
+        ts.ns = tcp_timespecNs(tss->ts[0]);
+        ts.hwNs = tcp_timespecNs(tss->ts[2]);
+    }
+    return n;
+#else
+    throw std::runtime_error(ERRSTR("Not supported"));
+#endif
+}
+
+ssize_t
+tcp::Socket::recvTimestamped(void* buf, size_t bufLen, uint64_t& ns,
+                             uint64_t& hwNs)
+{
+    ns = 0;
+    hwNs = 0;
+#ifdef __linux__
+    char control[TCP_TSTAMP_CMSG_LEN];
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len  = bufLen;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t rc = ::recvmsg(fd, &msg, MSG_DONTWAIT);
+    if (rc <= 0)
+        return rc;
+
+    for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm;
+         cm = CMSG_NXTHDR(&msg, cm))
+    {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SO_TIMESTAMPING)
+            continue;
+        const struct scm_timestamping* tss =
+            (const struct scm_timestamping *) CMSG_DATA(cm);
+        ns = tcp_timespecNs(tss->ts[0]);
+        hwNs = tcp_timespecNs(tss->ts[2]);
+    }
+    return rc;
+#else
+    throw std::runtime_error(ERRSTR("Not supported"));
+#endif
+}
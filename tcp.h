@@ -4,26 +4,85 @@
 #include "ip.h"
 #include <netinet/tcp.h>
 
+#include <string>
+
 namespace tcp
 {
+    // SO_TIMESTAMPING: kernel timestamps of the data sent and received
+    enum TimestampFlags
+    {
+        tsTx       = 1,
+        tsRx       = 2,
+        // The NIC's as well, where it has them turned on
+        tsHardware = 4,
+    };
+
+    // How far a send had got when the kernel stamped it
+    enum TxStage
+    {
+        txSched = 0, // entered the qdisc
+        txSnd   = 1, // handed to the NIC
+        txAck   = 2, // acked by the peer
+    };
+
+    // A stamp of the send whose last byte is key bytes after the first one
+    // sent with stamping on. ns is CLOCK_REALTIME, hwNs the NIC's clock or 0.
+    struct TxTimestamp
+    {
+        uint32_t key;
+        uint32_t stage;
+        uint64_t ns;
+        uint64_t hwNs;
+    };
+
+    // The clock the software timestamps are taken with
+    uint64_t timestampNowNs();
+
     struct Socket : public ip::Socket
     {
         void listen(int backlog);
         int accept(ip::sockaddr& addr);
+        int acceptNonBlocking(ip::sockaddr& addr);
         void connect(const ip::sockaddr& addr);
+        // On a non-blocking socket: 0 once connected, EINPROGRESS while the
+        // handshake is going on, or the errno of the failure
+        int connectNonBlocking(const ip::sockaddr& addr);
 
         size_t read(void* buf, size_t nbyte);
         size_t write(const void* buf, size_t nbytes);
-        void writeBlock(struct iovec *iov, int iovcnt, size_t iovlen);
+        // Virtual so other stream transports can take over the data path,
+        // see shm::Socket
+        virtual void writeBlock(struct iovec *iov, int iovcnt, size_t iovlen);
         ssize_t send(struct iovec *iov, size_t niov);
-        ssize_t recv(void* buf, size_t bufLen);
-        ssize_t recvNonBlocking(void* buf, size_t bufLen);
+        virtual ssize_t recv(void* buf, size_t bufLen);
+        virtual ssize_t recvNonBlocking(void* buf, size_t bufLen);
 
         void setNagle(bool enabled);
         void setKeepAliveCount(uint32_t size);
         void setKeepAliveIdle(uint32_t size);
         void setKeepAliveInterval(uint32_t size);
+        void setNotSentLowat(uint32_t bytes);
+        // The congestion control algorithm, by the name the kernel knows it
+        void setCongestion(const std::string& name);
+        std::string getCongestion();
         void getTCPInfo(struct tcp_info* ti);
+        // Before anything is sent, the keys of the sends count from there
+        void setTimestamping(uint32_t flags);
+        // Up to max stamps from the error queue, without blocking
+        int readTxTimestamps(TxTimestamp* stamps, int max);
+        // recvNonBlocking(), along with when the kernel received the data.
+        // ns is 0 if it was not stamped.
+        ssize_t recvTimestamped(void* buf, size_t bufLen, uint64_t& ns,
+                                uint64_t& hwNs);
+        // Has recv() poll the NIC's queue for up to us before it sleeps
+        void setBusyPoll(uint32_t us);
+        // A read-only region of len bytes, a multiple of the page size, for
+        // recvZeroCopy() to map the data into. munmap() it when done.
+        void* mapReceive(size_t len);
+        // Maps what the socket has in whole pages into region, up to len
+        // bytes, and returns how much it mapped. What it could not map is
+        // left to recv(), skip says how much of that comes first.
+        size_t recvZeroCopy(void* region, size_t len, uint32_t& skip);
 
         Socket(const int fd, const ip::sockaddr& addr);
         Socket(const ip::sockaddr& addr);
@@ -0,0 +1,535 @@
+#include "../app.h"
+#include "../logger.h"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <pthread.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Measures the hot paths one at a time: the traffic shapers, the send path
+// and the receive path. Every benchmark is calibrated to a minimum run time
+// per repetition and repeated, the median and the minimum are reported. The
+// measuring thread and the thread at the other end of the socket pair are
+// pinned to their own CPUs.
+
+struct Benchmark
+{
+    string name;
+    // Bytes moved per operation, 0 if the benchmark moves no data
+    uint64_t bytesPerOp;
+    // Runs ops operations and returns how long they took, in ns
+    function<uint64_t (uint64_t ops)> run;
+};
+
+struct BenchResult
+{
+    string name;
+    uint64_t ops;
+    uint64_t bytesPerOp;
+    // Sorted
+    vector<double> nsPerOp;
+
+    double median() const { return nsPerOp[nsPerOp.size() / 2]; }
+    double min() const { return nsPerOp.front(); }
+    // Of the repetitions, relative to the median
+    double spreadPct() const
+    {
+        return (nsPerOp.back() - nsPerOp.front()) * 100 / median();
+    }
+    double mbPerSec() const
+    {
+        return (bytesPerOp) ? bytesPerOp * 1e3 / median() : 0;
+    }
+};
+
+static int benchCPU = 0, peerCPU = 1;
+// Keeps the compiler from dropping loops whose results are not used
+static volatile uint64_t sink;
+
+static uint64_t
+nowNs()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(
+               chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void
+pinThread(pthread_t thread, int cpu)
+{
+#ifdef __linux__
+    if (cpu < 0)
+        return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(thread, sizeof(set), &set))
+        throw std::runtime_error(ERRSTR("Error pinning thread"));
+#endif
+}
+
+static ip::sockaddr
+benchAddr()
+{
+    return ip::sockaddr("127.0.0.1", 0);
+}
+
+// One isReady/avail/update cycle, as the send loop runs it. The rate limiter
+// gets a rate it never has to wait for, so only its bookkeeping is measured.
+static uint64_t
+benchShaper(const ts::TSDescriptor& tsd, uint64_t size, uint64_t ops)
+{
+    ts::TSProvider* tsp = ts::findTSProvider(tsd.name);
+    if (!tsp)
+        throw std::runtime_error(ERRSTR("Wrong Traffic Shaper"));
+    ts::TrafficShaper* ts = tsp->instantiate(tsd.args);
+
+    uint64_t sent = 0;
+    uint64_t start = nowNs();
+    for (uint64_t i = 0; i < ops; i++)
+    {
+        if (ts->isReady())
+        {
+            uint64_t avail = std::min(size, ts->avail());
+            ts->update(avail);
+            sent += avail;
+        }
+    }
+    uint64_t elapsed = nowNs() - start;
+
+    sink = sent;
+    delete ts;
+    return elapsed;
+}
+
+// One read of a clock. The readings are summed so that none of them can be
+// left out.
+template <typename F>
+static uint64_t
+benchClock(F read, uint64_t ops)
+{
+    uint64_t sum = 0;
+    uint64_t start = nowNs();
+    for (uint64_t i = 0; i < ops; i++)
+        sum += read();
+    uint64_t elapsed = nowNs() - start;
+
+    sink = sum;
+    return elapsed;
+}
+
+// Reads the other end of a socket pair until it is closed
+static void
+drain(int fd)
+{
+    pinThread(pthread_self(), peerCPU);
+    char* buf = (char *) malloc(app::large * 4);
+    while (::read(fd, buf, app::large * 4) > 0)
+        ;
+    free(buf);
+}
+
+// tcp::Socket::writeBlock() with the given iovec shape, into a socket pair
+// that is drained by the peer thread
+static uint64_t
+benchWriteBlock(const vector<size_t>& shape, uint64_t ops)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+        throw std::runtime_error(ERRSTR("Error creating socket pair"));
+    tcp::Socket sock(fds[0], benchAddr());
+    thread peer(drain, fds[1]);
+
+    size_t total = 0;
+    for (auto len : shape)
+        total += len;
+    char* data = (char *) malloc(total);
+    memset(data, 1, total);
+
+    // writeBlock() advances the iovec on a short write, so it is rebuilt
+    // for every block
+    vector<struct iovec> iov(shape.size());
+    uint64_t start = nowNs();
+    for (uint64_t i = 0; i < ops; i++)
+    {
+        char* p = data;
+        for (size_t j = 0; j < shape.size(); j++)
+        {
+            iov[j].iov_base = p;
+            iov[j].iov_len  = shape[j];
+            p += shape[j];
+        }
+        sock.writeBlock(iov.data(), iov.size(), total);
+    }
+    uint64_t elapsed = nowNs() - start;
+
+    sock.shutdownWrite();
+    peer.join();
+    close(fds[1]);
+    free(data);
+    return elapsed;
+}
+
+// Writes ops blocks in the framing of the send loop, then closes
+static void
+feed(int fd, size_t msgSize, uint64_t ops)
+{
+    pinThread(pthread_self(), peerCPU);
+    tcp::Socket sock(fd, benchAddr());
+    char* data = (char *) malloc(msgSize);
+    memset(data, 1, msgSize);
+
+    uint64_t blockSize = msgSize;
+    struct iovec iov[2];
+    for (uint64_t i = 0; i < ops; i++)
+    {
+        iov[0].iov_base = &blockSize;
+        iov[0].iov_len  = sizeof(blockSize);
+        iov[1].iov_base = data;
+        iov[1].iov_len  = msgSize;
+        sock.writeBlock(iov, 2, sizeof(blockSize) + msgSize);
+    }
+    free(data);
+}
+
+// A TrafficServer receiving and parsing blocks of msgSize from a socket
+// pair, until the feeder closes it
+static uint64_t
+benchServerRecv(size_t msgSize, uint64_t ops)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+        throw std::runtime_error(ERRSTR("Error creating socket pair"));
+
+    mutex lock;
+    condition_variable cv;
+    bool done = false;
+    app::TrafficServer* server =
+        new app::TrafficServer("Bench", fds[1], benchAddr(), benchAddr(),
+                               [&](app::TrafficServer *)
+                               {
+                                   std::lock_guard<std::mutex> lg(lock);
+                                   done = true;
+                                   cv.notify_all();
+                               });
+
+    uint64_t start = nowNs();
+    server->start();
+    pinThread(server->serverThread.native_handle(), benchCPU);
+    thread feeder(feed, fds[0], msgSize, ops);
+    {
+        std::unique_lock<std::mutex> ul(lock);
+        cv.wait(ul, [&]{return done;});
+    }
+    uint64_t elapsed = nowNs() - start;
+
+    feeder.join();
+    if (server->bytesReceived != ops * (sizeof(uint64_t) + msgSize))
+        throw std::runtime_error(ERRSTR("The server lost data"));
+    delete server;
+    return elapsed;
+}
+
+// Doubles the operations until a run takes at least minNs
+static uint64_t
+calibrate(const Benchmark& bench, uint64_t minNs)
+{
+    uint64_t ops = 1;
+    for (;;)
+    {
+        uint64_t elapsed = bench.run(ops);
+        if (elapsed >= minNs)
+            return ops;
+        // Jump close to the target once a run is long enough to tell
+        if (elapsed > minNs / 100)
+            ops = ops * minNs / elapsed + 1;
+        else
+            ops *= 2;
+    }
+}
+
+static BenchResult
+runBenchmark(const Benchmark& bench, int reps, uint64_t minNs)
+{
+    BenchResult res = {bench.name, calibrate(bench, minNs), bench.bytesPerOp,
+                       vector<double>()};
+    for (int i = 0; i < reps; i++)
+        res.nsPerOp.push_back((double) bench.run(res.ops) / res.ops);
+    sort(res.nsPerOp.begin(), res.nsPerOp.end());
+    return res;
+}
+
+static vector<Benchmark>
+allBenchmarks()
+{
+    vector<Benchmark> benches;
+    // The clocks the hot paths could read, and the one they do
+    benches.push_back({"clock.steady_clock", 0, [](uint64_t ops)
+                       { return benchClock(tsc::Clock::steadyNs, ops); }});
+    benches.push_back({"clock.system_clock", 0, [](uint64_t ops)
+                       { return benchClock([]
+                         {
+                             return (uint64_t) chrono::system_clock::now()
+                                 .time_since_epoch().count();
+                         }, ops); }});
+    benches.push_back({"clock.fast", 0, [](uint64_t ops)
+                       { return benchClock(tsc::nowNs, ops); }});
+#ifdef TSC_AVAILABLE
+    benches.push_back({"clock.rdtsc", 0, [](uint64_t ops)
+                       { return benchClock([]
+                         {
+                             return (uint64_t) __rdtsc();
+                         }, ops); }});
+#endif
+    benches.push_back({"shaper.noop", 0, [](uint64_t ops)
+                       { return benchShaper({"noop", ""}, app::large, ops); }});
+    benches.push_back({"shaper.rate-limit", 0, [](uint64_t ops)
+                       { return benchShaper({"rate-limit", "1e6gbps"}, app::large,
+                                            ops); }});
+
+    // The shapes of the send loop, header and payload, next to a single
+    // buffer and a scattered one
+    vector<pair<string, vector<size_t>>> shapes = {
+        {"8+32", {8, app::small}},
+        {"8+1400", {8, 1400}},
+        {"8+64K", {8, app::large}},
+        {"64K", {app::large}},
+        {"16x4K", vector<size_t>(16, 4096)},
+    };
+    for (auto& shape : shapes)
+    {
+        uint64_t bytes = 0;
+        for (auto len : shape.second)
+            bytes += len;
+        vector<size_t> iov = shape.second;
+        benches.push_back({"writeBlock." + shape.first, bytes,
+                           [iov](uint64_t ops)
+                           { return benchWriteBlock(iov, ops); }});
+    }
+
+    vector<pair<string, size_t>> sizes = {
+        {"32", app::small},
+        {"1400", 1400},
+        {"64K", app::large},
+    };
+    for (auto& size : sizes)
+    {
+        size_t msgSize = size.second;
+        benches.push_back({"server.recv." + size.first,
+                           sizeof(uint64_t) + msgSize, [msgSize](uint64_t ops)
+                           { return benchServerRecv(msgSize, ops); }});
+    }
+
+    return benches;
+}
+
+static void
+printHeader(ostream& out)
+{
+    out << left;
+    out.width(24);
+    out << "Benchmark";
+    out << right;
+    out.width(12);
+    out << "ops/rep";
+    out.width(14);
+    out << "median ns/op";
+    out.width(12);
+    out << "min ns/op";
+    out.width(10);
+    out << "spread %";
+    out.width(12);
+    out << "MB/s" << endl;
+}
+
+static void
+printRow(ostream& out, const BenchResult& r)
+{
+    out.precision(4);
+    out << left;
+    out.width(24);
+    out << r.name;
+    out << right;
+    out.width(12);
+    out << r.ops;
+    out.width(14);
+    out << r.median();
+    out.width(12);
+    out << r.min();
+    out.width(10);
+    out << r.spreadPct();
+    out.width(12);
+    if (r.bytesPerOp)
+        out << r.mbPerSec();
+    else
+        out << "-";
+    out << endl;
+}
+
+static void
+writeResults(ostream& out, results::Format format,
+             const vector<BenchResult>& res)
+{
+    if (format == results::json)
+    {
+        out << "{\n  \"benchmarks\": [";
+        for (size_t i = 0; i < res.size(); i++)
+        {
+            const BenchResult& r = res[i];
+            out << ((i) ? ",\n    " : "\n    ");
+            out << "{\"name\": \"" << r.name << "\", \"ops\": " << r.ops
+                << ", \"reps\": " << r.nsPerOp.size()
+                << ", \"median_ns\": " << r.median()
+                << ", \"min_ns\": " << r.min()
+                << ", \"spread_pct\": " << r.spreadPct()
+                << ", \"mb_per_sec\": " << r.mbPerSec() << "}";
+        }
+        out << "\n  ]\n}\n";
+        return;
+    }
+    if (format == results::csv)
+    {
+        out << "name,ops,reps,median_ns,min_ns,spread_pct,mb_per_sec\n";
+        for (auto& r : res)
+            out << r.name << "," << r.ops << "," << r.nsPerOp.size() << ","
+                << r.median() << "," << r.min() << "," << r.spreadPct()
+                << "," << r.mbPerSec() << "\n";
+        return;
+    }
+
+    printHeader(out);
+    for (auto& r : res)
+        printRow(out, r);
+}
+
+static void
+usage()
+{
+    cout << "Usage:\n";
+    cout << "    benchmark [-r <repetitions>] [-t <min ms per repetition>]";
+    cout << " [-c <benchmark cpu>,<peer cpu> (-1 to not pin)]";
+    cout << " [-n <name filter>] [-l (list)]";
+    cout << " [-o <human|json|csv>] [-f <results file>]\n";
+}
+
+int
+main(int argc, char* argv[]) try
+{
+    signal(SIGPIPE, SIG_IGN);
+    logger::setLevel(logger::warn);
+
+    int reps = 15, minMs = 50, opt;
+    const char *filter = "", *resultsPath = "";
+    bool list = false;
+    results::Format format = results::human;
+    long numCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+    peerCPU = (numCPUs > 1) ? 1 : 0;
+
+    while ((opt = getopt(argc, argv, "r:t:c:n:lo:f:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            reps = atoi(optarg);
+
+            if (reps < 1)
+                throw std::runtime_error(ERRSTR("Need at least one "
+                                                "repetition"));
+            break;
+        case 't':
+            minMs = atoi(optarg);
+
+            if (minMs < 1)
+                throw std::runtime_error(ERRSTR("Need a non zero run time"));
+            break;
+        case 'c':
+            if (sscanf(optarg, "%d,%d", &benchCPU, &peerCPU) != 2)
+                throw std::runtime_error(ERRSTR("Need two CPUs"));
+            break;
+        case 'n':
+            filter = optarg;
+            break;
+        case 'l':
+            list = true;
+            break;
+        case 'o':
+            format = results::parseFormat(optarg);
+            break;
+        case 'f':
+            resultsPath = optarg;
+            break;
+        case 'h':
+        default:
+            usage();
+            exit(0);
+        }
+    }
+
+    vector<Benchmark> benches;
+    for (auto& bench : allBenchmarks())
+    {
+        if (bench.name.find(filter) != string::npos)
+            benches.push_back(bench);
+    }
+    if (list)
+    {
+        for (auto& bench : benches)
+            cout << bench.name << endl;
+        return 0;
+    }
+
+    if (benchCPU >= 0 && benchCPU == peerCPU)
+        cerr << "The benchmark and its peer share CPU " << benchCPU
+             << ", the send and receive paths measure both ends\n";
+    pinThread(pthread_self(), benchCPU);
+
+    vector<BenchResult> res;
+    if (format == results::human)
+    {
+        if (tsc::clock.useTSC)
+            cout << "Fast clock: invariant TSC at " << tsc::clock.tscHz / 1e9
+                 << " GHz\n";
+        else
+            cout << "Fast clock: steady_clock, no invariant TSC\n";
+        printHeader(cout);
+    }
+    for (auto& bench : benches)
+    {
+        // One untimed run to fault in the buffers and warm the caches
+        bench.run(1);
+        res.push_back(runBenchmark(bench, reps, minMs * 1000000ULL));
+        if (format == results::human)
+            printRow(cout, res.back());
+    }
+
+    if (format == results::human)
+        return 0;
+
+    ofstream file;
+    ostream* out = &cout;
+    if (resultsPath[0] && strcmp(resultsPath, "-"))
+    {
+        file.open(resultsPath, ios::out | ios::trunc);
+        if (!file)
+            throw std::runtime_error(ERRSTR("Error opening results file"));
+        out = &file;
+    }
+    writeResults(*out, format, res);
+    return 0;
+}
+catch (std::exception& e)
+{
+    cout << "Unhandled exception: " << e.what();
+    cout << " err: " << strerror(errno) << endl;
+    return 1;
+}
+catch (...)
+{
+    cout << "Unhandled unknown exception" << endl;
+    return 1;
+}
@@ -0,0 +1,379 @@
+#include "../app.h"
+#include "../logger.h"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Runs a matrix of loopback scenarios with a ServerApp and a ClientApp in
+// this process, and compares what they achieve to a stored baseline. A
+// scenario regresses when its throughput or messages/sec drop, or the CPU
+// it takes per GB on either end grows, by more than the threshold.
+
+struct Scenario
+{
+    uint32_t msgSize;
+    uint16_t numConns;
+    ts::TSDescriptor tsd;
+
+    string name() const
+    {
+        string str = "m" + to_string(msgSize) + "-c" + to_string(numConns) +
+                     "-" + tsd.name;
+        return (tsd.args.empty()) ? str : str + "-" + tsd.args;
+    }
+};
+
+// What a scenario achieved, or the baseline of it
+struct Outcome
+{
+    double throughput;
+    // Blocks of the message size, with their header
+    double msgsPerSec;
+    double clientCPUPerGB;
+    double serverCPUPerGB;
+};
+
+// A metric, and which way is worse
+struct Metric
+{
+    const char* key;
+    double Outcome::* field;
+    bool higherIsBetter;
+};
+
+static const Metric outcomeMetrics[] =
+{
+    {"throughput_bps", &Outcome::throughput, true},
+    {"msgs_per_sec", &Outcome::msgsPerSec, true},
+    {"client_cpu_sec_per_gb", &Outcome::clientCPUPerGB, false},
+    {"server_cpu_sec_per_gb", &Outcome::serverCPUPerGB, false},
+};
+
+static vector<uint32_t>
+parseList(const string& str)
+{
+    vector<uint32_t> list;
+    stringstream ss(str);
+    string item;
+    while (getline(ss, item, ','))
+        list.push_back(stoul(item));
+    if (list.empty())
+        throw std::invalid_argument(ERRSTR("Empty list"));
+    return list;
+}
+
+// <name>[:<args>],...
+static vector<ts::TSDescriptor>
+parseShapers(const string& str)
+{
+    vector<ts::TSDescriptor> shapers;
+    stringstream ss(str);
+    string item;
+    while (getline(ss, item, ','))
+    {
+        size_t pos = item.find(':');
+        if (pos == string::npos)
+            shapers.push_back({item, ""});
+        else
+            shapers.push_back({item.substr(0, pos), item.substr(pos + 1)});
+        if (!ts::findTSProvider(shapers.back().name))
+            throw std::invalid_argument(ERRSTR("Wrong Traffic Shaper"));
+    }
+    return shapers;
+}
+
+static Outcome
+runScenario(const Scenario& sc, const ip::sockaddr& laddr,
+            const ip::sockaddr& addr, uint64_t durationSec, uint64_t warmupSec)
+{
+    // A server per scenario, so that stopping it accounts for all of its
+    // connections
+    app::ServerApp* sapp = new app::ServerApp(addr);
+    app::ClientApp* capp = NULL;
+    try
+    {
+        // The ClientApp runs the whole test before it returns
+        app::ClientConfig config;
+        config.testDurationSec = durationSec;
+        config.warmupSec = warmupSec;
+        config.tsd = sc.tsd;
+        config.numDrivers = sc.numConns;
+        config.msgSize = (app::MsgSize) sc.msgSize;
+        capp = new app::ClientApp(app::SourceConfig(laddr),
+                                  std::vector<app::Destination>(
+                                      1, app::Destination(addr)),
+                                  []{}, config);
+    }
+    catch (...)
+    {
+        sapp->stop();
+        delete sapp;
+        throw;
+    }
+    sapp->stop();
+
+    Outcome out;
+    out.throughput = capp->steadyThroughput;
+    out.msgsPerSec = (capp->steadySec > 0) ?
+        capp->steadyBytes / (double) (sizeof(uint64_t) + sc.msgSize) /
+        capp->steadySec : 0;
+    out.clientCPUPerGB = capp->totalCPU.cpuSecPerGB(capp->totalBytesSent);
+    out.serverCPUPerGB = sapp->totalCPU.cpuSecPerGB(sapp->totalBytesReceived);
+
+    delete capp;
+    delete sapp;
+    return out;
+}
+
+// The median of every metric over the repetitions, they are noisy on their
+// own
+static Outcome
+medianOutcome(vector<Outcome>& outs)
+{
+    Outcome med;
+    for (auto& m : outcomeMetrics)
+    {
+        sort(outs.begin(), outs.end(),
+             [&m](const Outcome& a, const Outcome& b)
+             { return a.*m.field < b.*m.field; });
+        med.*m.field = outs[outs.size() / 2].*m.field;
+    }
+    return med;
+}
+
+static void
+writeBaseline(const string& path, const vector<Scenario>& scenarios,
+              const vector<Outcome>& outs, uint64_t durationSec)
+{
+    ofstream file(path.c_str(), ios::out | ios::trunc);
+    if (!file)
+        throw std::runtime_error(ERRSTR("Error opening baseline file"));
+
+    file.precision(15);
+    file << "{\n  \"duration_sec\": " << durationSec << ",\n";
+    file << "  \"scenarios\": [";
+    for (size_t i = 0; i < scenarios.size(); i++)
+    {
+        const Scenario& sc = scenarios[i];
+        file << ((i) ? ",\n    " : "\n    ");
+        file << "{\"name\": \"" << sc.name() << "\", \"msg_size\": "
+             << sc.msgSize << ", \"connections\": " << sc.numConns
+             << ", \"shaper\": \"" << sc.tsd.name << "\", \"shaper_args\": \""
+             << sc.tsd.args << "\"";
+        for (auto& m : outcomeMetrics)
+            file << ", \"" << m.key << "\": " << outs[i].*m.field;
+        file << "}";
+    }
+    file << "\n  ]\n}\n";
+}
+
+// Only reads what writeBaseline() writes: every scenario is an object of
+// string and number values, on one line
+static map<string, Outcome>
+readBaseline(const string& path)
+{
+    ifstream file(path.c_str());
+    if (!file)
+        throw std::runtime_error(ERRSTR("Error opening baseline file"));
+
+    map<string, Outcome> baseline;
+    string line;
+    while (getline(file, line))
+    {
+        size_t pos = line.find("{\"name\": \"");
+        if (pos == string::npos)
+            continue;
+        pos += strlen("{\"name\": \"");
+        string name = line.substr(pos, line.find('"', pos) - pos);
+
+        Outcome out = {0, 0, 0, 0};
+        for (auto& m : outcomeMetrics)
+        {
+            string key = string("\"") + m.key + "\": ";
+            size_t kpos = line.find(key);
+            if (kpos == string::npos)
+                throw std::runtime_error(ERRSTR("Malformed baseline"));
+            out.*m.field = strtod(line.c_str() + kpos + key.size(), NULL);
+        }
+        baseline[name] = out;
+    }
+
+    return baseline;
+}
+
+// Prints every metric against the baseline, returns the number of metrics
+// that regressed
+static int
+compare(const Outcome& base, const Outcome& out, double thresholdPct)
+{
+    int regressions = 0;
+    for (auto& m : outcomeMetrics)
+    {
+        double was = base.*m.field, now = out.*m.field;
+        double deltaPct = (was) ? (now - was) * 100 / was : 0;
+        bool worse = (m.higherIsBetter) ? deltaPct < -thresholdPct :
+                                          deltaPct > thresholdPct;
+        regressions += worse;
+
+        cout.precision(4);
+        cout << "  " << left;
+        cout.width(24);
+        cout << m.key << right;
+        cout.width(14);
+        cout << was;
+        cout.width(14);
+        cout << now;
+        cout.width(10);
+        cout << deltaPct << "%" << ((worse) ? "  REGRESSED" : "") << endl;
+    }
+    return regressions;
+}
+
+static void
+usage()
+{
+    cout << "Usage:\n";
+    cout << "    regress [-m <msg sizes,...>] [-n <connection counts,...>]";
+    cout << " [-s <shaper[:args],...>] [-t <duration sec>]";
+    cout << " [-w <warm-up sec>] [-R <repetitions>] [-p <port>]";
+    cout << " [-c <baseline to compare to>] [-u <baseline to write>]";
+    cout << " [-T <threshold %>] [-v <debug|info|warn|error|none>]\n";
+}
+
+int
+main(int argc, char* argv[]) try
+{
+    signal(SIGPIPE, SIG_IGN);
+    logger::setLevel(logger::warn);
+
+    string sizesStr = "32,1400,16384,65536", connsStr = "1,4";
+    string shapersStr = "noop,rate-limit:1gbps";
+    string comparePath, updatePath;
+    int duration = 3, warmup = 1, reps = 1, port = 11300, opt;
+    double threshold = 10;
+
+    while ((opt = getopt(argc, argv, "m:n:s:t:w:R:p:c:u:T:v:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'm':
+            sizesStr = optarg;
+            break;
+        case 'n':
+            connsStr = optarg;
+            break;
+        case 's':
+            shapersStr = optarg;
+            break;
+        case 't':
+            duration = atoi(optarg);
+
+            if (duration <= 0)
+                throw std::runtime_error(ERRSTR("Please specify a valid "
+                                                "non zero duration"));
+            break;
+        case 'w':
+            warmup = atoi(optarg);
+
+            if (warmup < 0)
+                throw std::runtime_error(ERRSTR("Invalid warm-up period"));
+            break;
+        case 'R':
+            reps = atoi(optarg);
+
+            if (reps < 1)
+                throw std::runtime_error(ERRSTR("Need at least one "
+                                                "repetition"));
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'c':
+            comparePath = optarg;
+            break;
+        case 'u':
+            updatePath = optarg;
+            break;
+        case 'T':
+            threshold = atof(optarg);
+            break;
+        case 'v':
+            logger::setLevel(logger::parseLevel(optarg));
+            break;
+        case 'h':
+        default:
+            usage();
+            exit(0);
+        }
+    }
+
+    vector<Scenario> scenarios;
+    for (auto& tsd : parseShapers(shapersStr))
+    {
+        for (auto numConns : parseList(connsStr))
+        {
+            for (auto msgSize : parseList(sizesStr))
+            {
+                if (msgSize < app::small || msgSize > app::large)
+                    throw std::runtime_error(ERRSTR("Need msg size between "
+                                                    "32 bytes and 64k bytes"));
+                scenarios.push_back({msgSize, (uint16_t) numConns, tsd});
+            }
+        }
+    }
+
+    map<string, Outcome> baseline;
+    if (!comparePath.empty())
+        baseline = readBaseline(comparePath);
+
+    ip::sockaddr laddr("127.0.0.1", 0), addr("127.0.0.1", port);
+    vector<Outcome> outs;
+    int regressions = 0;
+    for (auto& sc : scenarios)
+    {
+        vector<Outcome> repOuts;
+        for (int i = 0; i < reps; i++)
+            repOuts.push_back(runScenario(sc, laddr, addr, duration, warmup));
+        outs.push_back(medianOutcome(repOuts));
+        const Outcome& out = outs.back();
+
+        cout << sc.name() << ": "
+             << ((out.throughput) ? formatThroughput(out.throughput) :
+                                    "0 bps")
+             << ", " << (uint64_t) out.msgsPerSec << " msgs/sec, CPU-sec/GB "
+             << out.clientCPUPerGB << " client, " << out.serverCPUPerGB
+             << " server\n";
+
+        auto it = baseline.find(sc.name());
+        if (it != baseline.end())
+            regressions += compare(it->second, out, threshold);
+        else if (!comparePath.empty())
+            cout << "  Not in the baseline\n";
+    }
+
+    if (!updatePath.empty())
+        writeBaseline(updatePath, scenarios, outs, duration);
+    if (!comparePath.empty())
+        cout << regressions << " metrics regressed by more than " << threshold
+             << "%\n";
+
+    logger::flush();
+    return (regressions) ? 1 : 0;
+}
+catch (std::exception& e)
+{
+    cout << "Unhandled exception: " << e.what();
+    cout << " err: " << strerror(errno) << endl;
+    return 2;
+}
+catch (...)
+{
+    cout << "Unhandled unknown exception" << endl;
+    return 2;
+}
@@ -1,4 +1,5 @@
 #include "../app.h"
+#include "../logger.h"
 #include <iostream>
 #include <string.h>
 #include <signal.h>
@@ -7,21 +8,258 @@
 using namespace std;
 
 app::ClientApp *capp = NULL;
+metrics::Exporter *exporter = NULL;
 mutex clientCompletedLock;
 condition_variable clientCompletedCV;
 int cvVar = 0;
 
+static string
+rttString(const stats::Histogram& rtt, const char* what = "probes")
+{
+    stringstream str;
+    str.precision(4);
+    str << rtt.count << " " << what << ", p50 " << rtt.percentile(50) / 1e3
+        << " us, p90 " << rtt.percentile(90) / 1e3 << " us, p99 "
+        << rtt.percentile(99) / 1e3 << " us, p99.9 "
+        << rtt.percentile(99.9) / 1e3 << " us, max "
+        << rtt.percentile(100) / 1e3 << " us";
+    return str.str();
+}
+
 static void
 printStats()
 {
-    uint64_t tput = capp->totalBytesSent / capp->testDurationSec;
-    tput *= 8;
+    bool sends = app::clientSends(capp->mode);
+    uint64_t tput = capp->steadyThroughput;
     string tputStr = (tput) ? formatThroughput(tput) : "0 bps";
 
     cout << "Test stats:\n";
-    cout << "  Sent: " << capp->totalBytesSent << " bytes\n";
-    cout << "  Time: " << capp->testDurationSec << " sec\n";
-    cout << "  Throughput: " << tputStr.c_str() << endl;
+    if (capp->mode != app::forward)
+        cout << "  Mode: " << app::trafficModeName(capp->mode) << "\n";
+    if (capp->transport != app::transportTCP)
+        cout << "  Transport: " << app::transportName(capp->transport) << "\n";
+    if (sends)
+        cout << "  Sent: " << capp->totalBytesSent << " bytes\n";
+    if (sends && (capp->warmupSec || capp->cooldownSec))
+    {
+        cout << "  Warm-up: " << capp->warmupBytes << " bytes in "
+             << capp->warmupSec << " sec\n";
+        cout << "  Steady state: " << capp->steadyBytes << " bytes\n";
+        if (capp->cooldownSec)
+            cout << "  Cool-down: " << capp->cooldownBytes << " bytes in "
+                 << capp->cooldownSec << " sec\n";
+    }
+    cout << "  Time: " << capp->steadySec << " sec\n";
+    if (sends)
+        cout << "  Throughput: " << tputStr.c_str() << endl;
+
+    if (capp->mode != app::forward)
+    {
+        uint64_t recvTput = capp->steadyRecvThroughput;
+        string recvTputStr = (recvTput) ? formatThroughput(recvTput) : "0 bps";
+        cout << "  Received: " << capp->totalBytesReceived << " bytes ("
+             << capp->steadyRecvBytes << " in the steady state)\n";
+        cout << "  Receive throughput: " << recvTputStr.c_str() << endl;
+    }
+
+    uint64_t bytes = capp->totalBytesSent + capp->totalBytesReceived;
+    cout << "  " << capp->totalCPU.toString(bytes) << endl;
+
+    if (capp->useControl && sends)
+    {
+        string goodputStr = (capp->peerGoodput) ?
+            formatThroughput(capp->peerGoodput) : "0 bps";
+        cout << "  Peer received: " << capp->totalPeerBytes << " bytes\n";
+        cout << "  Goodput: " << goodputStr.c_str() << endl;
+    }
+
+    if (capp->dests.size() > 1)
+    {
+        for (auto& dest : capp->dests)
+        {
+            results::ConnResult res = dest.result(sends);
+            cout << "  " << dest.toString() << ": " << dest.numConns
+                 << " connections, "
+                 << ((res.throughput()) ? formatThroughput(res.throughput()) :
+                                          "0 bps");
+            if (res.hasPeer)
+                cout << ", goodput "
+                     << ((res.peerGoodput()) ?
+                         formatThroughput(res.peerGoodput()) : "0 bps");
+            cout << endl;
+        }
+    }
+
+    if (!capp->ccMix.empty())
+    {
+        for (auto& share : capp->ccMix)
+        {
+            results::ConnResult res = capp->ccResult(share.algo);
+            cout << "  " << share.algo << ": " << share.numConns
+                 << " connections, "
+                 << ((res.throughput()) ? formatThroughput(res.throughput()) :
+                                          "0 bps")
+                 << ", " << res.retransmits << " retransmits, fairness "
+                 << capp->fairness(share.algo) << endl;
+        }
+        cout << "  Fairness: " << capp->fairness() << endl;
+    }
+    if (capp->transport == app::transportTCP && sends)
+        cout << "  Retransmits: " << capp->totalRetransmits << endl;
+
+    if (capp->idleConfig.intervalMs)
+    {
+        cout << "  Idle connections: " << capp->idleConnected
+             << " established, " << capp->idleLost << " lost, "
+             << capp->idleMessages << " messages, " << capp->idleSendStalls
+             << " sends skipped\n";
+    }
+
+    if (capp->sourcePool &&
+        (capp->sourcePool->sources.size() > 1 || capp->connectFailures))
+    {
+        for (auto source : capp->sourcePool->sources)
+            cout << "  Source " << source->statsString() << endl;
+    }
+
+    if (capp->transport == app::transportUDP)
+    {
+        cout << "  Datagrams: " << capp->totalPacketsSent << " sent, "
+             << capp->totalPeerPackets << " received, "
+             << capp->steadyPacketRate << " packets/sec\n";
+        cout << "  Loss: " << capp->lostPackets << " ("
+             << capp->lossPct() << "%), reordered: "
+             << capp->reorderedPackets << endl;
+    }
+
+    if (!capp->probes.empty())
+    {
+        cout << "  Probe RTT unloaded: " << rttString(capp->baselineRTT)
+             << endl;
+        cout << "  Probe RTT loaded: " << rttString(capp->loadedRTT) << endl;
+        cout << "  Probe CPU: " << capp->probeCPU.cpuSec << " sec\n";
+    }
+    if (capp->busyPollUs)
+        cout << "  Busy poll: " << capp->spinHits << " spins got data, "
+             << capp->spinMisses << " ran out\n";
+    if (capp->zeroCopy)
+        cout << "  Zero-copy: " << capp->zeroCopyBytes << " of "
+             << capp->totalBytesReceived << " bytes mapped ("
+             << ((capp->totalBytesReceived) ?
+                 100.0 * capp->zeroCopyBytes / capp->totalBytesReceived : 0)
+             << "%)\n";
+
+    if (capp->timestamping)
+        cout << "  Timestamps:\n" << capp->stamps.toString("    ");
+
+    if (capp->replayTrace)
+    {
+        cout << "  Replay lateness: "
+             << rttString(capp->replayLateness, "messages") << endl;
+        if (capp->replayUnfinished)
+            cout << "  Replay: " << capp->replayUnfinished
+                 << " connections did not get to the end of their flow\n";
+    }
+}
+
+static string
+trialString(const app::Trial& trial)
+{
+    stringstream str;
+    str.precision(4);
+    str << trial.point.toString() << ": ";
+    if (trial.failed)
+        str << "failed";
+    else
+        str << ((trial.throughput) ? formatThroughput(trial.throughput) :
+                                     "0 bps")
+            << ", " << trial.cpuPerGB << " CPU-sec/GB";
+    return str.str();
+}
+
+// One sweep trial: a whole test with the point's parameters
+static app::Trial
+runTrial(const app::SweepPoint& point,
+         const std::function<app::ClientApp* (const app::SweepPoint&)>& run)
+{
+    app::Trial trial = {point, 0, 0, true, {point.toString(), "", 0, 0,
+                                            stats::CPUStats()}};
+    try
+    {
+        capp = run(point);
+    }
+    catch (std::exception& e)
+    {
+        LOG_ERROR("Trial " << point.toString() << " failed: " << e.what());
+        capp = NULL;
+        return trial;
+    }
+
+    bool sends = app::clientSends(capp->mode);
+    results::ConnResult& res = trial.result;
+    res.bytes = ((sends) ? capp->steadyBytes : 0) +
+                ((capp->mode != app::forward) ? capp->steadyRecvBytes : 0);
+    res.durationSec = capp->steadySec;
+    res.cpu = capp->totalCPU;
+    res.retransmits = capp->totalRetransmits;
+    trial.throughput = ((sends) ? capp->steadyThroughput : 0) +
+        ((capp->mode != app::forward) ? capp->steadyRecvThroughput : 0);
+    trial.cpuPerGB = capp->totalCPU.cpuSecPerGB(capp->totalBytesSent +
+                                                capp->totalBytesReceived);
+    trial.failed = false;
+
+    delete capp;
+    capp = NULL;
+    cout << "Trial " << trialString(trial) << endl;
+    return trial;
+}
+
+static void
+printSweep(const app::Sweep& sweep)
+{
+    cout << "Sweep stats:\n";
+    cout << "  Trials: " << sweep.trials.size() << " of "
+         << sweep.config.gridSize() << " points\n";
+    for (auto& trial : sweep.trials)
+        cout << "    " << trialString(trial) << endl;
+    cout << "  Pareto frontier:\n";
+    for (auto trial : sweep.frontier())
+        cout << "    " << trialString(*trial) << endl;
+
+    const app::Trial* rec = sweep.recommended();
+    if (!rec)
+    {
+        cout << "  No trial succeeded\n";
+        return;
+    }
+    cout << "  Recommended: -m " << rec->point.msgSize << " -s "
+         << rec->point.sndBufSize << " -b " << rec->point.rcvBufSize
+         << " -n " << rec->point.numConns << " (" << trialString(*rec)
+         << ")\n";
+}
+
+static void
+fillSweepReport(const app::Sweep& sweep, results::Report& report)
+{
+    for (auto& trial : sweep.trials)
+    {
+        if (!trial.failed)
+            report.conns.push_back(trial.result);
+    }
+    for (auto trial : sweep.frontier())
+        report.groups.push_back(trial->result);
+
+    report.addMetric("trials", sweep.trials.size());
+    const app::Trial* rec = sweep.recommended();
+    if (!rec)
+        return;
+    report.total = rec->result;
+    report.addMetric("recommended_msg_size", rec->point.msgSize);
+    report.addMetric("recommended_snd_buf_size", rec->point.sndBufSize);
+    report.addMetric("recommended_rcv_buf_size", rec->point.rcvBufSize);
+    report.addMetric("recommended_connections", rec->point.numConns);
+    report.addMetric("recommended_throughput_bps", rec->throughput);
+    report.addMetric("recommended_cpu_sec_per_gb", rec->cpuPerGB);
 }
 
 static void
@@ -29,6 +267,9 @@ handleSignal(int signum)
 {
     cout << "Exiting...\n";
     delete capp;
+    delete exporter;
+    trace::tracer.close();
+    logger::flush();
     exit(signum);
 }
 
@@ -44,22 +285,69 @@ static void
 usage()
 {
     cout << "Usage:\n";
-    cout << "    testclient -c <remote ip> -p <remote port> -l <local ip>";
+    cout << "    testclient -c <remote ip> -p <remote port>";
+    cout << " -l <local ip>[,<local ip>...]";
+    cout << " [-e <addr:port[,conns=n][,rate=r][,weight=w]> ...]";
+    cout << " [-R <local port range lo-hi>] [-Q <server RSS queues>]";
+    cout << " [-K <server RSS key>]";
     cout << " [-t <test duration>] [-n <num of connections>]";
-    cout << " [-m <message size>] [-s send buffer size] [-r Rate limit]\n";
+    cout << " [-C <n algo>[,<n algo>...] (congestion control mix)]";
+    cout << " [-m <message size>] [-s send buffer size] [-r Rate limit]";
+    cout << " [-b <server receive buffer size>]";
+    cout << " [-w <warm-up sec>] [-W <cool-down sec>]";
+    cout << " [-d <forward|reverse|bidir>]";
+    cout << " [-u <tcp|udp|unix|shm>] [-G <UDP GSO segments>]";
+    cout << " [-P <num of latency probes>] [-i <probe interval us>]";
+    cout << " [-B <probe baseline sec>] [-D <probe DSCP>]";
+    cout << " [-Y <probe SO_PRIORITY>] [-T <probe TCP_NOTSENT_LOWAT>]";
+    cout << " [-o <human|json|csv>] [-f <results file>]";
+    cout << " [-v <debug|info|warn|error|none>] [-L <async|sync>]";
+    cout << " [-I <idle mode send interval ms>]";
+    cout << " [-k <keepalive idle,interval,count sec>]";
+    cout << " [-S <axis=v,...;...> (sweep m, s, r and n)]";
+    cout << " [-a (hill-climb the sweep)]";
+    cout << " [-M <[ip:]port or unix socket path> (metrics endpoint)]";
+    cout << " [-E <trace file>] [-Z <replay trace file>]";
+    cout << " [-H <sw|hw> (kernel timestamps)]";
+    cout << " [-U <busy poll us>]";
+    cout << " [-A (page-aligned framing)] [-z (zero-copy receive)]";
+    cout << " [-x (hardware perf counters)] [-X (no control channel)]\n";
 }
 
 int
 main(int argc, char* argv[]) try
 {
     signal(SIGINT, handleSignal);
+    signal(SIGPIPE, SIG_IGN);
 
     char *rAddrStr = NULL, *lAddrStr = NULL, *rate = NULL;
+    const char *resultsPath = "";
+    results::Format format = results::human;
     int rPort = 0, testDuration = 10, numConnections = 1;
-    int msgSize = app::large, sndBufSize = 0, opt;
+    int warmup = 0, cooldown = 0;
+    int msgSize = 0, sndBufSize = 0, rcvBufSize = 0, gsoSegments = 0, opt;
+    bool useControl = true;
+    app::TrafficMode mode = app::forward;
+    app::Transport transport = app::transportTCP;
+    vector<app::Destination> dests;
+    string destStr;
+    app::ProbeConfig probeConfig = {0, 10000, 1, 0, 0, 0};
+    app::SourceConfig sources;
+    app::IdleConfig idleConfig = {0, 0, 0, 0};
+    char *portRange = NULL, *ccStr = NULL;
+    vector<app::CongestionShare> ccMix;
+    bool connsGiven = false;
+    char *sweepStr = NULL, *metricsStr = NULL, *tracePath = NULL;
+    string replayPath;
+    const char* timestampStr = NULL;
+    uint32_t timestamping = 0;
+    int busyPollUs = 0;
+    app::Framing framing = app::framingPacked;
+    bool zeroCopy = false;
+    bool adaptive = false;
 
     //TODO: Improve this to parse address of form <ip>:<port>
-    while ((opt = getopt(argc, argv, "c:p:l:t:n:m:s:r:h")) != -1)
+    while ((opt = getopt(argc, argv, "c:p:l:e:R:Q:K:t:n:C:m:s:b:r:w:W:d:u:G:P:i:B:D:Y:T:o:f:v:L:I:k:S:aM:E:Z:H:U:AzxXh")) != -1)
     {
         switch (opt)
         {
@@ -72,6 +360,20 @@ main(int argc, char* argv[]) try
         case 'l':
             lAddrStr = optarg;
             break;
+        case 'e':
+            dests.push_back(app::parseDestination(optarg));
+            destStr += ((destStr.empty()) ? "" : " ") + string(optarg);
+            break;
+        case 'R':
+            portRange = optarg;
+            sources.parsePorts(optarg);
+            break;
+        case 'Q':
+            sources.rssQueues = atoi(optarg);
+            break;
+        case 'K':
+            sources.rssKey = optarg;
+            break;
         case 't':
             testDuration = atoi(optarg);
 
@@ -85,6 +387,11 @@ main(int argc, char* argv[]) try
             if (numConnections < 1)
                 throw std::runtime_error(ERRSTR("Need at least one"
                                                 " connection"));
+            connsGiven = true;
+            break;
+        case 'C':
+            ccStr = optarg;
+            ccMix = app::parseCongestionMix(optarg);
             break;
 
         case 'm':
@@ -101,9 +408,129 @@ main(int argc, char* argv[]) try
                 throw std::runtime_error(ERRSTR("Please specify a non zero"
                                                 "send buffer size"));
             break;
+        case 'b':
+            rcvBufSize = atoi(optarg);
+
+            if (rcvBufSize <= 0)
+                throw std::runtime_error(ERRSTR("Please specify a non zero "
+                                                "receive buffer size"));
+            break;
         case 'r':
             rate = optarg;
             break;
+        case 'w':
+            warmup = atoi(optarg);
+
+            if (warmup < 0)
+                throw std::runtime_error(ERRSTR("Invalid warm-up period"));
+            break;
+        case 'W':
+            cooldown = atoi(optarg);
+
+            if (cooldown < 0)
+                throw std::runtime_error(ERRSTR("Invalid cool-down period"));
+            break;
+        case 'd':
+            mode = app::parseTrafficMode(optarg);
+            break;
+        case 'u':
+            transport = app::parseTransport(optarg);
+            break;
+        case 'G':
+            gsoSegments = atoi(optarg);
+
+            if (gsoSegments < 0 || gsoSegments > UDP_MAX_SEGMENTS)
+                throw std::runtime_error(ERRSTR("Invalid number of GSO "
+                                                "segments"));
+            break;
+        case 'P':
+            probeConfig.numProbes = atoi(optarg);
+            break;
+        case 'i':
+            probeConfig.intervalUs = strtoull(optarg, NULL, 10);
+
+            if (!probeConfig.intervalUs)
+                throw std::runtime_error(ERRSTR("Need a non zero probe "
+                                                "interval"));
+            break;
+        case 'B':
+            probeConfig.baselineSec = strtoull(optarg, NULL, 10);
+            break;
+        case 'D':
+            probeConfig.dscp = atoi(optarg);
+
+            if (probeConfig.dscp > 63)
+                throw std::runtime_error(ERRSTR("DSCP is between 0 and 63"));
+            break;
+        case 'Y':
+            probeConfig.priority = atoi(optarg);
+            break;
+        case 'T':
+            probeConfig.notSentLowat = atoi(optarg);
+            break;
+        case 'o':
+            format = results::parseFormat(optarg);
+            break;
+        case 'f':
+            resultsPath = optarg;
+            break;
+        case 'v':
+            logger::setLevel(logger::parseLevel(optarg));
+            break;
+        case 'L':
+            logger::setMode(logger::parseMode(optarg));
+            break;
+        case 'I':
+            idleConfig.intervalMs = atoi(optarg);
+
+            if (!idleConfig.intervalMs)
+                throw std::runtime_error(ERRSTR("Need a non zero send "
+                                                "interval"));
+            break;
+        case 'k':
+            if (sscanf(optarg, "%u,%u,%u", &idleConfig.keepAliveIdleSec,
+                       &idleConfig.keepAliveIntervalSec,
+                       &idleConfig.keepAliveCount) < 1)
+                throw std::runtime_error(ERRSTR("Invalid keepalive"));
+            break;
+        case 'S':
+            sweepStr = optarg;
+            break;
+        case 'a':
+            adaptive = true;
+            break;
+        case 'M':
+            metricsStr = optarg;
+            break;
+        case 'E':
+            tracePath = optarg;
+            break;
+        case 'Z':
+            replayPath = optarg;
+            break;
+        case 'H':
+            timestampStr = optarg;
+            timestamping = app::parseTimestamping(optarg);
+            break;
+        case 'U':
+            busyPollUs = atoi(optarg);
+
+            if (busyPollUs <= 0)
+                throw std::runtime_error(ERRSTR("Need a non zero busy poll "
+                                                "time"));
+            break;
+        case 'A':
+            framing = app::framingAligned;
+            break;
+        case 'z':
+            zeroCopy = true;
+            break;
+        case 'x':
+            stats::enablePerfCounters();
+            break;
+        case 'X':
+            useControl = false;
+            break;
         case 'h':
         default:
             usage();
@@ -111,27 +538,185 @@ main(int argc, char* argv[]) try
         }
     }
 
+    // The unix and shm transports connect to a socket path (-c) and have no
+    // local address
+    if (!lAddrStr && rAddrStr && rAddrStr[0] == '/')
+        lAddrStr = rAddrStr;
+    if (!lAddrStr && !dests.empty() && dests[0].raddr.isUnix())
+        lAddrStr = dests[0].raddr.un.sun_path;
+
+    // -c and -p add to the -e destinations
+    if (rAddrStr)
+        dests.insert(dests.begin(), app::Destination(ip::sockaddr(rAddrStr,
+                                                                  rPort)));
+    if (dests.empty())
+        throw std::runtime_error(ERRSTR("Need a destination"));
+    if (!lAddrStr)
+        throw std::runtime_error(ERRSTR("Need a local address"));
+
+    // The mix sets the number of connections, unless -n does
+    if (!ccMix.empty() && !connsGiven)
+    {
+        numConnections = 0;
+        for (auto& share : ccMix)
+            numConnections += share.numConns;
+    }
+
+    // Datagrams default to what fits in an Ethernet frame, idle connections
+    // only send a little
+    if (!msgSize && idleConfig.intervalMs)
+        msgSize = app::small;
+    if (!msgSize)
+        msgSize = (transport == app::transportUDP) ? 1400 : app::large;
+    raiseFileLimit();
+    // Before anything is printed, so a document on stdout is all there is
+    results::Writer writer(format, resultsPath);
+    // Up before the first connection, so a scrape sees all of them
+    if (metricsStr)
+        exporter = new metrics::Exporter(metrics::parseEndpoint(metricsStr),
+                                         "client");
+    if (tracePath)
+        trace::tracer.open(tracePath);
+
     cout <<"Starting the traffic test...\n";
-    ip::sockaddr laddr(lAddrStr, 0);
-    ip::sockaddr raddr(rAddrStr, rPort);
+    sources.parseAddrs(lAddrStr);
     func_t cb = std::bind(handleClientAppDone);
 
-    ts::TSDescriptor tsd = {"noop", ""};
+    app::ClientConfig config;
+    config.testDurationSec = testDuration;
+    config.warmupSec = warmup;
+    config.cooldownSec = cooldown;
     if (rate)
+        config.tsd = {"rate-limit", rate};
+    config.useControl = useControl;
+    config.mode = mode;
+    config.transport = transport;
+    config.gsoSegments = gsoSegments;
+    config.probeConfig = probeConfig;
+    config.idleConfig = idleConfig;
+    config.ccMix = ccMix;
+    config.replayPath = replayPath;
+    config.timestamping = timestamping;
+    config.busyPollUs = busyPollUs;
+    config.framing = framing;
+    config.zeroCopy = zeroCopy;
+
+    // The sizes and the number of connections are what a sweep varies
+    auto run = [&](const app::SweepPoint& point)
+    {
+        app::ClientConfig pointConfig = config;
+        pointConfig.numDrivers = point.numConns;
+        pointConfig.msgSize = (app::MsgSize) point.msgSize;
+        pointConfig.sndBufSize = point.sndBufSize;
+        pointConfig.rcvBufSize = point.rcvBufSize;
+        return new app::ClientApp(sources, dests, cb, pointConfig);
+    };
+    app::SweepPoint point = {(uint32_t) msgSize, (uint32_t) sndBufSize,
+                             (uint32_t) rcvBufSize, (uint32_t) numConnections};
+
+    // Every trial is a whole test against the same servers, the axes that
+    // are not swept keep the values of the other options
+    app::Sweep* sweep = NULL;
+    if (sweepStr)
     {
-        tsd.name = "rate-limit";
-        tsd.args  = rate;
+        app::SweepConfig sweepConfig = {{point.msgSize}, {point.sndBufSize},
+                                        {point.rcvBufSize}, {point.numConns},
+                                        adaptive};
+        sweepConfig.parse(sweepStr);
+        sweep = new app::Sweep(sweepConfig,
+                               [&](const app::SweepPoint& p)
+                               { return runTrial(p, run); });
+        sweep->run();
+        logger::flush();
+        printSweep(*sweep);
     }
+    else
+    {
+        capp = run(point);
+
+        std::unique_lock<std::mutex> ul(clientCompletedLock);
+        clientCompletedCV.wait(ul, []{return cvVar == 1;});
 
-    capp = new app::ClientApp(laddr, raddr, testDuration, cb, tsd,
-                              numConnections, (app::MsgSize) msgSize,
-                              sndBufSize);
+        logger::flush();
+        printStats();
+    }
 
-    std::unique_lock<std::mutex> ul(clientCompletedLock);
-    clientCompletedCV.wait(ul, []{return cvVar == 1;});
+    results::Report report((sweep) ? "sweep" : "client");
+    if (rAddrStr)
+    {
+        report.addConfig("raddr", rAddrStr);
+        report.addConfig("rport", rPort);
+    }
+    if (!destStr.empty())
+        report.addConfig("destinations", destStr);
+    report.addConfig("laddr", lAddrStr);
+    if (portRange)
+        report.addConfig("lport_range", portRange);
+    if (sources.rssQueues)
+        report.addConfig("rss_queues", sources.rssQueues);
+    report.addConfig("duration_sec", testDuration);
+    report.addConfig("warmup_sec", warmup);
+    report.addConfig("cooldown_sec", cooldown);
+    report.addConfig("connections", numConnections);
+    if (ccStr)
+        report.addConfig("cc_mix", ccStr);
+    report.addConfig("msg_size", msgSize);
+    report.addConfig("snd_buf_size", sndBufSize);
+    if (rcvBufSize)
+        report.addConfig("rcv_buf_size", rcvBufSize);
+    if (sweep)
+    {
+        report.addConfig("sweep", sweepStr);
+        report.addConfig("sweep_adaptive", adaptive);
+    }
+    if (metricsStr)
+        report.addConfig("metrics_endpoint", metricsStr);
+    if (tracePath)
+        report.addConfig("trace_file", tracePath);
+    if (!replayPath.empty())
+        report.addConfig("replay_file", replayPath);
+    if (timestampStr)
+        report.addConfig("timestamping", timestampStr);
+    if (busyPollUs)
+        report.addConfig("busy_poll_us", busyPollUs);
+    if (framing == app::framingAligned)
+        report.addConfig("framing", "aligned");
+    if (zeroCopy)
+        report.addConfig("zerocopy_recv", zeroCopy);
+    report.addConfig("shaper", config.tsd.name);
+    report.addConfig("shaper_args", config.tsd.args);
+    report.addConfig("control", useControl);
+    report.addConfig("mode", app::trafficModeName(mode));
+    report.addConfig("transport", app::transportName(transport));
+    if (transport == app::transportUDP)
+        report.addConfig("gso_segments", gsoSegments);
+    if (idleConfig.intervalMs)
+    {
+        report.addConfig("idle_interval_ms", idleConfig.intervalMs);
+        report.addConfig("keepalive_idle_sec", idleConfig.keepAliveIdleSec);
+        report.addConfig("keepalive_interval_sec",
+                         idleConfig.keepAliveIntervalSec);
+        report.addConfig("keepalive_count", idleConfig.keepAliveCount);
+    }
+    report.addConfig("probes", probeConfig.numProbes);
+    if (probeConfig.numProbes)
+    {
+        report.addConfig("probe_interval_us", probeConfig.intervalUs);
+        report.addConfig("probe_baseline_sec", probeConfig.baselineSec);
+        report.addConfig("probe_dscp", probeConfig.dscp);
+        report.addConfig("probe_priority", probeConfig.priority);
+        report.addConfig("probe_notsent_lowat", probeConfig.notSentLowat);
+    }
+    if (sweep)
+        fillSweepReport(*sweep, report);
+    else
+        capp->fillReport(report);
+    writer.write(report);
 
-    printStats();
+    delete sweep;
     delete capp;
+    delete exporter;
+    trace::tracer.close();
     return 0;
 }
 catch (std::exception& e)
@@ -139,9 +724,11 @@ catch (std::exception& e)
     cout << "Unhandled exception: " << e.what();
     cout << " err: " << strerror(errno) << endl;
     delete capp;
+    delete exporter;
 }
 catch (...)
 {
     cout << "Unhandled unknown exception" << endl;
     delete capp;
+    delete exporter;
 }
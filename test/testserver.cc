@@ -1,4 +1,5 @@
 #include "../app.h"
+#include "../logger.h"
 #include <iostream>
 #include <string.h>
 #include <signal.h>
@@ -7,13 +8,60 @@
 using namespace std;
 
 app::ServerApp *sapp = NULL;
+results::Report *report = NULL;
+results::Writer *writer = NULL;
+metrics::Exporter *exporter = NULL;
 
 void
 handleSignal(int signum)
 {
-    cout << "Total bytes received: " << sapp->totalBytesReceived << endl;
     cout << "Exiting...\n";
+    sapp->stop();
+    logger::flush();
+    for (auto listener : sapp->listeners)
+        cout << listener->statsString() << endl;
+    cout << "Accepted " << sapp->acceptedConns() << " connections at ";
+    cout << sapp->acceptRate() << " accepts/sec\n";
+    cout << "Total bytes received: " << sapp->totalBytesReceived << endl;
+    if (sapp->totalBytesSent)
+        cout << "Total bytes sent: " << sapp->totalBytesSent << endl;
+    uint64_t udpBytes = 0;
+    if (sapp->udpServer)
+    {
+        udpBytes = sapp->udpServer->bytesReceived;
+        cout << "UDP: " << udpBytes << " bytes in "
+             << sapp->udpServer->packetsReceived << " datagrams\n";
+    }
+    app::IdleServer* idle = sapp->idleServer;
+    if (idle->peakConns)
+    {
+        cout << "Idle: " << idle->bytesReceived << " bytes, peak of "
+             << idle->peakConns << " connections\n";
+        cout << "  RSS: " << idle->peakMem.rssBytes << " bytes, "
+             << idle->rssPerConn() << " bytes/connection\n";
+        cout << "  TCP sockets: " << idle->peakMem.tcpSockets << ", "
+             << idle->peakMem.tcpMemBytes << " bytes of buffers, "
+             << idle->tcpMemPerConn() << " bytes/connection\n";
+    }
+    if (sapp->timestamping)
+        cout << "Timestamps:\n" << sapp->stamps.toString("  ");
+    if (sapp->busyPollUs)
+        cout << "Busy poll: " << sapp->spinHits << " spins got data, "
+             << sapp->spinMisses << " ran out\n";
+    if (sapp->zeroCopy)
+        cout << "Zero-copy: " << sapp->zeroCopyBytes << " of "
+             << sapp->totalBytesReceived << " bytes mapped ("
+             << ((sapp->totalBytesReceived) ?
+                 100.0 * sapp->zeroCopyBytes / sapp->totalBytesReceived : 0)
+             << "%)\n";
+    cout << sapp->totalCPU.toString(sapp->totalBytesReceived +
+                                    sapp->totalBytesSent + udpBytes +
+                                    idle->bytesReceived) << endl;
+    sapp->fillReport(*report);
+    writer->write(*report);
     delete sapp;
+    delete exporter;
+    trace::tracer.close();
     exit(signum);
 }
 
@@ -21,19 +69,36 @@ void
 usage()
 {
     cout << "Usage:\n";
-    cout << "    testserver -l <local ip> -p <listen port>";
-    cout << " [-r <Recv buffer size>] [-b <listen backlog>]\n";
+    cout << "    testserver -l <local ip or unix socket path> -p <listen port>";
+    cout << " [-r <Recv buffer size>] [-b <listen backlog>]";
+    cout << " [-N <num of SO_REUSEPORT listeners>]";
+    cout << " [-u (receive UDP)] [-G (UDP GRO)]";
+    cout << " [-M <[ip:]port or unix socket path> (metrics endpoint)]";
+    cout << " [-E <trace file>] [-H <sw|hw> (kernel timestamps)]";
+    cout << " [-U <busy poll us>] [-z (zero-copy receive)]";
+    cout << " [-x (hardware perf counters)]";
+    cout << " [-o <human|json|csv>] [-f <results file>]";
+    cout << " [-v <debug|info|warn|error|none>] [-L <async|sync>]\n";
 }
 
 int
 main(int argc, char* argv[]) try
 {
     signal(SIGINT, handleSignal);
+    // A client going away while we send to it is not fatal
+    signal(SIGPIPE, SIG_IGN);
 
-    char *lAddrStr = NULL;
-    int lPort = 0, rcvBufSize = 0, backlog = 128, opt;
+    char *lAddrStr = NULL, *metricsStr = NULL, *tracePath = NULL;
+    const char *resultsPath = "";
+    results::Format format = results::human;
+    int lPort = 0, rcvBufSize = 0, backlog = 128, numListeners = 1, opt;
+    int busyPollUs = 0;
+    bool zeroCopy = false;
+    bool udp = false, udpGRO = false;
+    uint32_t timestamping = 0;
+    const char* timestampStr = NULL;
 
-    while ((opt = getopt(argc, argv, "l:p:r:b:h")) != -1)
+    while ((opt = getopt(argc, argv, "l:p:r:b:N:uGM:E:H:U:zxo:f:v:L:h")) != -1)
     {
         switch (opt)
         {
@@ -53,6 +118,54 @@ main(int argc, char* argv[]) try
         case 'b':
             backlog = atoi(optarg);
             break;
+        case 'N':
+            numListeners = atoi(optarg);
+
+            if (numListeners < 1)
+                throw std::runtime_error(ERRSTR("Need at least one"
+                                                " listener"));
+            break;
+        case 'u':
+            udp = true;
+            break;
+        case 'G':
+            udpGRO = true;
+            break;
+        case 'M':
+            metricsStr = optarg;
+            break;
+        case 'E':
+            tracePath = optarg;
+            break;
+        case 'H':
+            timestampStr = optarg;
+            timestamping = app::parseTimestamping(optarg);
+            break;
+        case 'U':
+            busyPollUs = atoi(optarg);
+
+            if (busyPollUs <= 0)
+                throw std::runtime_error(ERRSTR("Need a non zero busy poll "
+                                                "time"));
+            break;
+        case 'z':
+            zeroCopy = true;
+            break;
+        case 'x':
+            stats::enablePerfCounters();
+            break;
+        case 'o':
+            format = results::parseFormat(optarg);
+            break;
+        case 'f':
+            resultsPath = optarg;
+            break;
+        case 'v':
+            logger::setLevel(logger::parseLevel(optarg));
+            break;
+        case 'L':
+            logger::setMode(logger::parseMode(optarg));
+            break;
         case 'h':
         default:
             usage();
@@ -61,8 +174,37 @@ main(int argc, char* argv[]) try
     }
 
     ip::sockaddr addr(lAddrStr, lPort);
+    raiseFileLimit();
+    // Before anything is printed, so a document on stdout is all there is
+    writer = new results::Writer(format, resultsPath);
+
+    report = new results::Report("server");
+    report->addConfig("laddr", lAddrStr);
+    report->addConfig("lport", lPort);
+    report->addConfig("rcv_buf_size", rcvBufSize);
+    report->addConfig("backlog", backlog);
+    report->addConfig("listeners", numListeners);
+    report->addConfig("udp", udp);
+    report->addConfig("udp_gro", udpGRO);
+    if (metricsStr)
+        report->addConfig("metrics_endpoint", metricsStr);
+    if (tracePath)
+        report->addConfig("trace_file", tracePath);
+    if (timestampStr)
+        report->addConfig("timestamping", timestampStr);
+    if (busyPollUs)
+        report->addConfig("busy_poll_us", busyPollUs);
+    if (zeroCopy)
+        report->addConfig("zerocopy_recv", zeroCopy);
 
-    sapp = new app::ServerApp(addr, rcvBufSize, backlog);
+    if (metricsStr)
+        exporter = new metrics::Exporter(metrics::parseEndpoint(metricsStr),
+                                         "server");
+    if (tracePath)
+        trace::tracer.open(tracePath);
+    sapp = new app::ServerApp(addr, rcvBufSize, backlog, numListeners, udp,
+                              udp && udpGRO, timestamping, busyPollUs,
+                              zeroCopy);
 
     while (true)
     {
@@ -70,14 +212,17 @@ main(int argc, char* argv[]) try
     }
 
     delete sapp;
+    delete exporter;
     return 0;
 }
 catch (std::exception& e)
 {
     cout << "Unhandled exception: " << e.what();
     cout << " err: " << strerror(errno) << endl;
+    delete exporter;
 }
 catch (...)
 {
     cout << "Unhandled unknown exception" << endl;
+    delete exporter;
 }
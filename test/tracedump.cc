@@ -0,0 +1,227 @@
+#include "../trace.h"
+#include "../helper.h"
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Converts a trace file of testclient or testserver -E to CSV, or to the
+// Chrome trace event format that chrome://tracing and Perfetto load
+
+static const char*
+eventName(uint32_t type)
+{
+    switch (type)
+    {
+    case trace::sendIssued:
+    case trace::sendCompleted:
+        return "send";
+    case trace::shaperSleep:
+    case trace::shaperWake:
+        return "shaper sleep";
+    case trace::recvBytes:
+        return "recv";
+    case trace::pollWakeup:
+        return "poll wakeup";
+    }
+    return "unknown";
+}
+
+static const char*
+csvName(uint32_t type)
+{
+    switch (type)
+    {
+    case trace::sendIssued:
+        return "send_issued";
+    case trace::sendCompleted:
+        return "send_completed";
+    case trace::shaperSleep:
+        return "shaper_sleep";
+    case trace::shaperWake:
+        return "shaper_wake";
+    case trace::recvBytes:
+        return "recv";
+    case trace::pollWakeup:
+        return "poll_wakeup";
+    }
+    return "unknown";
+}
+
+// Calls fn for the events the ring still holds, oldest first
+template <typename F>
+static void
+forEachEvent(trace::FileHeader* hdr, uint32_t ring, F fn)
+{
+    trace::RingHeader* rh = trace::ringAt(hdr, ring);
+    trace::Event* events = trace::ringEvents(rh);
+    uint64_t head = rh->head.load(std::memory_order_acquire);
+    uint64_t first = (head > hdr->ringEvents) ? head - hdr->ringEvents : 0;
+    for (uint64_t i = first; i < head; i++)
+        fn(events[i & (hdr->ringEvents - 1)]);
+}
+
+static void
+writeCSV(trace::FileHeader* hdr, uint32_t numRings, ostream& out)
+{
+    out << "ts_ns,thread,event,arg\n";
+    for (uint32_t ring = 0; ring < numRings; ring++)
+    {
+        string name = trace::ringAt(hdr, ring)->name;
+        forEachEvent(hdr, ring, [&](const trace::Event& ev)
+        {
+            out << ev.tsNs << "," << name << "," << csvName(ev.type) << ","
+                << ev.arg << "\n";
+        });
+    }
+}
+
+// Sends and shaper sleeps become durations, everything else instants. A ring
+// that wrapped may start with the end of a duration, which is left out.
+static void
+writeChrome(trace::FileHeader* hdr, uint32_t numRings, ostream& out)
+{
+    out.setf(ios::fixed);
+    out.precision(3);
+    out << "{\"traceEvents\": [";
+    bool first = true;
+    for (uint32_t ring = 0; ring < numRings; ring++)
+    {
+        string name = trace::ringAt(hdr, ring)->name;
+        out << ((first) ? "\n" : ",\n");
+        first = false;
+        out << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+            << "\"tid\": " << ring << ", \"args\": {\"name\": \"" << name
+            << "\"}}";
+
+        bool sending = false, sleeping = false;
+        forEachEvent(hdr, ring, [&](const trace::Event& ev)
+        {
+            const char* ph = "i";
+            switch (ev.type)
+            {
+            case trace::sendIssued:
+                ph = "B";
+                sending = true;
+                break;
+            case trace::sendCompleted:
+                if (!sending)
+                    return;
+                ph = "E";
+                sending = false;
+                break;
+            case trace::shaperSleep:
+                ph = "B";
+                sleeping = true;
+                break;
+            case trace::shaperWake:
+                if (!sleeping)
+                    return;
+                ph = "E";
+                sleeping = false;
+                break;
+            }
+
+            out << ",\n{\"name\": \"" << eventName(ev.type) << "\", "
+                << "\"ph\": \"" << ph << "\", \"ts\": " << ev.tsNs / 1e3
+                << ", \"pid\": 1, \"tid\": " << ring;
+            if (ph[0] == 'i')
+                out << ", \"s\": \"t\"";
+            if (ph[0] != 'E')
+                out << ", \"args\": {\"arg\": " << ev.arg << "}";
+            out << "}";
+        });
+    }
+    out << "\n]}\n";
+}
+
+static void
+usage()
+{
+    cout << "Usage:\n";
+    cout << "    tracedump -i <trace file> [-o <csv|chrome>]";
+    cout << " [-f <output file>]\n";
+}
+
+int
+main(int argc, char* argv[]) try
+{
+    string inPath, outPath, format = "csv";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:o:f:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            inPath = optarg;
+            break;
+        case 'o':
+            format = optarg;
+            if (format != "csv" && format != "chrome")
+                throw std::runtime_error(ERRSTR("Unknown output format"));
+            break;
+        case 'f':
+            outPath = optarg;
+            break;
+        case 'h':
+        default:
+            usage();
+            exit(0);
+        }
+    }
+    if (inPath.empty())
+    {
+        usage();
+        exit(1);
+    }
+
+    int fd = open(inPath.c_str(), O_RDONLY);
+    if (fd == -1)
+        throw std::runtime_error(ERRSTR("Error opening the trace file"));
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t) sizeof(trace::FileHeader))
+        throw std::runtime_error(ERRSTR("Not a trace file"));
+    void* mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+        throw std::runtime_error(ERRSTR("Error mapping the trace file"));
+
+    trace::FileHeader* hdr = (trace::FileHeader *) mem;
+    if (hdr->magic != TRACE_MAGIC || hdr->version != TRACE_VERSION)
+        throw std::runtime_error(ERRSTR("Not a trace file"));
+    uint32_t numRings = min(hdr->numRings.load(), hdr->maxRings);
+    if ((uint64_t) st.st_size < sizeof(trace::FileHeader) +
+                                hdr->maxRings * trace::ringBytes(hdr->ringEvents))
+        throw std::runtime_error(ERRSTR("Truncated trace file"));
+
+    ofstream file;
+    if (!outPath.empty())
+    {
+        file.open(outPath.c_str(), ios::out | ios::trunc);
+        if (!file)
+            throw std::runtime_error(ERRSTR("Error opening the output file"));
+    }
+    ostream& out = (outPath.empty()) ? cout : file;
+
+    if (format == "csv")
+        writeCSV(hdr, numRings, out);
+    else
+        writeChrome(hdr, numRings, out);
+    if (hdr->dropped)
+        cerr << hdr->dropped << " events were dropped, out of rings\n";
+
+    munmap(mem, st.st_size);
+    return 0;
+}
+catch (std::exception& e)
+{
+    cerr << "Unhandled exception: " << e.what();
+    cerr << " err: " << strerror(errno) << endl;
+    return 2;
+}
@@ -0,0 +1,144 @@
+#include "trace.h"
+#include "helper.h"
+#include "logger.h"
+#include "tsc.h"
+
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace std;
+
+trace::Tracer trace::tracer;
+
+namespace
+{
+    // The ring of the calling thread, and the file it belongs to
+    struct RingHandle
+    {
+        trace::RingHeader* ring;
+        trace::FileHeader* hdr;
+
+        RingHandle() : ring(NULL), hdr(NULL) {}
+    };
+
+    thread_local RingHandle localHandle;
+}
+
+trace::Tracer::Tracer() :
+    enabled(false),
+    hdr(NULL),
+    len(0)
+{
+}
+
+trace::Tracer::~Tracer()
+{
+    close();
+}
+
+// The file is sparse, only the pages of the events that were recorded take
+// space
+void
+trace::Tracer::open(const string& path)
+{
+    static_assert(sizeof(RingHeader) == TRACE_PAGE_SIZE,
+                  "Ring headers take a page");
+    static_assert(sizeof(FileHeader) == TRACE_PAGE_SIZE,
+                  "The file header takes a page");
+
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        throw std::runtime_error(ERRSTR("Error opening the trace file"));
+
+    size_t size = sizeof(FileHeader) +
+                  TRACE_MAX_RINGS * ringBytes(TRACE_RING_EVENTS);
+    if (ftruncate(fd, size) == -1)
+    {
+        ::close(fd);
+        throw std::runtime_error(ERRSTR("Error sizing the trace file"));
+    }
+
+    void* mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mem == MAP_FAILED)
+        throw std::runtime_error(ERRSTR("Error mapping the trace file"));
+
+    hdr = (FileHeader *) mem;
+    len = size;
+    hdr->magic = TRACE_MAGIC;
+    hdr->version = TRACE_VERSION;
+    hdr->maxRings = TRACE_MAX_RINGS;
+    hdr->ringEvents = TRACE_RING_EVENTS;
+    hdr->startNs = tsc::nowNs();
+    hdr->startUnixNs = chrono::duration_cast<chrono::nanoseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+    hdr->numRings = 0;
+    hdr->dropped = 0;
+    enabled.store(true, std::memory_order_release);
+}
+
+// Only once every thread that records is done
+void
+trace::Tracer::close()
+{
+    if (!hdr)
+        return;
+
+    enabled = false;
+    if (hdr->dropped)
+        LOG_WARN("Trace: out of rings, dropped " << hdr->dropped
+                 << " events");
+    munmap(hdr, len);
+    hdr = NULL;
+}
+
+trace::RingHeader*
+trace::Tracer::localRing()
+{
+    if (localHandle.hdr == hdr)
+        return localHandle.ring;
+
+    localHandle.hdr = hdr;
+    localHandle.ring = NULL;
+    uint32_t ring = hdr->numRings.fetch_add(1);
+    if (ring >= hdr->maxRings)
+    {
+        hdr->numRings.store(hdr->maxRings);
+        return NULL;
+    }
+
+    localHandle.ring = ringAt(hdr, ring);
+    return localHandle.ring;
+}
+
+void
+trace::Tracer::attach(const string& name)
+{
+    RingHeader* ring = localRing();
+    if (!ring)
+        return;
+
+    strncpy(ring->name, name.c_str(), TRACE_NAME_LEN - 1);
+    ring->name[TRACE_NAME_LEN - 1] = '\0';
+}
+
+void
+trace::Tracer::record(trace::EventType type, uint64_t arg)
+{
+    RingHeader* ring = localRing();
+    if (!ring)
+    {
+        hdr->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    Event& ev = ringEvents(ring)[head & (hdr->ringEvents - 1)];
+    ev.tsNs = tsc::nowNs() - hdr->startNs;
+    ev.type = type;
+    ev.arg = (arg > UINT32_MAX) ? UINT32_MAX : arg;
+    ring->head.store(head + 1, std::memory_order_release);
+}
@@ -0,0 +1,127 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Opt-in event tracing into a file. Every thread that records gets its own
+// ring of fixed-size events in the mmap'd file, which it alone writes, so
+// recording takes no lock and no system call. The rings keep the latest
+// events of their thread. test/tracedump turns the file into CSV or Chrome
+// trace JSON.
+namespace trace
+{
+#define TRACE_MAGIC       0x31454341525450ULL
+#define TRACE_VERSION     1
+// Power of two
+#define TRACE_RING_EVENTS (512 * 1024)
+#define TRACE_MAX_RINGS   128
+#define TRACE_NAME_LEN    48
+#define TRACE_PAGE_SIZE   4096
+
+    enum EventType
+    {
+        sendIssued    = 1, // arg: bytes handed to the socket
+        sendCompleted = 2, // arg: bytes the socket took
+        shaperSleep   = 3, // arg: ns the shaper is about to sleep
+        shaperWake    = 4,
+        recvBytes     = 5, // arg: bytes a single recv() returned
+        pollWakeup    = 6, // arg: what poll() returned
+    };
+
+    struct Event
+    {
+        // steady_clock, since FileHeader::startNs
+        uint64_t tsNs;
+        uint32_t type;
+        uint32_t arg;
+    };
+
+    struct RingHeader
+    {
+        // Free running count of the events written, only by the ring's thread
+        std::atomic<uint64_t> head;
+        char name[TRACE_NAME_LEN];
+        uint8_t pad[TRACE_PAGE_SIZE - sizeof(uint64_t) - TRACE_NAME_LEN];
+    };
+
+    struct FileHeader
+    {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t maxRings;
+        uint64_t ringEvents;
+        // steady_clock, and the wall clock at the same time
+        uint64_t startNs;
+        uint64_t startUnixNs;
+        std::atomic<uint32_t> numRings;
+        // Events of threads that came after the last ring was handed out
+        std::atomic<uint64_t> dropped;
+        uint8_t pad[TRACE_PAGE_SIZE - 7 * sizeof(uint64_t)];
+    };
+
+    // The file is a FileHeader followed by maxRings of a RingHeader and its
+    // events each
+    inline uint64_t
+    ringBytes(uint64_t ringEvents)
+    {
+        return sizeof(RingHeader) + ringEvents * sizeof(Event);
+    }
+
+    inline RingHeader*
+    ringAt(FileHeader* hdr, uint32_t ring)
+    {
+        return (RingHeader *) ((char *) hdr + sizeof(FileHeader) +
+                               ring * ringBytes(hdr->ringEvents));
+    }
+
+    inline Event*
+    ringEvents(RingHeader* ring)
+    {
+        return (Event *) (ring + 1);
+    }
+
+    struct Tracer
+    {
+        std::atomic<bool> enabled;
+        FileHeader* hdr;
+        size_t len;
+
+        void open(const std::string& path);
+        void close();
+        // Names the calling thread's ring, taking one if it has none yet
+        void attach(const std::string& name);
+        void record(EventType type, uint64_t arg);
+
+        Tracer();
+        ~Tracer();
+
+    protected:
+        RingHeader* localRing();
+    };
+
+    extern Tracer tracer;
+
+    inline bool
+    enabled()
+    {
+        return tracer.enabled.load(std::memory_order_relaxed);
+    }
+
+    inline void
+    attach(const std::string& name)
+    {
+        if (enabled())
+            tracer.attach(name);
+    }
+}
+
+#define TRACE(type, arg)                                                    \
+    do                                                                      \
+    {                                                                       \
+        if (trace::enabled())                                               \
+            trace::tracer.record(type, arg);                                \
+    } while (0)
+
+#endif /* __TRACE_H */
@@ -0,0 +1,548 @@
+#include "traffic-idle.h"
+#include "logger.h"
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include <cstring>
+
+using namespace std;
+
+// The connections pace themselves, forward over TCP
+static app::DriverConfig
+idle_driverConfig(const app::DriverConfig& config)
+{
+    app::DriverConfig base;
+    base.msgSize = config.msgSize;
+    base.gate = config.gate;
+    base.sessionId = config.sessionId;
+    return base;
+}
+
+app::IdleDriver::IdleDriver(const string& name, const uint32_t index,
+                            const uint32_t numConns, const ip::sockaddr& laddr,
+                            const ip::sockaddr& raddr,
+                            const app::DriverConfig& driverConfig,
+                            const app::IdleConfig& config) :
+    TrafficDriver(name, index, NULL, raddr, idle_driverConfig(driverConfig)),
+    config(config),
+    socks(numConns, NULL),
+    sources(numConns, NULL),
+    numConnected(0),
+    connectFailures(0),
+    messagesSent(0),
+    sendStalls(0),
+    numLost(0)
+{
+    if (!config.intervalMs)
+        throw std::runtime_error(ERRSTR("Need a non-zero send interval"));
+
+    // Sockets are bound here, a SourcePool is not thread safe
+    try
+    {
+        for (uint32_t i = 0; i < numConns; i++)
+        {
+            tcp::Socket* sock = new tcp::Socket(laddr);
+            socks[i] = sock;
+            if (driverConfig.sources)
+                sources[i] = driverConfig.sources->bind(sock, raddr);
+
+            sock->setNonBlocking();
+            // Every message goes out as soon as it is sent
+            sock->setNagle(false);
+            sock->setKeepAlive(true);
+            if (config.keepAliveIdleSec)
+                sock->setKeepAliveIdle(config.keepAliveIdleSec);
+            if (config.keepAliveIntervalSec)
+                sock->setKeepAliveInterval(config.keepAliveIntervalSec);
+            if (config.keepAliveCount)
+                sock->setKeepAliveCount(config.keepAliveCount);
+#ifdef __APPLE__
+            sock->setNoSIGPIPE();
+#endif
+        }
+    }
+    catch (...)
+    {
+        for (auto sock : socks)
+            delete sock;
+        throw;
+    }
+
+    driverThread = thread(&app::IdleDriver::doSetupAndStart, this);
+}
+
+app::IdleDriver::~IdleDriver()
+{
+    shuttingDown = true;
+    stopTraffic();
+    for (auto sock : socks)
+        delete sock;
+}
+
+void
+app::IdleDriver::doSetupAndStart()
+{
+    sendBuf = (char *) malloc(msgSize * sizeof(char));
+    memset(sendBuf, 1, msgSize);
+
+    connectAll();
+    LOG_INFO(name << ": " << numConnected << " of " << socks.size()
+             << " idle connections established with " << raddr.toString());
+    if (connectFailures)
+        LOG_WARN(name << ": " << connectFailures << " connects failed");
+
+    if (gate)
+        gate->arrive();
+
+    cpu.start();
+    startTime = tsc::FastClock::now();
+    sendMessages();
+    // The server collects the results once it has seen every connection end
+    for (auto sock : socks)
+    {
+        if (sock)
+            sock->shutdownWrite();
+    }
+    endTime = tsc::FastClock::now();
+    cpu.stop();
+}
+
+// Connects with up to IDLE_CONNECT_WINDOW handshakes in flight, so the
+// connection rate is not bound by the round trip
+void
+app::IdleDriver::connectAll()
+{
+    struct pollfd fds[IDLE_CONNECT_WINDOW];
+    uint32_t pending[IDLE_CONNECT_WINDOW];
+    chrono::steady_clock::time_point starts[IDLE_CONNECT_WINDOW];
+    uint32_t numPending = 0, next = 0;
+    while ((next < socks.size() || numPending) && !shuttingDown)
+    {
+        while (next < socks.size() && numPending < IDLE_CONNECT_WINDOW)
+        {
+            chrono::steady_clock::time_point start =
+                chrono::steady_clock::now();
+            int err = socks[next]->connectNonBlocking(raddr);
+            if (err == EINPROGRESS)
+            {
+                fds[numPending].fd = socks[next]->fd;
+                fds[numPending].events = POLLOUT;
+                fds[numPending].revents = 0;
+                pending[numPending] = next;
+                starts[numPending++] = start;
+            }
+            else
+                connected(next, start, err);
+            next++;
+        }
+
+        int rc = poll(fds, numPending, 100);
+        if (rc == -1 && errno != EINTR)
+            throw std::runtime_error(ERRSTR("Error during poll"));
+        if (rc <= 0)
+            continue;
+
+        // Finished handshakes leave the window, the others move up
+        uint32_t kept = 0;
+        for (uint32_t j = 0; j < numPending; j++)
+        {
+            if (!fds[j].revents)
+            {
+                fds[kept] = fds[j];
+                pending[kept] = pending[j];
+                starts[kept++] = starts[j];
+                continue;
+            }
+
+            connected(pending[j], starts[j], socks[pending[j]]->getError());
+        }
+        numPending = kept;
+    }
+}
+
+// Sends the Hello of a finished connect, or drops the connection if it failed
+void
+app::IdleDriver::connected(uint32_t i,
+                           const chrono::steady_clock::time_point& start,
+                           int err)
+{
+    if (!err)
+    {
+        ctrl::Hello hello = ctrl::makeHello(ctrl::idle);
+        hello.sessionId = sessionId;
+        hello.connIndex = index + i;
+
+        struct iovec iov;
+        iov.iov_base = &hello;
+        iov.iov_len  = sizeof(hello);
+        try
+        {
+            socks[i]->writeBlock(&iov, 1, sizeof(hello));
+        }
+        catch (...)
+        {
+            err = errno;
+        }
+    }
+
+    if (sources[i])
+        sources[i]->addConnect(start, !err);
+    if (!err)
+    {
+        numConnected++;
+        return;
+    }
+
+    LOG_DEBUG(name << ": connection " << index + i << " failed: "
+              << strerror(err));
+    connectFailures++;
+    delete socks[i];
+    socks[i] = NULL;
+}
+
+// The connections take turns, one every interval / connections. A send that
+// would block is skipped rather than queued, it is an idle connection after
+// all.
+void
+app::IdleDriver::sendMessages()
+{
+    std::vector<tcp::Socket*> live;
+    for (auto sock : socks)
+    {
+        if (sock)
+            live.push_back(sock);
+    }
+    if (live.empty())
+        return;
+
+    chrono::nanoseconds gap(max<int64_t>(1,
+        chrono::nanoseconds(chrono::milliseconds(config.intervalMs)).count() /
+        (int64_t) live.size()));
+    monotime_t next = tsc::FastClock::now();
+    struct iovec iov;
+    uint64_t turn = 0;
+    while (!stopSending)
+    {
+        monotime_t now = tsc::FastClock::now();
+        for (; next <= now && !stopSending; next += gap, turn++)
+        {
+            tcp::Socket*& sock = live[turn % live.size()];
+            if (!sock)
+                continue;
+
+            iov.iov_base = sendBuf;
+            iov.iov_len  = msgSize;
+            ssize_t rc = sock->send(&iov, 1);
+            if (rc > 0)
+            {
+                sentBytes += rc;
+                messagesSent += 1;
+                if (exported)
+                {
+                    exported->bytesSent += rc;
+                    exported->msgsSent += 1;
+                }
+            }
+            else if (errno == EAGAIN || errno == EWOULDBLOCK)
+                sendStalls += 1;
+            else if (errno != EINTR)
+            {
+                LOG_DEBUG(name << ": lost a connection: " << strerror(errno));
+                numLost++;
+                sock = NULL;
+            }
+        }
+
+        this_thread::sleep_until(min(next, now + chrono::milliseconds(100)));
+    }
+}
+
+void
+app::IdleDriver::addPeerReports(const std::vector<ctrl::ConnReport>& reports)
+{
+    peerValid = true;
+    for (uint32_t i = 0; i < socks.size() && index + i < reports.size(); i++)
+        peerBytes += reports[index + i].bytes;
+    peerDurationSec = elapsedSec();
+}
+
+app::IdleServer::IdleServer(const string& name) :
+    name(name),
+    shuttingDown(false),
+    bytesReceived(0),
+    exported(metrics::acquire(name)),
+    peakConns(0)
+{
+#ifdef __linux__
+    epfd = epoll_create1(0);
+    if (epfd == -1)
+        throw std::runtime_error(ERRSTR("Error in epoll_create()"));
+    efd = eventfd(0, 0);
+    if (efd == -1)
+        throw std::runtime_error(ERRSTR("Error creating event fd"));
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, efd, &ev) == -1)
+        throw std::runtime_error(ERRSTR("Error in epoll_ctl()"));
+#elif __APPLE__
+    kq = kqueue();
+    if (kq == -1)
+        throw std::runtime_error(ERRSTR("Error in kqueue()"));
+    ev_pipe(pfd);
+
+    struct kevent ev;
+    EV_SET(&ev, pfd[0], EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, NULL);
+    if (kevent(kq, &ev, 1, NULL, 0, NULL) == -1)
+        throw std::runtime_error(ERRSTR("Error while registering kevents"));
+#else
+    throw std::runtime_error(ERRSTR("Unsupported Platform"));
+#endif
+
+    baseMem.sample();
+    serverThread = thread(&app::IdleServer::serve, this);
+}
+
+app::IdleServer::~IdleServer()
+{
+    stop();
+    metrics::release(exported);
+
+#ifdef __linux__
+    close(epfd);
+    close(efd);
+#elif __APPLE__
+    close(kq);
+    close(pfd[0]);
+    close(pfd[1]);
+#endif
+}
+
+void
+app::IdleServer::stop()
+{
+    if (!serverThread.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lg(lock);
+        shuttingDown = true;
+        cv.notify_all();
+    }
+#ifdef __linux__
+    eventfd_write(efd, 1);
+#elif __APPLE__
+    ev_pipe_write(pfd[1]);
+#endif
+    serverThread.join();
+
+    for (auto& entry : conns)
+    {
+        ::close(entry.first);
+        delete entry.second;
+    }
+    conns.clear();
+}
+
+// Called from the TrafficServer that got the connection's Hello
+void
+app::IdleServer::add(int fd, uint32_t sessionId, uint32_t connIndex)
+{
+    IdleConn* conn = new IdleConn({0, fd, sessionId, connIndex});
+    int flags = rfcntl(fd, F_GETFL, 0);
+    rfcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    {
+        std::lock_guard<std::mutex> lg(lock);
+        conns[fd] = conn;
+    }
+
+#ifdef __linux__
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    int rc = epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+#elif __APPLE__
+    struct kevent ev;
+    EV_SET(&ev, fd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, conn);
+    int rc = kevent(kq, &ev, 1, NULL, 0, NULL);
+#endif
+    if (rc == -1)
+    {
+        closeConn(conn);
+        throw std::runtime_error(ERRSTR("Error adding an idle connection"));
+    }
+}
+
+void
+app::IdleServer::serve() try
+{
+#ifdef __linux__
+    struct epoll_event events[IDLE_EVENTS];
+#elif __APPLE__
+    struct kevent events[IDLE_EVENTS];
+    struct timespec timeout = {1, 0};
+#endif
+    monotime_t lastSample = tsc::FastClock::now();
+
+    cpu.start();
+    while (!shuttingDown)
+    {
+#ifdef __linux__
+        int rc = epoll_wait(epfd, events, IDLE_EVENTS, 1000);
+#elif __APPLE__
+        int rc = kevent(kq, NULL, 0, events, IDLE_EVENTS, &timeout);
+#endif
+        if (rc == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error(ERRSTR("Error during poll"));
+        }
+
+        for (int i = 0; i < rc; i++)
+        {
+#ifdef __linux__
+            IdleConn* conn = (IdleConn *) events[i].data.ptr;
+#elif __APPLE__
+            IdleConn* conn = (IdleConn *) events[i].udata;
+#endif
+            // The wake-up of stop()
+            if (conn)
+                recvConn(conn);
+        }
+
+        // Tests hold their connections for seconds, a sample a second
+        // catches the peak
+        monotime_t now = tsc::FastClock::now();
+        if (now - lastSample >= chrono::seconds(1))
+        {
+            sampleMem();
+            lastSample = now;
+        }
+    }
+    cpu.stop();
+}
+catch (std::exception& e)
+{
+    LOG_ERROR(name << ": stopped serving: " << e.what());
+}
+
+void
+app::IdleServer::recvConn(app::IdleConn* conn)
+{
+    for (;;)
+    {
+        ssize_t rc = ::recv(conn->fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (rc > 0)
+        {
+            std::lock_guard<std::mutex> lg(lock);
+            conn->bytes += rc;
+            bytesReceived += rc;
+            if (exported)
+                exported->bytesReceived += rc;
+            continue;
+        }
+        if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (rc < 0 && errno == EINTR)
+            continue;
+
+        closeConn(conn);
+        return;
+    }
+}
+
+// Closing the descriptor takes it out of the poll set as well
+void
+app::IdleServer::closeConn(app::IdleConn* conn)
+{
+    {
+        std::lock_guard<std::mutex> lg(lock);
+        conns.erase(conn->fd);
+        if (conn->sessionId)
+        {
+            uint64_t key = ((uint64_t) conn->sessionId << 32) | conn->connIndex;
+            closed[key] = {conn->connIndex, 1, conn->bytes, 0, 0, 0};
+            cv.notify_all();
+        }
+    }
+
+    ::close(conn->fd);
+    delete conn;
+}
+
+void
+app::IdleServer::sampleMem()
+{
+    uint64_t numConns;
+    {
+        std::lock_guard<std::mutex> lg(lock);
+        numConns = conns.size();
+    }
+    if (!numConns || numConns < peakConns)
+        return;
+
+    stats::MemStats mem;
+    mem.sample();
+    peakMem = mem;
+    peakConns = numConns;
+}
+
+std::vector<ctrl::ConnReport>
+app::IdleServer::collectReports(const uint32_t sessionId,
+                                const uint32_t numConns)
+{
+    uint64_t first = (uint64_t) sessionId << 32;
+    uint64_t last = first + numConns;
+    std::unique_lock<std::mutex> ul(lock);
+    cv.wait_for(ul, chrono::milliseconds(CTRL_DRAIN_TIMEOUT_MS),
+                [&]{ return shuttingDown ||
+                            (uint32_t) distance(closed.lower_bound(first),
+                                                closed.lower_bound(last)) ==
+                            numConns; });
+
+    std::vector<ctrl::ConnReport> reports(numConns);
+    for (uint32_t i = 0; i < numConns; i++)
+        reports[i] = {i, 0, 0, 0, 0, 0};
+    auto it = closed.lower_bound(first);
+    while (it != closed.end() && it->first < last)
+    {
+        reports[it->second.connIndex] = it->second;
+        it = closed.erase(it);
+    }
+
+    // Connections still open report what they got so far, and are no longer
+    // part of the session
+    for (auto& entry : conns)
+    {
+        IdleConn* conn = entry.second;
+        if (conn->sessionId != sessionId || conn->connIndex >= numConns)
+            continue;
+
+        reports[conn->connIndex].bytes = conn->bytes;
+        conn->sessionId = 0;
+    }
+
+    return reports;
+}
+
+uint64_t
+app::IdleServer::rssPerConn() const
+{
+    if (!peakConns || peakMem.rssBytes < baseMem.rssBytes)
+        return 0;
+
+    return (peakMem.rssBytes - baseMem.rssBytes) / peakConns;
+}
+
+uint64_t
+app::IdleServer::tcpMemPerConn() const
+{
+    if (!peakConns || peakMem.tcpMemBytes < baseMem.tcpMemBytes)
+        return 0;
+
+    return (peakMem.tcpMemBytes - baseMem.tcpMemBytes) / peakConns;
+}
@@ -0,0 +1,131 @@
+#ifndef __TRAFFIC_IDLE_H
+#define __TRAFFIC_IDLE_H
+
+#include "traffic.h"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace app
+{
+// Connections an IdleDriver serves from its one thread
+#define IDLE_CONNS_PER_DRIVER 8192
+// Connects an IdleDriver has in flight at a time
+#define IDLE_CONNECT_WINDOW   512
+// Events and bytes an IdleServer takes per wake-up and per read
+#define IDLE_EVENTS           256
+#define IDLE_RECV_BUF         4096
+
+    struct IdleConfig
+    {
+        // How often every connection sends a message, 0 for bulk traffic
+        uint32_t intervalMs;
+        // TCP keepalive, 0 leaves the system default
+        uint32_t keepAliveIdleSec;
+        uint32_t keepAliveIntervalSec;
+        uint32_t keepAliveCount;
+    };
+
+    // Many mostly idle connections served from one thread. Every connection
+    // sends a message per interval, and the sends are spread evenly over it.
+    // The connections take the indexes from index on.
+    struct IdleDriver : public TrafficDriver
+    {
+        const IdleConfig config;
+        std::vector<tcp::Socket*> socks;
+        std::vector<Source*> sources;
+        uint32_t numConnected;
+        uint32_t connectFailures;
+        Counter messagesSent;
+        // Sends that found the socket buffer full and were skipped
+        Counter sendStalls;
+        // Connections that broke after they were established
+        uint32_t numLost;
+
+        virtual void doSetupAndStart();
+        void connectAll();
+        void sendMessages();
+        void addPeerReports(const std::vector<ctrl::ConnReport>& reports);
+
+        // Only the message size, gate, session and sources of the driver
+        // config apply
+        IdleDriver(const std::string& name, const uint32_t index,
+                   const uint32_t numConns, const ip::sockaddr& laddr,
+                   const ip::sockaddr& raddr, const DriverConfig& driverConfig,
+                   const IdleConfig& config);
+        virtual ~IdleDriver();
+
+    protected:
+        void connected(uint32_t i,
+                       const std::chrono::steady_clock::time_point& start,
+                       int err);
+    };
+
+    // The server end of an idle connection. This and the kernel socket are
+    // all a connection costs.
+    struct IdleConn
+    {
+        uint64_t bytes;
+        int fd;
+        uint32_t sessionId;
+        uint32_t connIndex;
+    };
+
+    // Serves the idle connections of every session from one thread, and
+    // keeps track of what they cost in memory
+    struct IdleServer
+    {
+        const std::string name;
+#ifdef __linux__
+        int epfd;
+        int efd;
+#elif __APPLE__
+        int kq;
+        int pfd[2];
+#endif
+        bool shuttingDown;
+        char buf[IDLE_RECV_BUF];
+        Counter bytesReceived;
+        metrics::ConnCounters* exported;
+        stats::ThreadCPUCounters cpu;
+        // Open connections, and the reports of closed ones, by session and
+        // connection index
+        std::mutex lock;
+        std::condition_variable cv;
+        std::map<uint64_t, IdleConn*> conns;
+        std::map<uint64_t, ctrl::ConnReport> closed;
+        // Memory when the server started, and when it had the most idle
+        // connections open
+        stats::MemStats baseMem;
+        stats::MemStats peakMem;
+        uint64_t peakConns;
+        std::thread serverThread;
+
+        void add(int fd, uint32_t sessionId, uint32_t connIndex);
+        void serve();
+        // Waits for the session's connections to close, for up to the drain
+        // timeout, and removes them
+        std::vector<ctrl::ConnReport> collectReports(const uint32_t sessionId,
+                                                     const uint32_t numConns);
+        void stop();
+        // Growth over the start of the server, per connection at the peak
+        uint64_t rssPerConn() const;
+        uint64_t tcpMemPerConn() const;
+
+        IdleServer(const std::string& name);
+        ~IdleServer();
+
+    protected:
+        void recvConn(IdleConn* conn);
+        void closeConn(IdleConn* conn);
+        void sampleMem();
+    };
+};
+#endif /* __TRAFFIC_IDLE_H */
@@ -0,0 +1,372 @@
+#include "traffic-udp.h"
+#include "logger.h"
+
+#include <cstring>
+
+using namespace std;
+
+// Datagrams only go forward
+static app::DriverConfig
+udp_driverConfig(const app::DriverConfig& config)
+{
+    app::DriverConfig base;
+    base.tsd = config.tsd;
+    base.msgSize = config.msgSize;
+    base.gate = config.gate;
+    base.sessionId = config.sessionId;
+    base.transport = app::transportUDP;
+    return base;
+}
+
+app::UDPDriver::UDPDriver(const string& name, const uint32_t index,
+                          const ip::sockaddr& laddr, const ip::sockaddr& raddr,
+                          const app::DriverConfig& config,
+                          const uint16_t gsoSegments) :
+    TrafficDriver(name, index, NULL, raddr, udp_driverConfig(config)),
+    usock(NULL),
+    gsoSegments(gsoSegments),
+    sentPackets(0),
+    peerPackets(0),
+    peerReordered(0)
+{
+    if (msgSize < sizeof(ctrl::DatagramHeader) || msgSize > UDP_MAX_DATAGRAM)
+        throw std::runtime_error(ERRSTR("Invalid datagram size"));
+    if (gsoSegments > UDP_MAX_SEGMENTS ||
+        gsoSegments * msgSize > UDP_MAX_DATAGRAM)
+        throw std::runtime_error(ERRSTR("Too many GSO segments"));
+
+    usock = new udp::Socket(laddr);
+    try
+    {
+        uint16_t lport = (laddr.sa.sa_family == AF_INET6) ?
+            laddr.ipv6.sin6_port : laddr.ipv4.sin_port;
+        if (lport)
+            usock->bind();
+        if (config.sndBufSize)
+            usock->setSendBufferSize(config.sndBufSize);
+    }
+    catch (...)
+    {
+        delete usock;
+        throw;
+    }
+
+    driverThread = thread(&app::UDPDriver::doSetupAndStart, this);
+}
+
+app::UDPDriver::~UDPDriver()
+{
+    shuttingDown = true;
+    stopTraffic();
+    delete usock;
+}
+
+void
+app::UDPDriver::doSetupAndStart()
+{
+    trace::attach(name);
+    // Like a TCP connection, a socket that can't be set up is left out
+    try
+    {
+        usock->connect(raddr);
+        if (gsoSegments)
+            usock->setSegmentSize(msgSize);
+    }
+    catch (std::exception& e)
+    {
+        connectFailed = true;
+        LOG_ERROR(name << ": could not set up the UDP socket to "
+                  << raddr.toString() << ": " << e.what());
+        if (gate)
+            gate->withdraw();
+        return;
+    }
+    LOG_INFO("Connected with " << raddr.toString() << " over UDP");
+
+    // One message of the batch per UDP_BATCH slot, each holding all the
+    // segments of a GSO send
+    uint16_t segments = max(gsoSegments, (uint16_t) 1);
+    size_t bufLen = UDP_BATCH * segments * msgSize;
+    sendBuf = (char *) malloc(bufLen * sizeof(char));
+    memset(sendBuf, 1, bufLen);
+
+    if (gate)
+        gate->arrive();
+
+    cpu.start();
+    startTime = tsc::FastClock::now();
+    sendDatagrams();
+    endTime = tsc::FastClock::now();
+    cpu.stop();
+}
+
+// Sends as many datagrams per batch as the traffic shaper allows, and at
+// least one, so a rate below one datagram per shaper interval still moves
+void
+app::UDPDriver::sendDatagrams() try
+{
+    uint16_t segments = max(gsoSegments, (uint16_t) 1);
+    size_t msgLen = segments * msgSize;
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < UDP_BATCH; i++)
+    {
+        iov[i].iov_base = sendBuf + i * msgLen;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    ctrl::DatagramHeader hdr;
+    hdr.sessionId = sessionId;
+    hdr.connIndex = index;
+    hdr.seq = 0;
+    while (!stopSending)
+    {
+        if (!ts->isReady())
+            continue;
+
+        uint64_t budget = max(ts->avail() / msgSize, (uint64_t) 1);
+        budget = min(budget, (uint64_t) UDP_BATCH * segments);
+        hdr.sendNs = tsc::nowNs();
+
+        unsigned int vlen = 0;
+        uint64_t count = 0;
+        while (count < budget)
+        {
+            uint64_t n = min((uint64_t) segments, budget - count);
+            char* p = (char *) iov[vlen].iov_base;
+            for (uint64_t i = 0; i < n; i++, hdr.seq++)
+                memcpy(p + i * msgSize, &hdr, sizeof(hdr));
+
+            iov[vlen].iov_len = n * msgSize;
+            vlen++;
+            count += n;
+        }
+
+        TRACE(trace::sendIssued, count * msgSize);
+        usock->sendBatch(msgs, vlen);
+        TRACE(trace::sendCompleted, count * msgSize);
+        ts->update(count * msgSize);
+        sentBytes += count * msgSize;
+        sentPackets += count;
+        if (exported)
+        {
+            exported->bytesSent += count * msgSize;
+            exported->msgsSent += count;
+            exported->shaperWaitNs.set(ts->waitNs);
+        }
+    }
+}
+catch (std::exception& e)
+{
+    if (!shuttingDown)
+        LOG_WARN(name << ": stopped sending: " << e.what());
+}
+
+// Counts what never arrived by the time the receiver was asked, including
+// the tail of the flow that sequence numbers alone would not show
+uint64_t
+app::UDPDriver::lostPackets() const
+{
+    if (!peerValid || peerPackets >= sentPackets)
+        return 0;
+
+    return sentPackets - peerPackets;
+}
+
+double
+app::UDPDriver::steadyPacketRate() const
+{
+    double sec = steadySec();
+    return (sec > 0) ? steadyBytes() / msgSize / sec : 0;
+}
+
+uint64_t
+app::UDPFlow::lost() const
+{
+    return (maxSeq + 1 > packets) ? maxSeq + 1 - packets : 0;
+}
+
+app::UDPServer::UDPServer(const string& name, const ip::sockaddr& addr,
+                          const uint32_t rcvBufSize, const bool gro) :
+    name(name),
+    sock(addr),
+    gro(gro),
+    shuttingDown(false),
+    bytesReceived(0),
+    packetsReceived(0),
+    exported(metrics::acquire(name)),
+    generation(0),
+    cachedGeneration(0)
+{
+    sock.setReuseAddr();
+    sock.bind();
+    if (rcvBufSize)
+        sock.setRecvBufferSize(rcvBufSize);
+    if (gro)
+        sock.setGRO(true);
+    // Lets the receive loop notice that it is shutting down
+    sock.setRecvTimeout(100000);
+
+    serverThread = thread(&app::UDPServer::recvTraffic, this);
+}
+
+app::UDPServer::~UDPServer()
+{
+    stop();
+    metrics::release(exported);
+}
+
+void
+app::UDPServer::stop()
+{
+    shuttingDown = true;
+    if (serverThread.joinable())
+        serverThread.join();
+}
+
+void
+app::UDPServer::recvTraffic() try
+{
+    // Room for a full datagram, or a full GRO batch of them, per message
+    size_t bufLen = large;
+    char* bufs = (char *) malloc(UDP_BATCH * bufLen * sizeof(char));
+    char control[UDP_BATCH][CMSG_SPACE(sizeof(int))];
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < UDP_BATCH; i++)
+    {
+        iov[i].iov_base = bufs + i * bufLen;
+        iov[i].iov_len  = bufLen;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    cpu.start();
+    while (!shuttingDown)
+    {
+        for (int i = 0; i < UDP_BATCH; i++)
+        {
+            msgs[i].msg_hdr.msg_control = (gro) ? control[i] : NULL;
+            msgs[i].msg_hdr.msg_controllen = (gro) ? sizeof(control[i]) : 0;
+            msgs[i].msg_hdr.msg_flags = 0;
+        }
+
+        int rc = sock.recvBatch(msgs, UDP_BATCH);
+        if (rc < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                continue;
+            free(bufs);
+            throw std::runtime_error(ERRSTR("Error receiving datagrams"));
+        }
+
+        // Drops the flows collected since the last batch
+        if (generation.load(std::memory_order_acquire) != cachedGeneration)
+        {
+            std::lock_guard<std::mutex> lock(flowsLock);
+            cache.clear();
+            retired.clear();
+            cachedGeneration = generation.load(std::memory_order_relaxed);
+        }
+
+        monotime_t now = tsc::FastClock::now();
+        for (int i = 0; i < rc; i++)
+        {
+            const char* data = (const char *) iov[i].iov_base;
+            size_t len = msgs[i].msg_len;
+            size_t segment = (gro) ? udp::Socket::groSize(&msgs[i].msg_hdr) : 0;
+            if (!segment)
+                segment = len;
+
+            for (size_t off = 0; off < len; off += segment)
+                addDatagram(data + off, min(segment, len - off), now);
+        }
+    }
+    cpu.stop();
+    free(bufs);
+}
+catch (std::exception& e)
+{
+    LOG_ERROR(name << ": stopped receiving: " << e.what());
+}
+
+app::UDPFlow*
+app::UDPServer::findFlow(const uint64_t key)
+{
+    auto it = cache.find(key);
+    if (it != cache.end())
+        return it->second;
+
+    std::lock_guard<std::mutex> lock(flowsLock);
+    std::unique_ptr<UDPFlow>& flow = flows[key];
+    if (!flow)
+        flow.reset(new UDPFlow());
+    cache[key] = flow.get();
+    return flow.get();
+}
+
+void
+app::UDPServer::addDatagram(const char* data, size_t len,
+                            const monotime_t& now)
+{
+    ctrl::DatagramHeader hdr;
+    if (len < sizeof(hdr))
+        return;
+    memcpy(&hdr, data, sizeof(hdr));
+
+    UDPFlow& flow = *findFlow(((uint64_t) hdr.sessionId << 32) | hdr.connIndex);
+    if (!flow.packets)
+    {
+        flow.firstTime = now;
+        flow.maxSeq = hdr.seq;
+    }
+    else if (hdr.seq < flow.maxSeq)
+        flow.reordered++;
+    else
+        flow.maxSeq = hdr.seq;
+
+    flow.packets++;
+    flow.bytes += len;
+    flow.lastTime = now;
+    bytesReceived += len;
+    packetsReceived += 1;
+    if (exported)
+    {
+        exported->bytesReceived += len;
+        exported->msgsReceived += 1;
+    }
+}
+
+std::vector<ctrl::ConnReport>
+app::UDPServer::collectReports(const uint32_t sessionId,
+                               const uint32_t numConns)
+{
+    std::vector<ctrl::ConnReport> reports(numConns);
+    std::lock_guard<std::mutex> lock(flowsLock);
+    for (uint32_t i = 0; i < numConns; i++)
+    {
+        reports[i] = {i, 0, 0, 0, 0, 0};
+        auto it = flows.find(((uint64_t) sessionId << 32) | i);
+        if (it == flows.end())
+            continue;
+
+        const UDPFlow& flow = *it->second;
+        reports[i].completed = 1;
+        reports[i].bytes = flow.bytes;
+        reports[i].durationNs = chrono::duration_cast<chrono::nanoseconds>(
+                                    flow.lastTime - flow.firstTime).count();
+        reports[i].packets = flow.packets;
+        reports[i].reordered = flow.reordered;
+        LOG_INFO(name << ": session " << sessionId << " flow " << i << " got "
+                 << flow.packets << " datagrams, " << flow.lost()
+                 << " missing, " << flow.reordered << " reordered");
+        retired.push_back(std::move(it->second));
+        flows.erase(it);
+    }
+    generation.fetch_add(1, std::memory_order_release);
+
+    return reports;
+}
@@ -0,0 +1,100 @@
+#ifndef __TRAFFIC_UDP_H
+#define __TRAFFIC_UDP_H
+
+#include "traffic.h"
+#include "udp.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace app
+{
+// Datagrams handed to the kernel per sendmmsg()/recvmmsg()
+#define UDP_BATCH 32
+
+    // Sends fixed size datagrams on a connected UDP socket, batched with
+    // sendmmsg(). With GSO, every message of a batch carries gsoSegments
+    // datagrams that the kernel (or the NIC) splits up.
+    struct UDPDriver : public TrafficDriver
+    {
+        udp::Socket* usock;
+        const uint16_t gsoSegments;
+        Counter sentPackets;
+        // What the receiver measured, filled in from the control session
+        uint64_t peerPackets;
+        uint64_t peerReordered;
+
+        virtual void doSetupAndStart();
+        void sendDatagrams();
+        uint64_t lostPackets() const;
+        double steadyPacketRate() const;
+
+        // Only the shaper, message and buffer sizes, gate and session of the
+        // config apply
+        UDPDriver(const std::string& name, const uint32_t index,
+                  const ip::sockaddr& laddr, const ip::sockaddr& raddr,
+                  const DriverConfig& config, const uint16_t gsoSegments = 0);
+        virtual ~UDPDriver();
+    };
+
+    // What a UDPServer received from one driver
+    struct UDPFlow
+    {
+        uint64_t packets;
+        uint64_t bytes;
+        uint64_t maxSeq;
+        uint64_t reordered;
+        monotime_t firstTime;
+        monotime_t lastTime;
+
+        // Datagrams that never arrived, as far as the sequence numbers tell
+        uint64_t lost() const;
+    };
+
+    // Receives the datagrams of every UDP session on a single socket, bound
+    // to the same port as the TCP listeners
+    struct UDPServer
+    {
+        const std::string name;
+        udp::Socket sock;
+        const bool gro;
+        bool shuttingDown;
+        Counter bytesReceived;
+        Counter packetsReceived;
+        metrics::ConnCounters* exported;
+        stats::ThreadCPUCounters cpu;
+        // Keyed by session and connection index. The lock is only taken
+        // for a flow the receive loop has not seen yet, and to collect.
+        std::mutex flowsLock;
+        std::unordered_map<uint64_t, std::unique_ptr<UDPFlow>> flows;
+        // Collected flows, freed by the receive loop once it has dropped
+        // them from its cache
+        std::vector<std::unique_ptr<UDPFlow>> retired;
+        std::atomic<uint32_t> generation;
+        std::thread serverThread;
+
+        void recvTraffic();
+        // Removes the flows of the session, which the client has stopped
+        // sending to by then
+        std::vector<ctrl::ConnReport> collectReports(const uint32_t sessionId,
+                                                     const uint32_t numConns);
+        void stop();
+
+        UDPServer(const std::string& name, const ip::sockaddr& addr,
+                  const uint32_t rcvBufSize = 0, const bool gro = false);
+        ~UDPServer();
+
+    protected:
+        // Only touched by the receive loop
+        std::unordered_map<uint64_t, UDPFlow*> cache;
+        uint32_t cachedGeneration;
+
+        void addDatagram(const char* data, size_t len, const monotime_t& now);
+        UDPFlow* findFlow(const uint64_t key);
+    };
+};
+#endif /* __TRAFFIC_UDP_H */
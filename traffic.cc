@@ -1,149 +1,148 @@
 #include "traffic.h"
 #include "ts.h"
+#include "logger.h"
 
-#include <iostream>
 
 #ifdef __linux__
 #include <sys/eventfd.h>
+#include <sys/mman.h>
 #endif
 
 #include <cstring>
 
 using namespace std;
 
-app::TrafficEnabler::TrafficEnabler(const std::string& name,
-                                    tcp::Socket* sock,
-                                    const ip::sockaddr& raddr, char* buf) :
-    name(name),
-    sock(sock),
-    raddr(raddr),
-    buf(buf)
+static tcp::Socket*
+traffic_newSocket(const ip::sockaddr& laddr, const app::Transport transport)
 {
+    if (transport == app::transportShm)
+        return new shm::Socket(laddr);
+
+    return new tcp::Socket(laddr);
 }
 
-app::TrafficEnabler::~TrafficEnabler()
+// Between the size of a block and the block
+static uint64_t
+traffic_framePad(const app::Framing framing)
 {
-    if (buf)
-        free(buf);
-    delete sock;
+    return (framing == app::framingAligned) ?
+           TRAFFIC_FRAME_ALIGN - sizeof(uint64_t) : 0;
 }
 
-app::TrafficDriver::TrafficDriver(const string& name, const ip::sockaddr& laddr,
-                                  const ip::sockaddr& raddr,
-                                  const ts::TSDescriptor& tsd,
-                                  const MsgSize msgSize,
-                                  const uint32_t sndBufSize) :
-    app::TrafficEnabler(name, new tcp::Socket(laddr), raddr, NULL),
-    msgSize(msgSize),
-    sentBytes(0),
-    shuttingDown(false)
+app::TrafficMode
+app::parseTrafficMode(const string& str)
 {
-    uint16_t lport;
-    switch (laddr.sa.sa_family)
-    {
-    case AF_INET:
-        lport = laddr.ipv4.sin_port;
-        break;
-    case AF_INET6:
-        lport = laddr.ipv6.sin6_port;
-        break;
-    default:
-        throw std::runtime_error(ERRSTR("Wrong address family"));
-    }
-    if (lport)
-        sock->bind();
-
-    if (sndBufSize)
-        sock->setSendBufferSize(sndBufSize);
+    if (str == "forward")
+        return forward;
+    if (str == "reverse")
+        return reverse;
+    if (str == "bidir" || str == "bidirectional")
+        return bidirectional;
 
-#ifdef __APPLE__
-    sock->setNoSIGPIPE();
-#endif
+    throw std::invalid_argument(ERRSTR("Unknown traffic mode"));
+}
 
-    ts::TSProvider* tsp = ts::findTSProvider(tsd.name);
-    if (!tsp)
-        throw std::runtime_error(ERRSTR("Wrong Traffic Shaper"));
-    ts = tsp->instantiate(tsd.args);
+string
+app::trafficModeName(const app::TrafficMode mode)
+{
+    switch (mode)
+    {
+    case forward:
+        return "forward";
+    case reverse:
+        return "reverse";
+    case bidirectional:
+        return "bidirectional";
+    }
 
-    driverThread = thread(&app::TrafficDriver::doSetupAndStart, this);
+    return "unknown";
 }
 
-app::TrafficDriver::~TrafficDriver()
+bool
+app::clientSends(const app::TrafficMode mode)
 {
-    stopTraffic();
-    delete ts;
+    return mode != reverse;
 }
 
-void
-app::TrafficDriver::doSetupAndStart()
+bool
+app::serverSends(const app::TrafficMode mode)
 {
-    sock->connect(raddr);
-    cout << "Connected with " << raddr.toString().c_str() << endl;
-
-    sock->setNagle(false);
-
-    // Having a single buffer allows us to take advantage of maximum cache
-    // locality and is useful for pure network performance testing.
-    // TODO: Add better memory management and improve the TrafficDriver and
-    //       TrafficServer to support file transfers
-    buf = (char *) malloc(msgSize * sizeof(char));
-    memset(buf, 1, msgSize);
-
-    startTraffic();
+    return mode != forward;
 }
 
-void
-app::TrafficDriver::startTraffic()
+app::Transport
+app::parseTransport(const string& str)
 {
-    while (!shuttingDown)
-    {
-        if (ts->isReady())
-        {
-            // TODO: Improve this - split into perftest and reltest
-            uint64_t avail = std::min((uint64_t) msgSize, ts->avail());
-            struct iovec iov[2];
-            // TODO: Use iov[0] to send the base packet header instead of the
-            // size of transfer
-            iov[0].iov_base = &avail;
-            iov[0].iov_len  = sizeof(avail);
-            iov[1].iov_base = buf;
-            iov[1].iov_len  = avail;
-            size_t iovlen = iov[0].iov_len + iov[1].iov_len;
-            sock->writeBlock(iov, 2, iovlen);
-            ts->update(iovlen);
-            sentBytes += iovlen;
-        }
-    }
+    if (str == "tcp")
+        return transportTCP;
+    if (str == "udp")
+        return transportUDP;
+    if (str == "unix")
+        return transportUnix;
+    if (str == "shm")
+        return transportShm;
+
+    throw std::invalid_argument(ERRSTR("Unknown transport"));
 }
 
-void
-app::TrafficDriver::stopTraffic()
+string
+app::transportName(const app::Transport transport)
 {
-    if (!shuttingDown)
+    switch (transport)
     {
-        shuttingDown = true;
-        driverThread.join();
-        cout << name.c_str() << " sent " << sentBytes << " bytes\n";
+    case transportTCP:
+        return "tcp";
+    case transportUDP:
+        return "udp";
+    case transportUnix:
+        return "unix";
+    case transportShm:
+        return "shm";
     }
+
+    return "unknown";
 }
 
-app::TrafficServer::TrafficServer(const std::string& name, const int fd,
-                                  const ip::sockaddr& laddr,
-                                  const ip::sockaddr& raddr,
-                                  funcTS_t cb) :
-    app::TrafficEnabler(name, new tcp::Socket(fd, laddr), raddr, NULL),
+app::TrafficEnabler::TrafficEnabler(const std::string& name,
+                                    tcp::Socket* sock,
+                                    const ip::sockaddr& raddr, char* buf) :
+    name(name),
+    sock(sock),
+    raddr(raddr),
+    buf(buf),
+    sendBuf(NULL),
+    msgSize(large),
+    ts(NULL),
+    sentBytes(0),
     bytesReceived(0),
-    cb(cb),
-    shuttingDown(false)
+    exported(metrics::acquire(name)),
+    stamper(NULL),
+    spinUs(0),
+    spinHits(0),
+    spinMisses(0),
+    framing(framingPacked),
+    zcRegion(NULL),
+    zeroCopyBytes(0),
+    shuttingDown(false),
+    stopSending(false)
 {
 #ifdef __linux__
     efd = eventfd(0, 0);
     if (efd == -1)
+    {
+        // The destructor won't run, and the socket is ours by now
+        metrics::release(exported);
+        delete sock;
         throw std::runtime_error(ERRSTR("Error creating event fd"));
+    }
 #elif __APPLE__
     kq = kqueue();
     if (kq == -1)
+    {
+        metrics::release(exported);
+        delete sock;
         throw std::runtime_error(ERRSTR("Error in kqueue()"));
+    }
 
     ev_pipe(pfd);
     event = (struct kevent *) malloc(sizeof(struct kevent) * 2);
@@ -151,86 +150,185 @@ app::TrafficServer::TrafficServer(const std::string& name, const int fd,
 #else
     throw std::runtime_error(ERRSTR("Unsupported Platform"));
 #endif
+}
 
-    startTime = chrono::system_clock::now();
+double
+app::TrafficEnabler::elapsedSec() const
+{
+    chrono::duration<double> diff = endTime - startTime;
+    return diff.count();
+}
 
-    serverThread = thread(&app::TrafficServer::doSetupAndStart, this);
+// From the first data byte to the end of the connection
+double
+app::TrafficEnabler::dataSec() const
+{
+    if (!bytesReceived)
+        return 0;
+
+    chrono::duration<double> diff = endTime - firstByteTime;
+    return diff.count();
 }
 
-app::TrafficServer::~TrafficServer()
+app::TrafficEnabler::~TrafficEnabler()
 {
-    shuttingDown = true;
+    stopSender();
+    // Every thread that counts is done by now
+    metrics::release(exported);
 
 #ifdef __linux__
-    eventfd_write(efd, 1);
+    close(efd);
 #elif __APPLE__
-    ev_pipe_write(pfd[1]);
-#else
-    throw std::runtime_error(ERRSTR("Unsupported Platform"));
-#endif
-
-    serverThread.join();
-    printStats();
-
-#ifdef __APPLE__
+    close(kq);
     close(pfd[0]);
     close(pfd[1]);
     free(event);
     free(tevent);
 #endif
-}
 
-void
-app::TrafficServer::doSetupAndStart()
-{
-    buf = (char *) malloc(large * sizeof(char));
-    recvTraffic();
+    if (buf)
+        free(buf);
+    if (sendBuf)
+        free(sendBuf);
+#ifdef __linux__
+    if (zcRegion)
+        munmap(zcRegion, TRAFFIC_ZEROCOPY_LEN);
+#endif
+    delete ts;
+    delete stamper;
+    delete sock;
 }
 
+// The framed send loop, paced by the traffic shaper. Half-closes the
+// connection once stopped, so the peer sees the end of the data right away.
 void
-app::TrafficServer::recvBlock(void* rbuf, size_t buflen)
+app::TrafficEnabler::sendTraffic() try
 {
-    char *buf = (char *) rbuf;
-    while (!shuttingDown)
+    while (!stopSending)
     {
-#ifdef __linux__
-        int rc = poll(fds, 2, -1);
-#elif __APPLE__
-        int rc = kevent(kq, NULL, 0, tevent, 2, NULL);
-#else
-        throw std::runtime_error(ERRSTR("Unsupported Platform"));
-#endif
-        if (rc < 0)
+        if (ts->isReady())
         {
-            if (errno == EINTR)
-                continue;
-            else
-                throw std::runtime_error(ERRSTR("Error in poll"));
+            // TODO: Improve this - split into perftest and reltest
+            uint64_t avail = std::min((uint64_t) msgSize, ts->avail());
+            // Rounded up, the message size is whole pages
+            if (framing == framingAligned)
+                avail = (avail + TRAFFIC_FRAME_ALIGN - 1) &
+                        ~((uint64_t) TRAFFIC_FRAME_ALIGN - 1);
+            struct iovec iov[3];
+            // TODO: Use iov[0] to send the base packet header instead of the
+            // size of transfer
+            iov[0].iov_base = &avail;
+            iov[0].iov_len  = sizeof(avail);
+            // The padding is never read, any bytes do
+            iov[1].iov_base = sendBuf;
+            iov[1].iov_len  = traffic_framePad(framing);
+            iov[2].iov_base = sendBuf;
+            iov[2].iov_len  = avail;
+            size_t iovlen = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+            if (stamper)
+                stamper->sent(iovlen);
+            TRACE(trace::sendIssued, iovlen);
+            sock->writeBlock(iov, 3, iovlen);
+            TRACE(trace::sendCompleted, iovlen);
+            if (stamper)
+                stamper->readTx(sock);
+            ts->update(iovlen);
+            sentBytes += iovlen;
+            if (exported)
+            {
+                exported->bytesSent += iovlen;
+                exported->msgsSent += 1;
+                exported->shaperWaitNs.set(ts->waitNs);
+            }
         }
+    }
 
-        if (shuttingDown)
-            break;
+    sock->shutdownWrite();
+}
+catch (std::exception& e)
+{
+    if (!shuttingDown)
+        LOG_WARN(name << ": stopped sending: " << e.what());
+}
 
-        ssize_t count = sock->recv(buf, buflen);
-        if (count <= 0)
-        {
-            if (count < 0 && errno == EINTR)
-                continue;
-            throw std::runtime_error(ERRSTR("conn closed"));
-        }
+// Before the connection sends anything it does not tell the stamper about,
+// as that would throw off the keys
+void
+app::TrafficEnabler::enableTimestamps(uint32_t flags)
+{
+    sock->setTimestamping(flags);
+    if (!stamper)
+        stamper = new Timestamper();
+}
 
-        if (buflen - count > 0)
-        {
-            buf += count;
-            buflen -= count;
-        }
-        else
-            return;
+// The spin works without the kernel's busy polling too, which is only
+// allowed to go past net.core.busy_read with CAP_NET_ADMIN, and which unix
+// sockets don't have
+void
+app::TrafficEnabler::enableBusyPoll(uint32_t us)
+{
+    spinUs = us;
+    if (sock->addr.isUnix())
+        return;
+    try
+    {
+        sock->setBusyPoll(us);
+    }
+    catch (std::exception& e)
+    {
+        LOG_WARN(name << ": spinning without the kernel's busy poll: "
+                 << e.what());
     }
 }
 
+// Falls back to copying if the socket can't be mapped, e.g. on kernels
+// before 4.18
 void
-app::TrafficServer::recvTraffic() try
+app::TrafficEnabler::enableZeroCopy()
+{
+    try
+    {
+        zcRegion = (char *) sock->mapReceive(TRAFFIC_ZEROCOPY_LEN);
+    }
+    catch (std::exception& e)
+    {
+        LOG_WARN(name << ": copying the data instead: " << e.what());
+    }
+}
+
+void
+app::TrafficEnabler::senderMain()
+{
+    trace::attach(name + "/send");
+    senderCpu.start();
+    sendTraffic();
+    senderCpu.stop();
+}
+
+void
+app::TrafficEnabler::startSender()
+{
+    senderThread = thread(&app::TrafficEnabler::senderMain, this);
+}
+
+// Called from the thread that started the sender, after cpu.stop()
+void
+app::TrafficEnabler::stopSender()
+{
+    stopSending = true;
+    if (!senderThread.joinable())
+        return;
+
+    // A sender blocked on a peer that stopped reading only wakes up once the
+    // connection is shut down
+    if (shuttingDown)
+        sock->shutdownWrite();
+    senderThread.join();
+    cpu.result += senderCpu.result;
+}
+
+void
+app::TrafficEnabler::initPoll()
 {
 #ifdef __linux__
     fds[0].fd      = sock->fd;
@@ -252,39 +350,1051 @@ app::TrafficServer::recvTraffic() try
 #else
     throw std::runtime_error(ERRSTR("Unsupported Platform"));
 #endif
+}
+
+void
+app::TrafficEnabler::wakeUp()
+{
+#ifdef __linux__
+    eventfd_write(efd, 1);
+#elif __APPLE__
+    ev_pipe_write(pfd[1]);
+#else
+    throw std::runtime_error(ERRSTR("Unsupported Platform"));
+#endif
+}
+
+// Returns as soon as anything came, 0 only when shutting down
+size_t
+app::TrafficEnabler::recvSome(void* rbuf, size_t buflen)
+{
+    char *buf = (char *) rbuf;
+    // When the spin started running out, 0 while not spinning
+    uint64_t spinUntil = 0;
+    while (!shuttingDown)
+    {
+        // Only wait when there is nothing to read. Under load there usually
+        // is, which saves a poll() per block.
+        ssize_t count;
+        if (stamper)
+        {
+            uint64_t ns, hwNs;
+            count = sock->recvTimestamped(buf, buflen, ns, hwNs);
+            if (count > 0)
+                stamper->received(ns, hwNs);
+        }
+        else
+            count = sock->recvNonBlocking(buf, buflen);
+        if (count > 0)
+        {
+            TRACE(trace::recvBytes, count);
+            if (spinUntil)
+                spinHits++;
+            return count;
+        }
+        if (count == 0 ||
+            (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            throw std::runtime_error(ERRSTR("conn closed"));
+        waitForData(spinUntil);
+    }
+
+    return 0;
+}
+
+// Once there is nothing to read. Spins until spinUntil first, if busy
+// polling, then waits for the socket or wakeUp(). True if the socket is
+// readable, false if it should just be tried again.
+bool
+app::TrafficEnabler::waitForData(uint64_t& spinUntil)
+{
+    // Trades a core for not waiting for the wakeup
+    if (spinUs)
+    {
+        uint64_t now = tsc::nowNs();
+        if (!spinUntil)
+            spinUntil = now + spinUs * 1000ULL;
+        if (now < spinUntil)
+            return false;
+        spinMisses++;
+        spinUntil = 0;
+    }
+
+#ifdef __linux__
+    int rc = poll(fds, 2, -1);
+#elif __APPLE__
+    int rc = kevent(kq, NULL, 0, tevent, 2, NULL);
+#else
+    throw std::runtime_error(ERRSTR("Unsupported Platform"));
+#endif
+    TRACE(trace::pollWakeup, rc);
+    if (rc < 0)
+    {
+        if (errno == EINTR)
+            return false;
+        else
+            throw std::runtime_error(ERRSTR("Error in poll"));
+    }
+#ifdef __linux__
+    return fds[0].revents != 0;
+#else
+    return true;
+#endif
+}
+
+void
+app::TrafficEnabler::recvBlock(void* rbuf, size_t buflen)
+{
+    char *buf = (char *) rbuf;
+    while (buflen && !shuttingDown)
+    {
+        size_t count = recvSome(buf, buflen);
+        buf += count;
+        buflen -= count;
+    }
+}
+
+// The framed receive loop, given the header of the first block. Only returns
+// when shutting down, the end of the data is reported by recvBlock() throwing.
+void
+app::TrafficEnabler::recvFrames(uint64_t blockSize)
+{
+    firstByteTime = tsc::FastClock::now();
+    if (zcRegion)
+        return recvFramesZeroCopy(blockSize);
 
+    uint64_t pad = traffic_framePad(framing);
     while (!shuttingDown)
     {
-        // TODO: Eventually the first block of every transfer would be a packet
-        // header. We would try to read the entire header first. The header will
-        // have the transfer size as a field.
-        uint64_t blockSize;
-        recvBlock(&blockSize, sizeof(blockSize));
         if (blockSize > large)
         {
-            cout << "Malformed Packet\n";
+            LOG_ERROR(name << ": Malformed Packet");
             throw std::runtime_error(ERRSTR("Malformed Packet\n"));
         }
 
+        if (pad)
+            recvBlock(buf, pad);
         recvBlock(buf, blockSize);
-        bytesReceived += sizeof(blockSize) + blockSize;
+        uint64_t frameLen = sizeof(blockSize) + pad + blockSize;
+        bytesReceived += frameLen;
+        if (exported)
+        {
+            exported->bytesReceived += frameLen;
+            exported->msgsReceived += 1;
+        }
+        recvBlock(&blockSize, sizeof(blockSize));
     }
 }
-catch(...)
-{
-    cb(this);
-}
 
+// recvFrames() that maps the data in. Whatever the socket has in whole pages
+// is mapped, the rest is copied into buf. Either way only the sizes of the
+// blocks are read, and a size may come in pieces.
 void
-app::TrafficServer::printStats()
+app::TrafficEnabler::recvFramesZeroCopy(uint64_t blockSize)
 {
-    systime_t endTime = std::chrono::system_clock::now();
-    chrono::duration<double> diff = endTime - startTime;
-    uint64_t tput = (bytesReceived / diff.count()) * 8;
-    string tputStr = (tput) ? formatThroughput(tput) : "0 bps";
+    uint64_t pad = traffic_framePad(framing);
+    // Of the frame, after its size
+    uint64_t left = pad + blockSize;
+    size_t sizeGot = sizeof(blockSize);
+    uint64_t spinUntil = 0;
+    bool readable = false;
+    while (!shuttingDown)
+    {
+        if (blockSize > large)
+        {
+            LOG_ERROR(name << ": Malformed Packet");
+            throw std::runtime_error(ERRSTR("Malformed Packet\n"));
+        }
 
-    cout << name.c_str() << " done\n";
-    cout << "Bytes Received: " << bytesReceived << endl;
-    cout << "Time elapsed: " << diff.count() << " sec\n";
-    cout << "Throughput: " << tputStr.c_str() << endl;
+        uint32_t skip;
+        const char* data = zcRegion;
+        size_t len = sock->recvZeroCopy(zcRegion, TRAFFIC_ZEROCOPY_LEN, skip);
+        if (len)
+        {
+            TRACE(trace::recvBytes, len);
+            zeroCopyBytes += len;
+            if (spinUntil)
+                spinHits++;
+            spinUntil = 0;
+        }
+        else if (skip || readable)
+        {
+            // Less than a page, or the end of the data, which only recv()
+            // tells
+            data = buf;
+            len = recvSome(buf, (skip) ? std::min<size_t>(skip, large) :
+                                         large);
+        }
+        else
+        {
+            // Waited for, so the data is mapped rather than copied
+            readable = waitForData(spinUntil);
+            continue;
+        }
+        readable = false;
+
+        while (len)
+        {
+            if (sizeGot < sizeof(blockSize))
+            {
+                size_t n = std::min(sizeof(blockSize) - sizeGot, len);
+                memcpy((char *) &blockSize + sizeGot, data, n);
+                sizeGot += n;
+                data += n;
+                len -= n;
+                if (sizeGot < sizeof(blockSize))
+                    break;
+                if (blockSize > large)
+                    break;
+                left = pad + blockSize;
+            }
+
+            size_t n = std::min(left, (uint64_t) len);
+            left -= n;
+            data += n;
+            len -= n;
+            if (left)
+                continue;
+
+            uint64_t frameLen = sizeof(blockSize) + pad + blockSize;
+            bytesReceived += frameLen;
+            if (exported)
+            {
+                exported->bytesReceived += frameLen;
+                exported->msgsReceived += 1;
+            }
+            sizeGot = 0;
+        }
+    }
+}
+
+app::StartGate::StartGate() :
+    ready(0),
+    opened(false),
+    shuttingDown(false)
+{
+}
+
+bool
+app::StartGate::arrive()
+{
+    std::unique_lock<std::mutex> ul(lock);
+    if (shuttingDown)
+        return false;
+
+    ready++;
+    cv.notify_all();
+    cv.wait(ul, [this]{return opened || shuttingDown;});
+    return !shuttingDown;
+}
+
+void
+app::StartGate::withdraw()
+{
+    std::lock_guard<std::mutex> lg(lock);
+    ready++;
+    cv.notify_all();
+}
+
+void
+app::StartGate::waitReady(uint32_t count)
+{
+    std::unique_lock<std::mutex> ul(lock);
+    cv.wait(ul, [this, count]{
+        return ready >= count || opened || shuttingDown;
+    });
+}
+
+void
+app::StartGate::open()
+{
+    std::lock_guard<std::mutex> lg(lock);
+    opened = true;
+    cv.notify_all();
+}
+
+void
+app::StartGate::shutDown()
+{
+    std::lock_guard<std::mutex> lg(lock);
+    shuttingDown = true;
+    cv.notify_all();
+}
+
+app::DriverConfig::DriverConfig() :
+    tsd({"noop", ""}),
+    msgSize(large),
+    sndBufSize(0),
+    gate(NULL),
+    sessionId(0),
+    mode(forward),
+    transport(transportTCP),
+    sources(NULL),
+    replay(NULL),
+    replayFlow(0),
+    timestamping(0),
+    busyPollUs(0),
+    framing(framingPacked),
+    zeroCopy(false)
+{
+}
+
+app::TrafficDriver::TrafficDriver(const string& name, const uint32_t index,
+                                  tcp::Socket* sock, const ip::sockaddr& raddr,
+                                  const app::DriverConfig& config) :
+    app::TrafficEnabler(name, sock, raddr, NULL),
+    index(index),
+    mode(config.mode),
+    transport(config.transport),
+    tsd(config.tsd),
+    gate(config.gate),
+    sessionId(config.sessionId),
+    source(NULL),
+    connectFailed(false),
+    congestion(config.congestion),
+    retransmits(0),
+    peerValid(false),
+    peerBytes(0),
+    peerDurationSec(0),
+    steadyStart({0, 0, monotime_t()}),
+    steadyEnd({0, 0, monotime_t()}),
+    replay(config.replay),
+    replayFlow(config.replayFlow),
+    replayMsgs(0),
+    replayDone(false),
+    timestamping(config.timestamping),
+    busyPollUs(config.busyPollUs),
+    zeroCopy(config.zeroCopy)
+{
+    msgSize = config.msgSize;
+    framing = config.framing;
+
+    ts::TSProvider* tsp = ts::findTSProvider(tsd.name);
+    if (!tsp)
+        throw std::runtime_error(ERRSTR("Wrong Traffic Shaper"));
+    ts = tsp->instantiate(tsd.args);
+}
+
+app::TrafficDriver::TrafficDriver(const string& name, const uint32_t index,
+                                  const ip::sockaddr& laddr,
+                                  const ip::sockaddr& raddr,
+                                  const app::DriverConfig& config) :
+    TrafficDriver(name, index, traffic_newSocket(laddr, config.transport),
+                  raddr, config)
+{
+    uint16_t lport;
+    switch (laddr.sa.sa_family)
+    {
+    case AF_UNIX:
+        lport = 0;
+        break;
+    case AF_INET:
+        lport = laddr.ipv4.sin_port;
+        break;
+    case AF_INET6:
+        lport = laddr.ipv6.sin6_port;
+        break;
+    default:
+        throw std::runtime_error(ERRSTR("Wrong address family"));
+    }
+    if (config.sources)
+        source = config.sources->bind(sock, raddr);
+    else if (lport)
+        sock->bind();
+
+    if (config.sndBufSize)
+        sock->setSendBufferSize(config.sndBufSize);
+    // Before the handshake, which already runs the algorithm
+    if (!congestion.empty())
+        sock->setCongestion(congestion);
+
+#ifdef __APPLE__
+    sock->setNoSIGPIPE();
+#endif
+
+    driverThread = thread(&app::TrafficDriver::doSetupAndStart, this);
+}
+
+app::TrafficDriver::~TrafficDriver()
+{
+    // Don't wait for the server to finish sending
+    shuttingDown = true;
+    wakeUp();
+    stopTraffic();
+}
+
+void
+app::TrafficDriver::doSetupAndStart()
+{
+    trace::attach(name);
+    // A connection that fails is reported, and the test goes on without it
+    chrono::steady_clock::time_point connectStart = chrono::steady_clock::now();
+    try
+    {
+        sock->connect(raddr);
+    }
+    catch (...)
+    {
+        connectFailed = true;
+        if (source)
+            source->addConnect(connectStart, false);
+        LOG_ERROR(name << ": could not connect from "
+                  << sock->addr.toString() << " to " << raddr.toString());
+        if (gate)
+            gate->withdraw();
+        return;
+    }
+    if (source)
+        source->addConnect(connectStart, true);
+    LOG_INFO("Connected with " << raddr.toString());
+
+    // Like a failed connect, a connection that can't be set up is left out
+    try
+    {
+        setupConnection();
+    }
+    catch (std::exception& e)
+    {
+        connectFailed = true;
+        LOG_ERROR(name << ": could not set up the connection to "
+                  << raddr.toString() << ": " << e.what());
+        if (gate)
+            gate->withdraw();
+        return;
+    }
+
+    if (gate)
+        gate->arrive();
+
+    cpu.start();
+    startTime = tsc::FastClock::now();
+    if (mode == forward && replay)
+        replayTraffic();
+    else if (mode == forward)
+        sendTraffic();
+    else
+    {
+        buf = (char *) malloc(large * sizeof(char));
+        initPoll();
+        if (mode == bidirectional)
+            startSender();
+        recvTraffic();
+    }
+    endTime = tsc::FastClock::now();
+    cpu.stop();
+    stopSender();
+}
+
+// Everything between the connect and the start of the traffic
+void
+app::TrafficDriver::setupConnection()
+{
+    sock->setNagle(false);
+    // The data is only received in reverse and bidirectional mode
+    if (timestamping)
+        enableTimestamps((mode == forward) ?
+                         timestamping & ~tcp::tsRx : timestamping);
+    if (busyPollUs)
+        enableBusyPoll(busyPollUs);
+
+    // A replayed message can be of any size, and goes out in blocks of up
+    // to 64K
+    MsgSize msgSize = (replay) ? large : this->msgSize;
+    // Having a single buffer allows us to take advantage of maximum cache
+    // locality and is useful for pure network performance testing.
+    // TODO: Add better memory management and improve the TrafficDriver and
+    //       TrafficServer to support file transfers
+    sendBuf = (char *) malloc(msgSize * sizeof(char));
+    memset(sendBuf, 1, msgSize);
+
+    if (sessionId)
+    {
+        ctrl::Hello hello = ctrl::makeHello(ctrl::data);
+        hello.sessionId = sessionId;
+        hello.connIndex = index;
+        hello.msgSize = msgSize;
+        hello.mode = mode;
+        hello.framing = framing;
+        strncpy(hello.shaper, tsd.name.c_str(), CTRL_SHAPER_LEN - 1);
+        strncpy(hello.shaperArgs, tsd.args.c_str(), CTRL_SHAPER_ARGS_LEN - 1);
+        hello.transport = transport;
+
+        struct iovec iov;
+        iov.iov_base = &hello;
+        iov.iov_len  = sizeof(hello);
+        sock->writeBlock(&iov, 1, sizeof(hello));
+        if (stamper)
+            stamper->skip(sizeof(hello));
+    }
+    if (transport == transportShm)
+        static_cast<shm::Socket *>(sock)->setupRings();
+}
+
+// Sends the messages of the flow when the trace says, measured from the start
+// of the traffic, which is the start of the trace for every flow. The shaper
+// is left out, the trace sets the pace. A message that would be early waits,
+// one that is late goes out right away and its lateness is recorded.
+void
+app::TrafficDriver::replayTraffic() try
+{
+    monotime_t start = tsc::FastClock::now();
+    ReplayRecord rec;
+    for (size_t i = 0; !stopSending; i++)
+    {
+        if (!replay->message(replayFlow, i, rec))
+        {
+            replayDone = true;
+            break;
+        }
+
+        // Sleeps in slices, so the end of the test is not missed
+        monotime_t due = start + chrono::nanoseconds(rec.timeNs);
+        monotime_t now = tsc::FastClock::now();
+        while (now < due && !stopSending)
+        {
+            this_thread::sleep_until(min(due, now + chrono::milliseconds(100)));
+            now = tsc::FastClock::now();
+        }
+        if (stopSending)
+            break;
+        replayLateness.add(chrono::duration_cast<chrono::nanoseconds>(
+            now - due).count());
+
+        uint64_t left = rec.size;
+        do
+        {
+            uint64_t block = std::min(left, (uint64_t) large);
+            struct iovec iov[2];
+            iov[0].iov_base = &block;
+            iov[0].iov_len  = sizeof(block);
+            iov[1].iov_base = sendBuf;
+            iov[1].iov_len  = block;
+            size_t iovlen = iov[0].iov_len + iov[1].iov_len;
+            if (stamper)
+                stamper->sent(iovlen);
+            TRACE(trace::sendIssued, iovlen);
+            sock->writeBlock(iov, 2, iovlen);
+            TRACE(trace::sendCompleted, iovlen);
+            if (stamper)
+                stamper->readTx(sock);
+            sentBytes += iovlen;
+            if (exported)
+            {
+                exported->bytesSent += iovlen;
+                exported->msgsSent += 1;
+            }
+            left -= block;
+        } while (left && !stopSending);
+        replayMsgs++;
+    }
+
+    sock->shutdownWrite();
+}
+catch (std::exception& e)
+{
+    if (!shuttingDown)
+        LOG_WARN(name << ": stopped replaying: " << e.what());
+}
+
+// Receives until the server is done sending
+void
+app::TrafficDriver::recvTraffic() try
+{
+    if (zeroCopy)
+        enableZeroCopy();
+    uint64_t blockSize;
+    recvBlock(&blockSize, sizeof(blockSize));
+    recvFrames(blockSize);
+}
+catch(...)
+{
+}
+
+void
+app::TrafficDriver::stopTraffic()
+{
+    if (driverThread.joinable())
+    {
+        stopSending = true;
+        // Without a send loop nothing else tells the server to stop
+        if (mode == reverse)
+            sock->shutdownWrite();
+        driverThread.join();
+
+#ifdef __linux__
+        if (transport == transportTCP && sock && !connectFailed)
+        {
+            struct tcp_info ti;
+            sock->getTCPInfo(&ti);
+            retransmits = ti.tcpi_total_retrans;
+        }
+#endif
+
+        uint64_t bytes = sentBytes + bytesReceived;
+        if (mode == forward)
+            LOG_INFO(name << " sent " << sentBytes << " bytes, "
+                     << cpu.result.toString(bytes));
+        else
+            LOG_INFO(name << " sent " << sentBytes << " bytes, received "
+                     << bytesReceived << " bytes, "
+                     << cpu.result.toString(bytes));
+    }
+}
+
+uint64_t
+app::TrafficDriver::peerGoodput() const
+{
+    return (peerDurationSec > 0) ? (peerBytes / peerDurationSec) * 8 : 0;
+}
+
+// Reads the counters without synchronizing with the driver threads, the
+// timestamp is taken right after them so they match closely
+void
+app::TrafficDriver::mark(app::ByteMark& byteMark) const
+{
+    byteMark.bytes = sentBytes;
+    byteMark.recvBytes = bytesReceived;
+    byteMark.time = tsc::FastClock::now();
+}
+
+uint64_t
+app::TrafficDriver::steadyBytes() const
+{
+    return steadyEnd.bytes - steadyStart.bytes;
+}
+
+uint64_t
+app::TrafficDriver::steadyRecvBytes() const
+{
+    return steadyEnd.recvBytes - steadyStart.recvBytes;
+}
+
+double
+app::TrafficDriver::steadySec() const
+{
+    chrono::duration<double> elapsed = steadyEnd.time - steadyStart.time;
+    return elapsed.count();
+}
+
+uint64_t
+app::TrafficDriver::steadyThroughput() const
+{
+    double sec = steadySec();
+    return (sec > 0) ? (steadyBytes() / sec) * 8 : 0;
+}
+
+uint64_t
+app::TrafficDriver::steadyRecvThroughput() const
+{
+    double sec = steadySec();
+    return (sec > 0) ? (steadyRecvBytes() / sec) * 8 : 0;
+}
+
+app::LatencyProbe::LatencyProbe(const string& name, const ip::sockaddr& laddr,
+                                const ip::sockaddr& raddr,
+                                const app::ProbeConfig& config,
+                                const app::Transport transport,
+                                const uint32_t busyPollUs) :
+    app::TrafficEnabler(name, traffic_newSocket(laddr, transport), raddr,
+                        NULL),
+    config(config),
+    transport(transport),
+    busyPollUs(busyPollUs),
+    phase(probeBaseline)
+{
+    // Set before connecting, so the handshake is marked as well
+    if (config.dscp)
+        sock->setDSCP(config.dscp);
+    if (config.priority)
+        sock->setPriority(config.priority);
+    if (config.notSentLowat)
+        sock->setNotSentLowat(config.notSentLowat);
+#ifdef __APPLE__
+    sock->setNoSIGPIPE();
+#endif
+
+    probeThread = thread(&app::LatencyProbe::doSetupAndStart, this);
+}
+
+app::LatencyProbe::~LatencyProbe()
+{
+    stopTraffic();
+}
+
+void
+app::LatencyProbe::doSetupAndStart()
+{
+    sock->connect(raddr);
+    sock->setNagle(false);
+    if (busyPollUs)
+        enableBusyPoll(busyPollUs);
+
+    ctrl::Hello hello = ctrl::makeHello(ctrl::probe);
+    hello.dscp = config.dscp;
+    hello.transport = transport;
+
+    struct iovec iov;
+    iov.iov_base = &hello;
+    iov.iov_len  = sizeof(hello);
+    sock->writeBlock(&iov, 1, sizeof(hello));
+    if (transport == transportShm)
+        static_cast<shm::Socket *>(sock)->setupRings();
+
+    initPoll();
+    cpu.start();
+    startTime = tsc::FastClock::now();
+    probeTraffic();
+    endTime = tsc::FastClock::now();
+    cpu.stop();
+}
+
+// One request in flight at a time. A late response delays the next request
+// rather than bunching the following ones up.
+void
+app::LatencyProbe::probeTraffic() try
+{
+    ctrl::Probe req, resp;
+    memset(&req, 0, sizeof(req));
+    monotime_t next = tsc::FastClock::now();
+    while (!stopSending)
+    {
+        monotime_t sent = tsc::FastClock::now();
+        req.seq++;
+        req.sendNs = chrono::duration_cast<chrono::nanoseconds>(
+                         sent.time_since_epoch()).count();
+
+        struct iovec iov;
+        iov.iov_base = &req;
+        iov.iov_len  = sizeof(req);
+        sock->writeBlock(&iov, 1, sizeof(req));
+        sentBytes += sizeof(req);
+        if (exported)
+        {
+            exported->bytesSent += sizeof(req);
+            exported->msgsSent += 1;
+        }
+
+        recvBlock(&resp, sizeof(resp));
+        if (shuttingDown)
+            break;
+        monotime_t now = tsc::FastClock::now();
+        bytesReceived += sizeof(resp);
+        if (exported)
+        {
+            exported->bytesReceived += sizeof(resp);
+            exported->msgsReceived += 1;
+        }
+        if (resp.seq != req.seq)
+            throw std::runtime_error(ERRSTR("Probe out of sequence"));
+
+        uint64_t rtt = chrono::duration_cast<chrono::nanoseconds>(
+                           now - sent).count();
+        if (phase == probeBaseline)
+            baselineRTT.add(rtt);
+        else if (phase == probeLoaded)
+            loadedRTT.add(rtt);
+
+        next += chrono::microseconds(config.intervalUs);
+        if (next < now)
+            next = now;
+        this_thread::sleep_until(next);
+    }
+}
+catch (std::exception& e)
+{
+    if (!shuttingDown)
+        LOG_WARN(name << ": stopped probing: " << e.what());
+}
+
+void
+app::LatencyProbe::stopTraffic()
+{
+    if (probeThread.joinable())
+    {
+        stopSending = true;
+        shuttingDown = true;
+        wakeUp();
+        probeThread.join();
+    }
+}
+
+app::TrafficServer::TrafficServer(const std::string& name, const int fd,
+                                  const ip::sockaddr& laddr,
+                                  const ip::sockaddr& raddr,
+                                  funcTS_t cb, funcHello_t helloCb) :
+    // A unix connection only turns to shared memory if its Hello asks for it
+    app::TrafficEnabler(name, (laddr.isUnix()) ?
+                            new shm::Socket(fd, laddr) :
+                            new tcp::Socket(fd, laddr),
+                        raddr, NULL),
+    slot(0),
+    nextCompleted(NULL),
+    connType(0),
+    sessionId(0),
+    connIndex(0),
+    mode(forward),
+    timestamping(0),
+    busyPollUs(0),
+    zeroCopy(false),
+    cb(cb),
+    helloCb(helloCb),
+    closed(false)
+{
+    startTime = tsc::FastClock::now();
+}
+
+app::TrafficServer::~TrafficServer()
+{
+    stopTraffic();
+    printStats();
+}
+
+void
+app::TrafficServer::start()
+{
+    serverThread = thread(&app::TrafficServer::doSetupAndStart, this);
+}
+
+void
+app::TrafficServer::stopTraffic()
+{
+    if (!shuttingDown)
+    {
+        shuttingDown = true;
+        wakeUp();
+
+        if (serverThread.joinable())
+            serverThread.join();
+    }
+}
+
+void
+app::TrafficServer::doSetupAndStart()
+{
+    trace::attach(name);
+    // The send side once there is something to send, see setupSender()
+    try
+    {
+        if (timestamping & tcp::tsRx)
+            enableTimestamps(timestamping & ~tcp::tsTx);
+    }
+    catch (std::exception& e)
+    {
+        LOG_ERROR(name << ": could not set up the connection from "
+                  << raddr.toString() << ": " << e.what());
+        closed = true;
+    }
+    if (busyPollUs)
+        enableBusyPoll(busyPollUs);
+    cpu.start();
+    if (!closed)
+        recvTraffic();
+    endTime = tsc::FastClock::now();
+    cpu.stop();
+    stopSender();
+
+    // The server may be deleted as soon as this returns
+    if (closed)
+        cb(this);
+}
+
+// Sends back to the client as the data Hello asks, with the same kind of
+// traffic shaper the client would have used
+void
+app::TrafficServer::setupSender(const ctrl::Hello& hello)
+{
+    if (hello.msgSize < small || hello.msgSize > large)
+        throw std::runtime_error(ERRSTR("Invalid message size"));
+    if (framing == framingAligned && hello.msgSize % TRAFFIC_FRAME_ALIGN)
+        throw std::runtime_error(ERRSTR("Page-aligned framing needs a "
+                                        "message size of whole pages"));
+    msgSize = (MsgSize) hello.msgSize;
+
+    string shaper(hello.shaper, strnlen(hello.shaper, CTRL_SHAPER_LEN));
+    string args(hello.shaperArgs,
+                strnlen(hello.shaperArgs, CTRL_SHAPER_ARGS_LEN));
+    ts::TSProvider* tsp = ts::findTSProvider(shaper);
+    if (!tsp)
+        throw std::runtime_error(ERRSTR("Wrong Traffic Shaper"));
+    ts = tsp->instantiate(args);
+
+    sendBuf = (char *) malloc(msgSize * sizeof(char));
+    memset(sendBuf, 1, msgSize);
+
+    if (timestamping & tcp::tsTx)
+        enableTimestamps(timestamping);
+
+    // The send loop blocks in writev(), the receive loop keeps polling
+    sock->setBlocking();
+    sock->setNagle(false);
+#ifdef __APPLE__
+    sock->setNoSIGPIPE();
+#endif
+}
+
+// Reverse and bidirectional mode measure from when the client started the
+// test, not from the connect
+void
+app::TrafficServer::senderMain()
+{
+    if (startGate)
+    {
+        if (!startGate->arrive())
+            return;
+        startTime = tsc::FastClock::now();
+    }
+    if (!stopSending)
+        TrafficEnabler::senderMain();
+}
+
+void
+app::TrafficServer::setupTransport(const ctrl::Hello& hello)
+{
+    if (hello.transport != transportShm)
+        return;
+
+    shm::Socket* shmSock = dynamic_cast<shm::Socket *>(sock);
+    if (!shmSock)
+        throw std::runtime_error(ERRSTR("Shared memory needs a unix socket"));
+    shmSock->acceptRings();
+}
+
+void
+app::TrafficServer::echoProbes(const ctrl::Hello& hello)
+{
+    if (hello.dscp)
+        sock->setDSCP(hello.dscp);
+    sock->setNagle(false);
+    sock->setBlocking();
+
+    ctrl::Probe probe;
+    while (!shuttingDown)
+    {
+        recvBlock(&probe, sizeof(probe));
+        if (shuttingDown)
+            break;
+        bytesReceived += sizeof(probe);
+        if (exported)
+        {
+            exported->bytesReceived += sizeof(probe);
+            exported->msgsReceived += 1;
+        }
+
+        struct iovec iov;
+        iov.iov_base = &probe;
+        iov.iov_len  = sizeof(probe);
+        sock->writeBlock(&iov, 1, sizeof(probe));
+        sentBytes += sizeof(probe);
+        if (exported)
+        {
+            exported->bytesSent += sizeof(probe);
+            exported->msgsSent += 1;
+        }
+    }
+}
+
+void
+app::TrafficServer::recvTraffic() try
+{
+    initPoll();
+
+    // TODO: Eventually the first block of every transfer would be a packet
+    // header. We would try to read the entire header first. The header will
+    // have the transfer size as a field.
+    uint64_t blockSize;
+    recvBlock(&blockSize, sizeof(blockSize));
+
+    if (!shuttingDown && blockSize == CTRL_MAGIC)
+    {
+        ctrl::Hello hello;
+        hello.magic = blockSize;
+        recvBlock((char *) &hello + sizeof(blockSize),
+                  sizeof(hello) - sizeof(blockSize));
+        if (shuttingDown)
+            return;
+
+        connType = hello.type;
+        // An idle connection is handed over to the IdleServer as it is,
+        // nothing of the TrafficServer stays around for it
+        if (connType == ctrl::idle)
+        {
+            if (helloCb)
+                helloCb(this, hello);
+            closed = true;
+            return;
+        }
+
+        // Only allocated now, so a connection that is handed over never
+        // pays for it
+        buf = (char *) malloc(large * sizeof(char));
+        if (connType != ctrl::control)
+            setupTransport(hello);
+        if (connType == ctrl::data)
+        {
+            sessionId = hello.sessionId;
+            connIndex = hello.connIndex;
+            if (hello.mode > bidirectional)
+                throw std::runtime_error(ERRSTR("Invalid traffic mode"));
+            mode = (TrafficMode) hello.mode;
+            if (hello.framing > framingAligned)
+                throw std::runtime_error(ERRSTR("Invalid framing"));
+            framing = (Framing) hello.framing;
+            if (serverSends(mode))
+                setupSender(hello);
+        }
+
+        // A control connection is served entirely from the callback
+        if (helloCb)
+            helloCb(this, hello);
+        if (connType == ctrl::control)
+        {
+            closed = true;
+            return;
+        }
+        if (connType == ctrl::probe)
+        {
+            echoProbes(hello);
+            return;
+        }
+
+        // Runs until the client is done sending
+        if (serverSends(mode))
+            startSender();
+        recvBlock(&blockSize, sizeof(blockSize));
+    }
+
+    if (!buf)
+        buf = (char *) malloc(large * sizeof(char));
+    if (zeroCopy)
+        enableZeroCopy();
+    recvFrames(blockSize);
+}
+catch(...)
+{
+    closed = true;
+}
+
+void
+app::TrafficServer::printStats()
+{
+    // The IdleServer took over the connection
+    if (connType == ctrl::idle)
+        return;
+
+    double elapsed = elapsedSec();
+    uint64_t tput = (bytesReceived / elapsed) * 8;
+    string tputStr = (tput) ? formatThroughput(tput) : "0 bps";
+
+    LOG_INFO(name << " done");
+    LOG_INFO("Bytes Received: " << bytesReceived);
+    if (serverSends(mode))
+        LOG_INFO("Bytes Sent: " << sentBytes);
+    LOG_INFO("Time elapsed: " << elapsed << " sec");
+    LOG_INFO("Throughput: " << tputStr);
+    if (serverSends(mode))
+    {
+        uint64_t sendTput = (sentBytes / elapsed) * 8;
+        LOG_INFO("Send Throughput: "
+                 << ((sendTput) ? formatThroughput(sendTput) : "0 bps"));
+    }
+    LOG_INFO(cpu.result.toString(bytesReceived + sentBytes));
 }
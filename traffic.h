@@ -2,8 +2,16 @@
 #define __TRAFFIC_H
 
 #include "tcp.h"
+#include "shm.h"
 #include "helper.h"
 #include "ts.h"
+#include "stats.h"
+#include "ctrl.h"
+#include "srcpool.h"
+#include "replay.h"
+#include "tstamp.h"
+#include "metrics.h"
+#include "trace.h"
 
 #ifdef __linux__
 #include <poll.h>
@@ -11,13 +19,25 @@
 #include <sys/event.h>
 #endif
 
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 
 namespace app
 {
+// Page-aligned framing: where every block header and payload starts in the
+// stream, whatever the page size of either host
+#define TRAFFIC_FRAME_ALIGN  4096
+// The region the receiver maps the data into, per connection
+#define TRAFFIC_ZEROCOPY_LEN (4 * 64 * 1024)
+
     struct TrafficServer;
     typedef std::function<void (TrafficServer *)> funcTS_t;
+    typedef std::function<void (TrafficServer *, const ctrl::Hello&)>
+        funcHello_t;
 
     enum MsgSize
     {
@@ -25,65 +45,332 @@ namespace app
         large = 64 * 1024,
     };
 
+    // Which end of a connection sends
+    enum TrafficMode
+    {
+        forward       = 0, // The client sends, the server receives
+        reverse       = 1, // The server sends, the client receives
+        bidirectional = 2, // Both ends send and receive at the same time
+    };
+
+    // What carries the data connections. The control channel and the latency
+    // probes use TCP, or the unix socket for the same-host transports.
+    enum Transport
+    {
+        transportTCP  = 0,
+        transportUDP  = 1,
+        // Same host only, to tell the cost of the TCP stack apart
+        transportUnix = 2,
+        transportShm  = 3,
+    };
+
+    // How the blocks of a data connection are laid out in the stream
+    enum Framing
+    {
+        // The size of the block, then the block
+        framingPacked  = 0,
+        // The size padded to a page, then a block of whole pages, so the
+        // receiver can map the data in rather than copy it
+        framingAligned = 1,
+    };
+
+    TrafficMode parseTrafficMode(const std::string& str);
+    std::string trafficModeName(const TrafficMode mode);
+    bool clientSends(const TrafficMode mode);
+    bool serverSends(const TrafficMode mode);
+    Transport parseTransport(const std::string& str);
+    std::string transportName(const Transport transport);
+
+    // One end of a connection. Both ends share the framed send and receive
+    // loops. A connection that only sends or only receives runs the loop in
+    // its own thread; one that does both runs the send loop in a second
+    // thread.
 	struct TrafficEnabler
 	{
         std::string name;
         tcp::Socket* sock;
         ip::sockaddr raddr;
+        // The receive and send buffers are separate so both loops can run at
+        // the same time
         char* buf;
+        char* sendBuf;
+#ifdef __linux__
+        struct pollfd fds[2];
+        int efd;
+#elif __APPLE__
+        int kq;
+        int pfd[2];
+        struct kevent *event;
+        struct kevent *tevent;
+#endif
+        MsgSize msgSize;
+        ts::TrafficShaper* ts;
+        Counter sentBytes;
+        Counter bytesReceived;
+        // The same and more for the metrics exporter, NULL unless enabled
+        metrics::ConnCounters* exported;
+        // Kernel timestamps of the data, NULL unless enabled
+        Timestamper* stamper;
+        // How long the receive loop spins on recv() before it waits in
+        // poll(), 0 to wait right away. A hit is data that came while it
+        // spun, a miss a spin that ran out.
+        uint32_t spinUs;
+        uint64_t spinHits;
+        uint64_t spinMisses;
+        Framing framing;
+        // Zero-copy receive: where the data is mapped in, NULL when it is
+        // copied, and the bytes that came that way
+        char* zcRegion;
+        uint64_t zeroCopyBytes;
+        stats::ThreadCPUCounters cpu;
+        // Added to cpu once the send thread is done
+        stats::ThreadCPUCounters senderCpu;
+        monotime_t startTime;
+        monotime_t endTime;
+        monotime_t firstByteTime;
+        // Stops the receive loop, along with wakeUp()
+        bool shuttingDown;
+        bool stopSending;
+        std::thread senderThread;
 
         virtual void doSetupAndStart() = 0;
+        double elapsedSec() const;
+        double dataSec() const;
+
+        void sendTraffic();
+        void enableTimestamps(uint32_t flags);
+        void enableBusyPoll(uint32_t us);
+        void enableZeroCopy();
+        void startSender();
+        void stopSender();
+
+        void initPoll();
+        void wakeUp();
+        size_t recvSome(void* rbuf, size_t buflen);
+        bool waitForData(uint64_t& spinUntil);
+        void recvBlock(void* rbuf, size_t buflen);
+        void recvFrames(uint64_t blockSize);
+        void recvFramesZeroCopy(uint64_t blockSize);
 
         TrafficEnabler(const std::string& name, tcp::Socket* sock,
                        const ip::sockaddr& raddr, char* buf);
         virtual ~TrafficEnabler();
+
+    protected:
+        virtual void senderMain();
 	};
 
-    struct TrafficDriver : public TrafficEnabler
+    // Holds the drivers back until all of them are connected, so connection
+    // setup is not part of the measurement
+    struct StartGate
     {
-        MsgSize msgSize;
-        uint64_t sentBytes;
-        ts::TrafficShaper* ts;
+        std::mutex lock;
+        std::condition_variable cv;
+        uint32_t ready;
+        bool opened;
+        // Set when the server stops before the test started
         bool shuttingDown;
+
+        // Called by a driver once it is connected; blocks until the gate opens.
+        // False if it was shut down instead.
+        bool arrive();
+        // Called by a driver that could not connect, nobody waits for it
+        void withdraw();
+        void waitReady(uint32_t count);
+        void open();
+        void shutDown();
+
+        StartGate();
+    };
+
+    // A driver's byte counts and when they were read
+    struct ByteMark
+    {
+        uint64_t bytes;
+        uint64_t recvBytes;
+        monotime_t time;
+    };
+
+    // How a driver sets its connection up and what it sends, apart from
+    // where it connects to
+    struct DriverConfig
+    {
+        ts::TSDescriptor tsd;
+        MsgSize msgSize;
+        // 0 leaves the system default
+        uint32_t sndBufSize;
+        StartGate* gate;
+        // Non-zero when the driver is part of a control session
+        uint32_t sessionId;
+        TrafficMode mode;
+        Transport transport;
+        // Binds the connection to one of its addresses, if set
+        SourcePool* sources;
+        // The congestion control algorithm, empty for the system default
+        std::string congestion;
+        // Replays this flow of the trace, if set
+        const ReplayTrace* replay;
+        uint32_t replayFlow;
+        // tcp::TimestampFlags, 0 for none
+        uint32_t timestamping;
+        uint32_t busyPollUs;
+        Framing framing;
+        bool zeroCopy;
+
+        DriverConfig();
+    };
+
+    struct TrafficDriver : public TrafficEnabler
+    {
+        const uint32_t index;
+        const TrafficMode mode;
+        const Transport transport;
+        const ts::TSDescriptor tsd;
+        StartGate* gate;
+        // Non-zero when the driver is part of a control session
+        const uint32_t sessionId;
+        // The local address the connection is accounted to, if it came from
+        // a SourcePool
+        Source* source;
+        bool connectFailed;
+        // The congestion control algorithm, empty for the system default, and
+        // the segments it had to retransmit
+        const std::string congestion;
+        uint64_t retransmits;
+        // What the receiver measured, filled in from the control session
+        bool peerValid;
+        uint64_t peerBytes;
+        double peerDurationSec;
+        // Bounds of the steady-state window, between warm-up and cool-down
+        ByteMark steadyStart;
+        ByteMark steadyEnd;
+        // Forward mode: sends the messages of this flow of the trace, at
+        // their recorded times, instead of msgSize ones. NULL if not replaying.
+        const ReplayTrace* replay;
+        uint32_t replayFlow;
+        // How much later than recorded every message went out, in ns
+        stats::Histogram replayLateness;
+        uint64_t replayMsgs;
+        // Got to the end of the flow before the test ended
+        bool replayDone;
+        // tcp::TimestampFlags of the data connection, 0 for none
+        uint32_t timestamping;
+        // Spin budget of the receive loop, see TrafficEnabler
+        uint32_t busyPollUs;
+        // Reverse and bidirectional mode: map the data in
+        bool zeroCopy;
         std::thread driverThread;
 
         virtual void doSetupAndStart();
-        void startTraffic();
+        void setupConnection();
+        void replayTraffic();
+        void recvTraffic();
         void stopTraffic();
+        uint64_t peerGoodput() const;
+        void mark(ByteMark& byteMark) const;
+        uint64_t steadyBytes() const;
+        uint64_t steadyRecvBytes() const;
+        double steadySec() const;
+        uint64_t steadyThroughput() const;
+        uint64_t steadyRecvThroughput() const;
 
-        TrafficDriver(const std::string& name, const ip::sockaddr& laddr,
-                      const ip::sockaddr& raddr, const ts::TSDescriptor& tsd,
-                      const MsgSize msgSize = large,
-                      const uint32_t sndBufSize = 0);
+        TrafficDriver(const std::string& name, const uint32_t index,
+                      const ip::sockaddr& laddr, const ip::sockaddr& raddr,
+                      const DriverConfig& config);
         virtual ~TrafficDriver();
+
+    protected:
+        // For drivers that bring their own socket and start their own thread
+        TrafficDriver(const std::string& name, const uint32_t index,
+                      tcp::Socket* sock, const ip::sockaddr& raddr,
+                      const DriverConfig& config);
+    };
+
+    // Latency probes measure the round trip of small request/response
+    // exchanges on their own connections, next to the bulk traffic
+    struct ProbeConfig
+    {
+        uint16_t numProbes;
+        uint64_t intervalUs;
+        // How long to probe the idle path before the bulk traffic starts
+        uint64_t baselineSec;
+        uint8_t dscp;
+        // Socket options of the probe connections, 0 leaves them alone
+        uint32_t priority;
+        uint32_t notSentLowat;
+    };
+
+    // Which histogram a probe records into
+    enum ProbePhase
+    {
+        probeBaseline,
+        probeLoaded,
+        probeIdle,
+    };
+
+    struct LatencyProbe : public TrafficEnabler
+    {
+        const ProbeConfig config;
+        const Transport transport;
+        // Spins for the responses, see TrafficEnabler
+        const uint32_t busyPollUs;
+        std::atomic<uint32_t> phase;
+        stats::Histogram baselineRTT;
+        stats::Histogram loadedRTT;
+        std::thread probeThread;
+
+        virtual void doSetupAndStart();
+        void probeTraffic();
+        void stopTraffic();
+
+        LatencyProbe(const std::string& name, const ip::sockaddr& laddr,
+                     const ip::sockaddr& raddr, const ProbeConfig& config,
+                     const Transport transport = transportTCP,
+                     const uint32_t busyPollUs = 0);
+        virtual ~LatencyProbe();
     };
 
     struct TrafficServer : public TrafficEnabler
     {
-#ifdef __linux__
-        struct pollfd fds[2];
-        int efd;
-#elif __APPLE__
-        int kq;
-        int pfd[2];
-        struct kevent *event;
-        struct kevent *tevent;
-#endif
-        uint64_t bytesReceived;
+        // Owned by ServerApp: the connection table slot and the link in the
+        // completion queue
+        uint32_t slot;
+        TrafficServer* nextCompleted;
+        // Set from the Hello of clients that speak the control protocol
+        uint32_t connType;
+        uint32_t sessionId;
+        uint32_t connIndex;
+        TrafficMode mode;
+        // tcp::TimestampFlags, set by ServerApp before start()
+        uint32_t timestamping;
+        // Spin budget of the receive loop, set by ServerApp before start()
+        uint32_t busyPollUs;
+        // Map the data in, set by ServerApp before start()
+        bool zeroCopy;
+        // The session's, set from the data Hello. The send loop waits for it
+        // so it starts together with the client's receive loop.
+        std::shared_ptr<StartGate> startGate;
         funcTS_t cb;
-        bool shuttingDown;
+        funcHello_t helloCb;
+        bool closed;
         std::thread serverThread;
-        systime_t startTime;
 
         virtual void doSetupAndStart();
-        void recvBlock(void* rbuf, size_t buflen);
         void recvTraffic();
+        void setupSender(const ctrl::Hello& hello);
+        void setupTransport(const ctrl::Hello& hello);
+        void echoProbes(const ctrl::Hello& hello);
+        void start();
+        void stopTraffic();
         void printStats();
 
         TrafficServer(const std::string& name, const int fd,
                       const ip::sockaddr& laddr, const ip::sockaddr& raddr,
-                      funcTS_t cb);
+                      funcTS_t cb, funcHello_t helloCb = NULL);
         virtual ~TrafficServer();
+
+    protected:
+        virtual void senderMain();
     };
 };
 #endif /* __TRAFFIC_H */
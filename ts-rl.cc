@@ -1,4 +1,5 @@
 #include "ts-rl.h"
+#include "trace.h"
 
 #include <stdexcept>
 #include <thread>
@@ -14,7 +15,7 @@ ts::RateLimiter::RateLimiter(const ts::TSDescriptor& tsd) :
     uint64_t rate = strtou64(tsd.args);
     capacity = rate / (8 * SEC_EPOCH_CONV);
     availCapacity = capacity;
-    nextReplenishTime = chrono::high_resolution_clock::now();
+    nextReplenishTime = tsc::FastClock::now();
     timeInterval = chrono::microseconds(TIME_EPOCH_US);
 }
 
@@ -28,17 +29,20 @@ ts::RateLimiter::isReady()
     //An approximation - we replenish only when we don't have capacity
     if (!availCapacity)
     {
-        hrsystime_t currTime = chrono::high_resolution_clock::now();
+        monotime_t currTime = tsc::FastClock::now();
         if (currTime < nextReplenishTime)
         {
             //TODO: Improve this - make this asynchronous instead of blocking
             // This works for now as every Traffic Driver would run in its own
             // thread
             chrono::nanoseconds diff = nextReplenishTime - currTime;
+            TRACE(trace::shaperSleep, diff.count());
             this_thread::sleep_for(diff);
+            TRACE(trace::shaperWake, 0);
+            waitNs += diff.count();
         }
         availCapacity = capacity;
-        nextReplenishTime = chrono::high_resolution_clock::now() + timeInterval;
+        nextReplenishTime = tsc::FastClock::now() + timeInterval;
     }
     return true;
 }
@@ -5,7 +5,8 @@
 static std::list<ts::TSProvider *> providers;
 
 ts::TrafficShaper::TrafficShaper(const ts::TSDescriptor& tsd) :
-    tsd(tsd)
+    tsd(tsd),
+    waitNs(0)
 {
 }
 
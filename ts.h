@@ -1,6 +1,7 @@
 #ifndef __TS_H
 #define __TS_H
 
+#include <cstdint>
 #include <string>
 
 namespace ts
@@ -14,6 +15,8 @@ namespace ts
     struct TrafficShaper
     {
         const TSDescriptor tsd;
+        // Time spent holding the caller back, for shapers that block
+        uint64_t waitNs;
 
         virtual bool isReady() = 0;
 		virtual uint64_t avail() = 0;
@@ -0,0 +1,80 @@
+#include "tsc.h"
+
+#ifdef TSC_AVAILABLE
+#include <cpuid.h>
+#endif
+
+using namespace std;
+
+// Calibrated before main(), so every thread sees the same rate
+tsc::Clock tsc::clock;
+
+#ifdef TSC_AVAILABLE
+// Both clocks at the same time, or as close as two steady_clock reads around
+// the TSC read get
+static void
+tsc_sample(uint64_t& ns, uint64_t& ticks)
+{
+    uint64_t before = tsc::Clock::steadyNs();
+    ticks = __rdtsc();
+    uint64_t after = tsc::Clock::steadyNs();
+    ns = before + (after - before) / 2;
+}
+#endif
+
+tsc::Clock::Clock() :
+    useTSC(false),
+    tscBase(0),
+    nsBase(0),
+    mult(0),
+    tscHz(0)
+{
+    calibrate();
+}
+
+// CPUID leaf 0x80000007, EDX bit 8
+bool
+tsc::Clock::invariantTSC()
+{
+#ifdef TSC_AVAILABLE
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007)
+        return false;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+        return false;
+    return edx & (1 << 8);
+#else
+    return false;
+#endif
+}
+
+// Counts the ticks over TSC_CALIBRATE_MS of steady_clock. The rate is off by
+// a few ppm at most, which the shapers and the samplers do not notice.
+void
+tsc::Clock::calibrate()
+{
+    useTSC = false;
+#ifdef TSC_AVAILABLE
+    if (!invariantTSC())
+        return;
+
+    uint64_t ns0, ticks0, ns1, ticks1;
+    tsc_sample(ns0, ticks0);
+    do
+    {
+        tsc_sample(ns1, ticks1);
+    } while (ns1 - ns0 < TSC_CALIBRATE_MS * 1000000ULL);
+
+    if (ticks1 <= ticks0)
+        return;
+    tscHz = (double) (ticks1 - ticks0) * 1e9 / (ns1 - ns0);
+    // Anything slower would make the clock coarser than steady_clock
+    if (tscHz < 1e8)
+        return;
+
+    mult = ((ns1 - ns0) << 32) / (ticks1 - ticks0);
+    tscBase = ticks1;
+    nsBase = ns1;
+    useTSC = true;
+#endif
+}
@@ -0,0 +1,87 @@
+#ifndef __TSC_H
+#define __TSC_H
+
+#include <chrono>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TSC_AVAILABLE 1
+#endif
+
+// A monotonic clock for the hot paths. Where the CPU has an invariant TSC,
+// one that ticks at a constant rate through frequency changes and idle
+// states, it is read with rdtsc and scaled to ns, which costs a fraction of
+// a clock_gettime() call. Everywhere else it falls back to steady_clock.
+// Either way the time is in ns since the steady_clock epoch, so the two can
+// be compared.
+namespace tsc
+{
+// How long the TSC is measured against steady_clock to get its rate
+#define TSC_CALIBRATE_MS 10
+
+    struct Clock
+    {
+        bool useTSC;
+        // A reading of both clocks at the same time
+        uint64_t tscBase;
+        uint64_t nsBase;
+        // ns per tick, in 32.32 fixed point
+        uint64_t mult;
+        double tscHz;
+
+        void calibrate();
+        uint64_t nowNs() const;
+
+        static uint64_t steadyNs();
+        static bool invariantTSC();
+
+        Clock();
+    };
+
+    extern Clock clock;
+
+    inline uint64_t
+    Clock::steadyNs()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    inline uint64_t
+    Clock::nowNs() const
+    {
+#ifdef TSC_AVAILABLE
+        if (useTSC)
+        {
+            // 128 bits, so the product does not overflow after a few seconds
+            uint64_t ticks = __rdtsc() - tscBase;
+            return nsBase + (uint64_t) (((unsigned __int128) ticks * mult) >> 32);
+        }
+#endif
+        return steadyNs();
+    }
+
+    inline uint64_t
+    nowNs()
+    {
+        return clock.nowNs();
+    }
+
+    // The same clock for std::chrono time points and durations
+    struct FastClock
+    {
+        typedef std::chrono::nanoseconds duration;
+        typedef duration::rep rep;
+        typedef duration::period period;
+        typedef std::chrono::time_point<FastClock> time_point;
+        static const bool is_steady = true;
+
+        static time_point now()
+        {
+            return time_point(duration(clock.nowNs()));
+        }
+    };
+}
+
+#endif /* __TSC_H */
@@ -0,0 +1,149 @@
+#include "tstamp.h"
+#include "helper.h"
+
+#include <sstream>
+#include <stdexcept>
+
+using namespace std;
+
+const app::TimestampStage app::timestampStages[TSTAMP_STAGES] =
+{
+    {"sndbuf", "Socket buffer", &app::TimestampStats::sndBuf},
+    {"qdisc", "Qdisc and driver", &app::TimestampStats::qdisc},
+    {"tx_nic", "Sender NIC", &app::TimestampStats::txNic},
+    {"ack", "Until acked", &app::TimestampStats::ack},
+    {"rx_nic", "Receiver NIC", &app::TimestampStats::rxNic},
+    {"rx_app", "Receiver stack to app", &app::TimestampStats::rxApp},
+};
+
+// Clock steps can put a stamp before the one it follows
+static uint64_t
+tstamp_diff(uint64_t later, uint64_t earlier)
+{
+    return (later > earlier) ? later - earlier : 0;
+}
+
+// Keys wrap around after 4GB
+static bool
+tstamp_before(uint32_t a, uint32_t b)
+{
+    return (int32_t) (a - b) < 0;
+}
+
+void
+app::TimestampStats::merge(const app::TimestampStats& other)
+{
+    for (auto& stage : timestampStages)
+        (this->*stage.hist).merge(other.*stage.hist);
+}
+
+string
+app::TimestampStats::toString(const string& indent) const
+{
+    stringstream str;
+    str.precision(4);
+    for (auto& stage : timestampStages)
+    {
+        const stats::Histogram& hist = this->*stage.hist;
+        if (!hist.count)
+            continue;
+        str << indent << stage.desc << ": " << hist.count << " samples, p50 "
+            << hist.percentile(50) / 1e3 << " us, p99 "
+            << hist.percentile(99) / 1e3 << " us, max "
+            << hist.percentile(100) / 1e3 << " us\n";
+    }
+    return str.str();
+}
+
+uint32_t
+app::parseTimestamping(const string& str)
+{
+    if (str == "sw")
+        return tcp::tsTx | tcp::tsRx;
+    if (str == "hw")
+        return tcp::tsTx | tcp::tsRx | tcp::tsHardware;
+    throw std::invalid_argument(ERRSTR("Timestamping is sw or hw"));
+}
+
+app::Timestamper::Timestamper() :
+    txBytes(0)
+{
+}
+
+void
+app::Timestamper::sent(uint64_t len)
+{
+    uint32_t key = txBytes + len - 1;
+    txBytes += len;
+    if (pending.size() < TSTAMP_MAX_PENDING)
+        pending.push_back({key, tcp::timestampNowNs(), 0, 0});
+}
+
+void
+app::Timestamper::skip(uint64_t len)
+{
+    txBytes += len;
+}
+
+void
+app::Timestamper::readTx(tcp::Socket* sock)
+{
+    tcp::TxTimestamp stamps[TSTAMP_BATCH];
+    int n;
+    do
+    {
+        n = sock->readTxTimestamps(stamps, TSTAMP_BATCH);
+        for (int i = 0; i < n; i++)
+            stamped(stamps[i]);
+    } while (n == TSTAMP_BATCH);
+}
+
+// The stages of a send are stamped in order, and the sends are acked in
+// order. An ack also settles the sends before it whose stamps were lost,
+// e.g. to a full error queue.
+void
+app::Timestamper::stamped(const tcp::TxTimestamp& ts)
+{
+    auto it = pending.begin();
+    while (it != pending.end() && tstamp_before(it->key, ts.key))
+        it++;
+    if (it == pending.end() || it->key != ts.key)
+        return;
+
+    switch (ts.stage)
+    {
+    case tcp::txSched:
+        it->schedNs = ts.ns;
+        stats.sndBuf.add(tstamp_diff(ts.ns, it->sendNs));
+        break;
+    case tcp::txSnd:
+        // The NIC's stamp comes on its own, after the software one
+        if (ts.ns)
+        {
+            it->sndNs = ts.ns;
+            if (it->schedNs)
+                stats.qdisc.add(tstamp_diff(ts.ns, it->schedNs));
+        }
+        if (ts.hwNs && it->sndNs)
+            stats.txNic.add(tstamp_diff(ts.hwNs, it->sndNs));
+        break;
+    case tcp::txAck:
+        if (it->sndNs)
+            stats.ack.add(tstamp_diff(ts.ns, it->sndNs));
+        pending.erase(pending.begin(), it + 1);
+        break;
+    }
+}
+
+void
+app::Timestamper::received(uint64_t ns, uint64_t hwNs)
+{
+    if (!ns && !hwNs)
+        return;
+
+    uint64_t now = tcp::timestampNowNs();
+    if (ns)
+        stats.rxApp.add(tstamp_diff(now, ns));
+    if (ns && hwNs)
+        stats.rxNic.add(tstamp_diff(ns, hwNs));
+}
@@ -0,0 +1,89 @@
+#ifndef __TSTAMP_H
+#define __TSTAMP_H
+
+#include "tcp.h"
+#include "stats.h"
+
+#include <cstdint>
+#include <deque>
+#include <string>
+
+namespace app
+{
+// Sends waiting for their stamps. Beyond that, new sends are not followed.
+#define TSTAMP_MAX_PENDING 4096
+// Stamps read from the error queue at a time
+#define TSTAMP_BATCH       64
+#define TSTAMP_STAGES      6
+
+    // Where the time goes between send() and the peer's recv(), from the
+    // kernel's timestamps, in ns. The NIC's stamps only compare with the
+    // kernel's if its clock is kept in sync with the system clock, e.g. by
+    // phc2sys.
+    struct TimestampStats
+    {
+        // Sender: in the socket buffer, until the qdisc took the last byte
+        stats::Histogram sndBuf;
+        // Sender: in the qdisc and the driver, until handed to the NIC
+        stats::Histogram qdisc;
+        // Sender: on the wire and at the receiver, until acked
+        stats::Histogram ack;
+        // Sender: in the NIC, until it stamped the send
+        stats::Histogram txNic;
+        // Receiver: from the NIC's stamp to the stack's
+        stats::Histogram rxNic;
+        // Receiver: from the stack to recv() returning
+        stats::Histogram rxApp;
+
+        void merge(const TimestampStats& other);
+        // A line per stage that has samples
+        std::string toString(const std::string& indent) const;
+    };
+
+    struct TimestampStage
+    {
+        const char* name;
+        const char* desc;
+        stats::Histogram TimestampStats::* hist;
+    };
+
+    // In the order the data goes through them
+    extern const TimestampStage timestampStages[TSTAMP_STAGES];
+
+    // "sw" for the kernel's stamps, "hw" for the NIC's too
+    uint32_t parseTimestamping(const std::string& str);
+
+    // Follows the stamps of one connection. The send side is only used by
+    // the thread that sends, the receive side by the one that receives.
+    struct Timestamper
+    {
+        struct PendingSend
+        {
+            uint32_t key;
+            uint64_t sendNs;
+            uint64_t schedNs;
+            uint64_t sndNs;
+        };
+
+        TimestampStats stats;
+        std::deque<PendingSend> pending;
+        // Bytes sent since stamping was turned on, the keys count them
+        uint32_t txBytes;
+
+        // Right before sending len bytes
+        void sent(uint64_t len);
+        // Bytes sent that are not followed
+        void skip(uint64_t len);
+        // Drains the error queue
+        void readTx(tcp::Socket* sock);
+        // After a recv() that returned the stamps
+        void received(uint64_t ns, uint64_t hwNs);
+
+        Timestamper();
+
+    protected:
+        void stamped(const tcp::TxTimestamp& ts);
+    };
+}
+
+#endif /* __TSTAMP_H */
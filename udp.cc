@@ -0,0 +1,110 @@
+#include "udp.h"
+#include "helper.h"
+
+#include <unistd.h>
+#include <stdexcept>
+#include <string.h>
+
+udp::Socket::Socket(const int fd, const ip::sockaddr& addr) :
+    ip::Socket(fd, addr)
+{
+}
+
+udp::Socket::Socket(const ip::sockaddr& addr) :
+    ip::Socket(addr, SOCK_DGRAM)
+{
+}
+
+void
+udp::Socket::connect(const ip::sockaddr& addr)
+{
+    if (::connect(fd, &addr.sa, addr.sa_len) == -1)
+        throw std::runtime_error(ERRSTR("Error during connect"));
+}
+
+void
+udp::Socket::sendBatch(struct mmsghdr* msgs, unsigned int vlen)
+{
+    while (vlen)
+    {
+#ifdef __linux__
+        int rc = ::sendmmsg(fd, msgs, vlen, 0);
+#else
+        int rc = ::sendmsg(fd, &msgs->msg_hdr, 0);
+        if (rc >= 0)
+        {
+            msgs->msg_len = rc;
+            rc = 1;
+        }
+#endif
+        if (rc < 0)
+        {
+            // ENOBUFS: the device queue is full, which is what we're after
+            if (errno == EINTR || errno == EAGAIN || errno == ENOBUFS)
+                continue;
+            throw std::runtime_error(ERRSTR("Error while sending datagrams"));
+        }
+
+        msgs += rc;
+        vlen -= rc;
+    }
+}
+
+int
+udp::Socket::recvBatch(struct mmsghdr* msgs, unsigned int vlen)
+{
+#ifdef __linux__
+    return ::recvmmsg(fd, msgs, vlen, MSG_WAITFORONE, NULL);
+#else
+    int rc = ::recvmsg(fd, &msgs->msg_hdr, 0);
+    if (rc < 0)
+        return rc;
+
+    msgs->msg_len = rc;
+    return 1;
+#endif
+}
+
+void
+udp::Socket::setSegmentSize(uint16_t size)
+{
+#ifdef __linux__
+    int val = size;
+    int ret = ::setsockopt(fd, SOL_UDP, UDP_SEGMENT, &val, sizeof(val));
+    if (ret == -1)
+        throw std::runtime_error(ERRSTR("Error setting UDP segment size"));
+#else
+    throw std::runtime_error(ERRSTR("Not supported"));
+#endif
+}
+
+void
+udp::Socket::setGRO(bool enabled)
+{
+#ifdef __linux__
+    int val = enabled;
+    int ret = ::setsockopt(fd, SOL_UDP, UDP_GRO, &val, sizeof(val));
+    if (ret == -1)
+        throw std::runtime_error(ERRSTR("Error setting UDP GRO"));
+#else
+    throw std::runtime_error(ERRSTR("Not supported"));
+#endif
+}
+
+uint16_t
+udp::Socket::groSize(const struct msghdr* msg)
+{
+#ifdef __linux__
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg); cmsg;
+         cmsg = CMSG_NXTHDR((struct msghdr *) msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+        {
+            int size;
+            memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+            return size;
+        }
+    }
+#endif
+    return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef __UDP_H
+#define __UDP_H
+
+#include "ip.h"
+#include <netinet/udp.h>
+#include <sys/socket.h>
+
+#ifndef __linux__
+// Batches are sent and received one message at a time elsewhere
+struct mmsghdr
+{
+    struct msghdr msg_hdr;
+    unsigned int  msg_len;
+};
+#endif
+
+namespace udp
+{
+// Largest payload of an IPv4 UDP datagram
+#define UDP_MAX_DATAGRAM 65507
+// Most segments the kernel takes in a single UDP_SEGMENT send
+#define UDP_MAX_SEGMENTS 64
+
+    struct Socket : public ip::Socket
+    {
+        void connect(const ip::sockaddr& addr);
+
+        // Sends every message of the batch, retrying partial sends
+        void sendBatch(struct mmsghdr* msgs, unsigned int vlen);
+        // Returns the number of messages received, -1 with errno set if none
+        // were, e.g. on a receive timeout
+        int recvBatch(struct mmsghdr* msgs, unsigned int vlen);
+
+        // Kernel segmentation of large sends into datagrams of size bytes
+        void setSegmentSize(uint16_t size);
+        // Lets the kernel coalesce received datagrams, see groSize()
+        void setGRO(bool enabled);
+        // Segment size of a coalesced message, 0 if it is a single datagram
+        static uint16_t groSize(const struct msghdr* msg);
+
+        Socket(const int fd, const ip::sockaddr& addr);
+        Socket(const ip::sockaddr& addr);
+
+        virtual ~Socket() {}
+    };
+}
+
+#endif /* __UDP_H */